@@ -15,6 +15,7 @@
 
 
 #include "CMRI.h"
+#include "CMRIRing.h"
 
 #define ATTN 0xFF
 #define STX  0x02
@@ -33,6 +34,34 @@
  */
 #define STRICT_PROTOCOL_CHECKING false
 
+/*
+ * define this (as the address byte as it appears on the wire) if messages
+ * sent to a broadcast address should be parsed rather than skipped, for
+ * use by an extension of the protocol.  There is no such address in the
+ * protocol as published.
+ */
+// #define CMRI_BROADCAST_ADDR 0
+
+/*
+ * time a call to a user handler, for the metrics (if they are enabled)
+ */
+#if CMRI_METRICS
+#define HANDLER_TIMER_START(t) unsigned long t = micros()
+#define HANDLER_TIMER_STOP(t) addToHistogram(handlerTime, micros() - (t))
+#else
+#define HANDLER_TIMER_START(t)
+#define HANDLER_TIMER_STOP(t)
+#endif
+
+/*
+ * record an event in the trace buffer (if tracing is compiled in)
+ */
+#if CMRI_TRACE_SIZE > 0
+#define TRACE(event, a, b, c) trace(event, a, b, c)
+#else
+#define TRACE(event, a, b, c)
+#endif
+
 /******************************************************************************
  *
  * These are the PUBLIC methods of the CMRI object 
@@ -41,193 +70,1959 @@
  */
 
 /*
- * Create a CMRI protocol parser object.  The required arguments are a Stream object,
- * typically a serial port such as Serial or Serial1, and the node identifier (the
- * value one would set by the address DIP switches on the SUSIC or SMINI). 
+ * Create a CMRI protocol parser object.  The required arguments are a Stream object,
+ * typically a serial port such as Serial or Serial1, and the node identifier (the
+ * value one would set by the address DIP switches on the SUSIC or SMINI). 
+ *
+ * The nodeId value should range between 0 and 127.
+ *
+ */
+
+CMRI::CMRI(Stream & s, uint8_t n):
+node(n), stream(s)
+{
+    init();
+
+    // without these buffers, every message is too long, so nothing is
+    // answered (rather than writing through a NULL pointer)
+    buf = (uint8_t *) malloc(MAX_MESG_LEN);
+    bufSize = buf ? MAX_MESG_LEN : 0;
+    txBuf = (uint8_t *) malloc(MAX_FRAME_LEN);
+    txBufSize = txBuf ? MAX_FRAME_LEN : 0;
+}
+
+
+/*
+ * Create a CMRI object that uses storage provided by the caller for its
+ * message buffers and the line models of its node, rather than allocating
+ * them.  All of it is cleared here.  This is used by the CMRIStatic
+ * template.
+ */
+
+CMRI::CMRI(Stream & s, uint8_t n, uint8_t * mesgStore, uint16_t mesgSize,
+           uint8_t * frameStore, uint16_t frameSize, uint8_t * inputStore, uint16_t inputLines,
+           uint8_t * outputStore, uint16_t outputLines):
+node(n, inputStore, inputLines, outputStore, outputLines), stream(s)
+{
+    init();
+
+    memset(mesgStore, 0, mesgSize);
+    memset(frameStore, 0, frameSize);
+
+    buf = mesgStore;
+    bufSize = mesgSize;
+    txBuf = frameStore;
+    txBufSize = frameSize;
+}
+
+
+/*
+ * The state common to both constructors
+ */
+
+void CMRI::init()
+{
+    messageLength = 0;
+    currentState = START;
+    debug = NULL;
+    tickCount = 0;
+    charCount = 0;
+    messagesSeen = 0;
+    messagesProcessed = 0;
+    errorCount = 0;
+#if CMRI_METRICS
+    resetMetrics();
+#endif
+#if CMRI_TRACE_SIZE > 0
+    traceHead = 0;
+    traceCount = 0;
+    traceDropped = 0;
+    traceMask = (uint8_t) ~(1 << TRACE_STATE);
+    traceStream = NULL;
+#endif
+    bytesSkipped = 0;
+    framesSkipped = 0;
+    skipStart = 0;
+    nodes[0] = &node;
+    numNodes = 1;
+#if CMRI_MAX_NODES > 1
+    memset(nodeIndex, 0, sizeof(nodeIndex));
+    uint8_t slot = node.nodeId - 65;
+
+    if (slot < 128) {
+        nodeIndex[slot] = 1;
+    }
+#endif
+    currentNode = NULL;
+    memset(messageHandlers, 0, sizeof(messageHandlers));
+    txLength = 0;
+    txSent = 0;
+    replyNode = NULL;
+    replyLength = 0;
+    replyModelBytes = 0;
+    replyFrameLength = 0;
+    replyEscapes = 0;
+    nonBlockingTransmit = false;
+    monitor = false;
+    processing = false;
+    ring = NULL;
+    owner = NULL;
+    nextStream = NULL;
+    firstStream = NULL;
+    txScheduled = false;
+    txReply = false;
+    txDelay = 0;
+    transmitEnablePin = -1;
+    transmitEnableHandler = NULL;
+    transmitIdleHandler = NULL;
+    transmitEnabled = false;
+    txRoomWhenEmpty = 0;
+    etxMicros = 0;
+    enableMicros = 0;
+    lastWriteMicros = 0;
+    memset(&timing, 0, sizeof(timing));
+    outputNode = NULL;
+    outputsPending = false;
+    outputsChanged = false;
+    outputCursor = 0;
+    outputTail = 0;
+    changeBase = 0;
+    changeMask = 0;
+    streamingOutputs = false;
+    stage = NULL;
+    stageNode = NULL;
+    stageGeneration = 0;
+    stageFirst = 0;
+    stageEnd = 0;
+}
+
+
+/*
+ * Perform the next bit of processing on a CMRI protocol stream.  This
+ * should be called frequently; ideally once per iteration of the Arduino
+ * loop() method.  
+ *
+ * Because this method does not block, processing of other functions may
+ * occur inside the loop() method.
+ *
+ * All of the characters that are currently available are processed, as
+ * are all of the output changes that result from them.  Use the budgeted
+ * form of check() to put a bound on the time spent here.
+ */
+
+void CMRI::check()
+{
+    check(0, 0);
+}
+
+
+/*
+ * Perform a limited amount of CMRI processing.
+ *
+ * At most maxBytes characters are read from the stream, and at most
+ * maxMicros microseconds are spent (a value of 0 means no limit for
+ * either).  Each output line change that has to be handed to the
+ * perLineOutputHandler counts against the byte budget as well, so a long
+ * 'T' message is applied over several calls rather than all at once.
+ *
+ * The time budget is checked before each unit of work, so a single slow
+ * handler callback can still overrun it by the length of that callback.
+ * A step of the background input scan (see setInputScan) is taken first
+ * when one is due.  It counts against the time budget, but not against
+ * maxBytes, so even check(1) reads a character every call.
+ *
+ * Parser state is kept between calls.  While the outputs of a 'T' message
+ * are still being applied, or a reply is still being transmitted, no more
+ * characters are read from the stream (they wait in the serial receive
+ * buffer, or the receive ring).
+ *
+ * Returns true if there is still work pending (characters available,
+ * outputs not yet applied or a reply not completely written), false if
+ * everything has been done.
+ */
+
+bool CMRI::check(uint16_t maxBytes, unsigned long maxMicros)
+{
+    if (owner != NULL) {
+        // the first CMRI object serves all of the streams
+        return owner->check(maxBytes, maxMicros);
+    }
+
+    unsigned long start = (maxMicros || CMRI_METRICS) ? micros() : 0;
+    uint16_t work = 0;
+    bool pending;
+
+    tickCount += 1;
+
+    if (!outputsPending) {
+        for (uint8_t i = 0; i < numNodes; i++) {
+            if (nodes[i]->scanEnabled) {
+                nodes[i]->scanNextInputs();
+            }
+            if (nodes[i]->effects != NULL) {
+                nodes[i]->runEffects();
+            }
+        }
+    }
+
+    if (nextStream == NULL) {
+        pending = serve(maxBytes, maxMicros, start, work);
+    } else {
+        pending = serveStreams(maxBytes, maxMicros, start, work);
+    }
+
+#if CMRI_METRICS
+    unsigned long elapsed = micros() - start;
+    if (elapsed > maxCheckMicros) {
+        maxCheckMicros = elapsed;
+    }
+#endif
+
+    return pending;
+}
+
+
+/*
+ * Serve every stream (see addStream) in turn, each taking at most
+ * CMRI_STREAM_QUANTUM units of work before the next one gets its turn,
+ * until none has anything left to do or the budget is spent.  Each
+ * call starts with the stream after the one the last call started with,
+ * so that with a small budget none always goes first.
+ */
+
+bool CMRI::serveStreams(uint16_t maxBytes, unsigned long maxMicros, unsigned long start,
+                        uint16_t & work)
+{
+    CMRI *first = firstStream ? firstStream : this;
+    bool pending;
+
+    firstStream = first->nextStream;
+
+    for (;;) {
+        uint16_t roundStart = work;
+        CMRI *s = first;
+
+        pending = false;
+        do {
+            uint16_t limit = work + CMRI_STREAM_QUANTUM;
+
+            if (maxBytes && limit > maxBytes) {
+                limit = maxBytes;
+            }
+            if (limit > work) {
+                pending |= s->serve(limit, maxMicros, start, work);
+            } else {
+                pending = true;
+            }
+            s = s->nextStream ? s->nextStream : this;
+        } while (s != first);
+
+        if (work == roundStart || (maxBytes && work >= maxBytes)
+            || (maxMicros && (micros() - start) >= maxMicros)) {
+            return pending;
+        }
+    }
+}
+
+
+/*
+ * Do what there is to do on this object's stream: apply outputs, send a
+ * reply, or read characters, until the work count reaches maxBytes or
+ * maxMicros have passed since start (0 for no limit).  Returns true if
+ * there is still work pending.
+ */
+
+bool CMRI::serve(uint16_t maxBytes, unsigned long maxMicros, unsigned long start,
+                 uint16_t & work)
+{
+    uint16_t taken;
+
+    for (;;) {
+        if (maxBytes && work >= maxBytes) {
+            break;
+        }
+        if (maxMicros && (micros() - start) >= maxMicros) {
+            break;
+        }
+
+        if (outputsPending) {
+            applyNextOutput();
+        } else if (txScheduled) {
+            if (micros() - etxMicros <= txDelay) {
+                // the host asked for a delay before the reply
+                break;
+            }
+            startTransmit();
+        } else if (txSent < txLength) {
+            if (drainTransmit() == 0) {
+                // the transmit buffer is full; try again next time
+                break;
+            }
+        } else if (transmitEnabled) {
+            if (!finishTransmit()) {
+                // the last bytes are still on their way out
+                break;
+            }
+        } else if (ring != NULL && (taken = readRing(maxBytes ? maxBytes - work : 0)) > 0) {
+            // a run of characters from the receive ring, all at once
+            work += taken - 1;
+        } else if (ring == NULL && stream.available() > 0) {
+            int b = stream.read();
+
+            if (b >= 0) {
+                nextChar((uint8_t) b);
+            } else {
+                if (debug) {
+                    debug->println("error reading from available stream");
+                }
+            }
+        } else {
+#if CMRI_TRACE_SIZE > 0
+            // nothing else to do, so this is the time to write the trace
+            drainTrace();
+#endif
+            break;
+        }
+
+        work += 1;
+    }
+
+    return outputsPending || txSent < txLength || transmitEnabled
+        || (ring != NULL ? ring->available() > 0 : stream.available() > 0);
+}
+
+
+/*
+ * The handler and line model settings for the node given to the
+ * constructor.  See the CMRINode methods of the same names, including
+ * what their return values mean.
+ */
+
+void CMRI::setInitHandler(bool(*initHandler) (uint8_t * data, int datalen))
+{
+    node.setInitHandler(initHandler);
+}
+
+const CMRINode::Config & CMRI::nodeConfig()
+{
+    return node.nodeConfig();
+}
+
+bool CMRI::setInputHandler(uint16_t numLines, bool(*inputHandler) (uint16_t line))
+{
+    if (debug) {
+        debug->println("inputHandler set");
+    }
+    return node.setInputHandler(numLines, inputHandler);
+}
+
+bool CMRI::setInputHandler(uint16_t numLines,
+                           void (*bulkInputHandler) (uint16_t firstLine, uint16_t numLines,
+                                                     uint8_t * data))
+{
+    if (debug) {
+        debug->println("bulkInputHandler set");
+    }
+    return node.setInputHandler(numLines, bulkInputHandler);
+}
+
+void CMRI::setInputScan(uint16_t linesPerStep, unsigned long intervalMicros)
+{
+    node.setInputScan(linesPerStep, intervalMicros);
+}
+
+unsigned long CMRI::inputSnapshotAge()
+{
+    return node.inputSnapshotAge();
+}
+
+bool CMRI::setInputDebounce(uint16_t firstLine, uint16_t numLines, uint8_t samples)
+{
+    return node.setInputDebounce(firstLine, numLines, samples);
+}
+
+bool CMRI::setOutputHandler(uint16_t numLines,
+                            void (*perLineOutputHandler) (uint16_t line, bool isOn),
+                            void (*overallOutputHandler) (uint16_t numOutputs, bool outputs[]))
+{
+    if (debug) {
+        debug->println("outputHandler set");
+    }
+    return node.setOutputHandler(numLines, perLineOutputHandler, overallOutputHandler);
+}
+
+bool CMRI::setOutputChangeHandler(uint16_t numLines,
+                                  void (*outputChangeHandler) (const CMRIOutputChange changes[],
+                                                               uint8_t count))
+{
+    return node.setOutputChangeHandler(numLines, outputChangeHandler);
+}
+
+bool CMRI::setOutputPorts(uint8_t numPorts, const uint8_t portMap[],
+                          void (*portOutputHandler) (uint8_t port, uint8_t mask, uint8_t bits))
+{
+    return node.setOutputPorts(numPorts, portMap, portOutputHandler);
+}
+
+bool CMRI::addOutputEffect(uint8_t effect, uint16_t controlLine, uint16_t firstLine,
+                           uint16_t numLines, uint16_t onMillis, uint16_t offMillis)
+{
+    return node.addOutputEffect(effect, controlLine, firstLine, numLines, onMillis, offMillis);
+}
+
+
+/*
+ * Serve an additional node address from this CMRI object, so that one
+ * board can appear as several C/MRI nodes on the network.  The node must
+ * outlive the CMRI object (a global is typical), and must have a node
+ * identifier that is not already in use here.
+ *
+ * Up to CMRI_MAX_NODES nodes (including the one given to the
+ * constructor) can be served.  Returns false if the node cannot be added.
+ */
+
+bool CMRI::addNode(CMRINode & n)
+{
+    if (owner != NULL) {
+        return owner->addNode(n);
+    }
+
+#if CMRI_MAX_NODES > 1
+    uint8_t slot = n.nodeId - 65;
+
+    if (numNodes >= CMRI_MAX_NODES || slot >= 128 || nodeIndex[slot] != 0) {
+        return false;
+    }
+
+    nodes[numNodes++] = &n;
+    nodeIndex[slot] = numNodes;
+
+    return true;
+#else
+    (void) n;
+    return false;
+#endif
+}
+
+
+/*
+ * Serve the nodes of this CMRI object on another stream as well, such as
+ * a second RS-485 segment or a USB link to a test bench.  The other CMRI
+ * object is created on that stream as usual (its own node is not used),
+ * and keeps its own parser and transmit state, so a reply goes out on
+ * the stream the poll came in on.  The nodes, their handlers, their
+ * line models and the message handlers are shared: configure them here,
+ * not there.  A message handler is handed the object the message came in
+ * on, so its sendMessage() goes out on that stream.  Monitor mode and the
+ * debug stream stay with each object, so one port can be watched on its
+ * own.
+ *
+ * check() on either object serves every stream in turn, a few characters
+ * at a time (see CMRI_STREAM_QUANTUM), so a busy bus cannot starve a
+ * quiet one.  Returns false if either object already takes part in
+ * another such group.
+ */
+
+bool CMRI::addStream(CMRI & other)
+{
+    if (&other == this || owner != NULL || other.owner != NULL || other.nextStream != NULL) {
+        return false;
+    }
+
+    CMRI **link = &nextStream;
+    while (*link != NULL) {
+        link = &(*link)->nextStream;
+    }
+    *link = &other;
+    other.owner = this;
+
+    return true;
+}
+
+
+/*
+ * Install a function to handle messages of the given type ('A' through
+ * 'Z'), for the extended CMRInet protocol as proposed by Catania &
+ * Neumann (2013), or any other extension.
+ *
+ * The handler is consulted before the library's own handling of the 'I',
+ * 'T' and 'P' messages, so it can also replace (or just watch) those.
+ * Use NULL to remove a handler.
+ */
+
+void CMRI::setMessageHandler(uint8_t type, CMRIMessageHandler handler)
+{
+    if (owner != NULL) {
+        owner->setMessageHandler(type, handler);
+        return;
+    }
+
+    if (type >= FIRST_HANDLER_TYPE && type < FIRST_HANDLER_TYPE + NUM_HANDLER_TYPES) {
+        messageHandlers[type - FIRST_HANDLER_TYPE] = handler;
+    }
+}
+
+
+/*
+ * In monitor mode, frames for every address are parsed (none are
+ * skipped) and handed to the message handlers, with the address they were
+ * sent to.  The library never answers on its own, not even for the node
+ * given to the constructor.  This is for bus monitors, and for the bus
+ * master (CMRIMaster), which listens for the replies of every node.
+ */
+
+void CMRI::setMonitorMode(bool monitor)
+{
+    this->monitor = monitor;
+}
+
+
+/*
+ * Read characters from a receive ring (see CMRIRing.h), filled by an
+ * interrupt handler or another thread, rather than from the stream, which
+ * is then only used for transmitting.  check() takes everything the ring
+ * holds in one piece at a time, through feed().  Use NULL to read from
+ * the stream again.
+ */
+
+void CMRI::setReceiveRing(CMRIRing * ring)
+{
+    this->ring = ring;
+}
+
+
+/*
+ * Feed the parser from the receive ring, up to maxBytes characters (0 for
+ * no limit).  Where the ring had to drop characters, the frame they were
+ * part of is thrown away.  Returns the number of characters taken, or 1
+ * for a loss dealt with; 0 if there was nothing to do.
+ */
+
+uint16_t CMRI::readRing(uint16_t maxBytes)
+{
+    if (ring->takeLoss()) {
+        changeState(error(ERROR_OVERRUN), 0);
+        return 1;
+    }
+
+    const uint8_t *span;
+    uint16_t n = ring->peek(span);
+
+    if (maxBytes && n > maxBytes) {
+        n = maxBytes;
+    }
+    if (n > 0) {
+        n = feed(span, n);
+        ring->consume(n);
+    }
+    return n;
+}
+
+
+/*
+ * Send a message with the given type and data.  The data is escaped and
+ * framed just as the 'R' response to a poll is, and goes out through the
+ * same transmit path (so non-blocking transmit and RS-485 transmit enable
+ * apply to it too).  Nothing is allocated; the data is encoded straight
+ * into the transmit buffer, and may be the data a message handler was
+ * given.
+ *
+ * From within a message handler, the message comes from the node that
+ * the handled message was addressed to; otherwise from the node given to
+ * the constructor.
+ *
+ * A reply to the host waits for the transmit delay given in the 'I'
+ * message, without blocking: it is sent by a later check().
+ *
+ * Returns false if the data is too long, or if the previous message has
+ * not been completely transmitted yet.
+ */
+
+bool CMRI::sendMessage(uint8_t type, const uint8_t * data, uint16_t dataLen)
+{
+    CMRINode *sender = processing && currentNode ? currentNode : owner ? &owner->node : &node;
+
+    return sendFrame(sender->nodeId, type, data, dataLen);
+}
+
+
+/*
+ * Send a frame with the given address byte (as it appears on the wire),
+ * type and data.  This is sendMessage() without the choice of sender,
+ * for a bus master (see CMRIMaster), which addresses the node it is
+ * talking to.
+ */
+
+bool CMRI::sendFrame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t dataLen)
+{
+    if (dataLen > maxMessageLength() || txSent < txLength || transmitEnabled) {
+        return false;
+    }
+
+    encodeFrame(address, type, data, dataLen);
+    queueFrame();
+
+    return true;
+}
+
+
+/*
+ * Escape and frame a message into the transmit buffer, which must have
+ * room for it
+ */
+
+void CMRI::encodeFrame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t dataLen)
+{
+    if (debug) {
+        printMessage("---- complete message being sent: address ", address, type, data,
+                     dataLen);
+    }
+
+    TRACE(TRACE_REPLY, address, type, dataLen > 255 ? 255 : dataLen);
+
+    uint8_t *p = txBuf;
+
+    *p++ = ATTN;
+    *p++ = ATTN;
+    *p++ = STX;
+
+    *p++ = address;
+    *p++ = type;
+
+    for (uint16_t i = 0; i < dataLen; i++) {
+        if (data[i] == ETX || data[i] == STX || data[i] == DLE) {
+            *p++ = DLE;
+        }
+        *p++ = data[i];
+    }
+
+    *p++ = ETX;
+
+    txLength = p - txBuf;
+    replyNode = NULL;
+}
+
+
+/*
+ * Send the frame in the transmit buffer: now, or once the transmit delay
+ * has passed
+ */
+
+void CMRI::queueFrame()
+{
+    txSent = 0;
+
+    // a reply waits for the transmit delay the host configured, which
+    // check() counts down
+    txReply = processing && currentNode != NULL;
+    txDelay = txReply ? currentNode->config.transmitDelay : 0;
+    if (txDelay > 0 && micros() - etxMicros <= txDelay) {
+        txScheduled = true;
+        return;
+    }
+
+    startTransmit();
+}
+
+
+/*
+ * Start sending the frame in the transmit buffer
+ */
+
+void CMRI::startTransmit()
+{
+    txScheduled = false;
+
+#if CMRI_METRICS
+    if (txReply) {
+        addToHistogram(replyLatency, micros() - etxMicros);
+    }
+#endif
+
+    beginTransmit();
+
+    if (nonBlockingTransmit) {
+        drainTransmit();
+    } else {
+        while (txSent < txLength) {
+            uint16_t written = stream.write(txBuf + txSent, txLength - txSent);
+
+            if (written == 0) {
+                // the stream gave up; what is left of the frame is lost
+                countError(ERROR_TRANSMIT);
+                txLength = txSent;
+                break;
+            }
+            txSent += written;
+        }
+        lastWriteMicros = micros();
+
+        if (transmitEnabled) {
+            while (!finishTransmit()) {
+                // wait for the last byte to leave
+            }
+        }
+    }
+}
+
+
+/*
+ * Normally a reply is written to the stream in one piece, which blocks
+ * until the stream has accepted all of it.  With non-blocking transmit,
+ * only as much as availableForWrite() says will fit is written at a time,
+ * and check() writes the rest as space becomes available.
+ *
+ * The stream must implement availableForWrite() (HardwareSerial does).
+ * Print's own version always says there is no room, and a reply would
+ * never go out, so non-blocking transmit is only turned on if the stream
+ * reports some room now; call this while nothing is being sent.  Returns
+ * false if transmit stays blocking.
+ */
+
+bool CMRI::setNonBlockingTransmit(bool nonBlocking)
+{
+    if (nonBlocking && stream.availableForWrite() <= 0) {
+        nonBlockingTransmit = false;
+        return false;
+    }
+
+    nonBlockingTransmit = nonBlocking;
+    return true;
+}
+
+
+/*
+ * Normally a 'T' message is compared to the output model once its ETX has
+ * arrived.  With streaming outputs, each byte of it is compared as soon as
+ * it has been received, and the changed bits are kept in a shadow of the
+ * message buffer; at the ETX, check() applies just those, as before.  A
+ * message that is not received intact changes nothing.  That spreads the
+ * comparing over the time the frame takes on the wire, so that little is
+ * left to do after it.
+ *
+ * This is set for each stream (see addStream) separately.  Returns false
+ * if there is no memory for the shadow buffer.
+ */
+
+bool CMRI::setStreamingOutputs(bool streaming)
+{
+    if (streaming && stage == NULL) {
+        stage = (uint8_t *) calloc(1, bufSize);
+        if (stage == NULL) {
+            return false;
+        }
+    }
+
+    streamingOutputs = streaming;
+    return true;
+}
+
+
+/*
+ * true once the last reply has been completely handed to the stream, and
+ * (when an RS-485 transmit enable is in use) has left the wire and the
+ * driver has been released
+ */
+
+bool CMRI::transmitComplete()
+{
+    return txSent >= txLength && !transmitEnabled;
+}
+
+
+/*
+ * Use the given pin to drive the DE (driver enable) input of an RS-485
+ * transceiver.  The pin is raised immediately before the first byte of a
+ * reply is written, and lowered as soon as the last byte has completely
+ * left the UART.  Use -1 for no pin.
+ */
+
+void CMRI::setTransmitEnablePin(int pin)
+{
+    transmitEnablePin = pin;
+
+    if (pin >= 0) {
+        pinMode(pin, OUTPUT);
+        digitalWrite(pin, LOW);
+    }
+}
+
+
+/*
+ * As setTransmitEnablePin, but call a user function (with true to enable
+ * the driver, false to release it), for transceivers that are not on a
+ * simple pin
+ */
+
+void CMRI::setTransmitEnableHandler(void (*transmitEnableHandler) (bool enable))
+{
+    this->transmitEnableHandler = transmitEnableHandler;
+}
+
+
+/*
+ * Install a function that returns true once the UART has completely
+ * shifted out the last byte (on an AVR, the TXCn flag).  Without one, the
+ * transmit buffer is watched via availableForWrite() and stream.flush()
+ * waits out the final character.
+ */
+
+void CMRI::setTransmitIdleHandler(bool(*transmitIdleHandler) ())
+{
+    this->transmitIdleHandler = transmitIdleHandler;
+}
+
+
+/*
+ * The bus turnaround times achieved by the transmit enable control
+ */
+
+const CMRI::TransmitTiming & CMRI::transmitTiming()
+{
+    return timing;
+}
+
+
+/*
+ * Process a block of characters that have already been read from the
+ * CMRI network (from readBytes(), a DMA buffer, or a host program),
+ * instead of having check() read them from the stream.
+ *
+ * Inside the data portion of a message, runs of characters that are not
+ * ETX or DLE are copied into the message buffer in one step (or, for a
+ * message to another node, stepped over), rather than going through the
+ * state machine one character at a time.
+ *
+ * Processing stops early when a complete message leaves work to be done
+ * (outputs to apply, or a reply still being transmitted).  The number of
+ * characters consumed is returned; the caller should call check() and then
+ * feed the rest again.
+ */
+
+size_t CMRI::feed(const uint8_t * data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        if (outputsPending || txSent < txLength || transmitEnabled) {
+            break;
+        }
+
+        if (currentState == SKIP_NEXT) {
+            const uint8_t *p = data + i;
+            size_t n = len - i;
+            size_t run = 0;
+
+            while (run < n && p[run] != ETX && p[run] != DLE) {
+                run++;
+            }
+
+            if (run > 0) {
+                charCount += run;
+                i += run;
+                continue;
+            }
+        } else if (currentState == MAYBE_DATA_NEXT) {
+            const uint8_t *p = data + i;
+            size_t n = len - i;
+            size_t run = 0;
+
+            while (run < n && p[run] != ETX && p[run] != DLE) {
+                run++;
+            }
+
+            // whatever does not fit is left to nextChar, which will
+            // report the overflow
+            if (run > (size_t) (bufSize - messageLength)) {
+                run = bufSize - messageLength;
+            }
+
+            if (run > 0) {
+                memcpy(buf + messageLength, p, run);
+                messageLength += run;
+                if (stageNode != NULL) {
+                    stageOutputs(messageLength - run);
+                }
+                charCount += run;
+                i += run;
+                continue;
+            }
+        }
+
+        nextChar(data[i++]);
+    }
+
+    return i;
+}
+
+
+/*
+ * Let the user program add a stream to use for debug messages 
+ * 
+ * This can be a second serial port, or an established network
+ * connection. Both have been tested.  No reconnection efforts are taken,
+ * so network connections are not the most reliable.
+ */
+
+void CMRI::addDebugStream(Stream * s)
+{
+    debug = s;
+}
+
+
+/*
+ * A debugging routine to print some information about the CMRI object to
+ * the debug stream.  
+ */
+
+void CMRI::printSummary()
+{
+    if (debug) {
+        debug->println("CMRI communications summary");
+        debug->print("  tickCount: ");
+        debug->println(tickCount);
+        debug->print("  charCount: ");
+        debug->println(charCount);
+        debug->print("  messagesSeen: ");
+        debug->println(messagesSeen);
+        debug->print("  messagesProcessed: ");
+        debug->print(messagesProcessed);
+        debug->println("");
+        debug->print("  framesSkipped: ");
+        debug->println(framesSkipped);
+        debug->print("  bytesSkipped: ");
+        debug->println(bytesSkipped);
+        debug->print("  errorCount: ");
+        debug->println(errorCount);
+#if CMRI_METRICS
+        for (uint8_t i = 0; i < NUM_ERROR_KINDS; i++) {
+            if (errorKinds[i]) {
+                debug->print("    ");
+                debug->print(errorKindName(i));
+                debug->print(": ");
+                debug->println(errorKinds[i]);
+            }
+        }
+        debug->print("  maxCheckMicros: ");
+        debug->println(maxCheckMicros);
+#endif
+    }
+}
+
+
+/*
+ * The number of characters, and of complete messages, that belonged to
+ * messages for other nodes and were skipped over without being parsed
+ */
+
+unsigned long CMRI::skippedBytes()
+{
+    return bytesSkipped;
+}
+
+unsigned long CMRI::skippedFrames()
+{
+    return framesSkipped;
+}
+
+
+/*
+ * A short name for an ErrorKind, for reports
+ */
+
+const char *CMRI::errorKindName(uint8_t kind)
+{
+    static const char *const names[NUM_ERROR_KINDS] = {
+        "junk", "noStx", "overflow", "escape", "state", "init", "config", "capacity", "overrun",
+        "transmit"
+    };
+
+    return kind < NUM_ERROR_KINDS ? names[kind] : "unknown";
+}
+
+
+#if CMRI_TRACE_SIZE > 0
+/*
+ * Record protocol events in a ring buffer of CMRI_TRACE_SIZE bytes, and
+ * write them to the given stream in a compact binary form, but only from
+ * check() when there is nothing else to do (no characters waiting, no
+ * reply being sent), and only as much as the stream can take without
+ * blocking.  Unlike the debug stream, this barely changes the timing of
+ * the node, so it can be left on while chasing missed polls.
+ *
+ * The stream must report availableForWrite() (HardwareSerial does).
+ * When the buffer fills, new events are dropped and counted.
+ * extras/host/cmri_trace turns a capture of the stream into a log.
+ */
+
+void CMRI::setTraceStream(Stream * s)
+{
+    traceStream = s;
+}
+
+/*
+ * Choose the events to record: bit (1 << event) for each TraceEvent.
+ * By default, everything except the parser state changes is recorded.
+ */
+
+void CMRI::setTraceEvents(uint8_t mask)
+{
+    traceMask = mask;
+}
+
+void CMRI::trace(uint8_t event, uint8_t a, uint8_t b, uint8_t c)
+{
+    if (traceStream == NULL || !(traceMask & (1 << event))) {
+        return;
+    }
+
+    // say how much was lost, before anything else is recorded
+    if (traceDropped > 0) {
+        if (traceCount + 2 > TRACE_RECORDS) {
+            if (traceDropped < 0xFFFF) {
+                traceDropped++;
+            }
+            return;
+        }
+        putTraceRecord(TRACE_DROPPED, traceDropped & 0xFF, traceDropped >> 8, 0);
+        traceDropped = 0;
+    }
+
+    if (traceCount >= TRACE_RECORDS) {
+        traceDropped = 1;
+        return;
+    }
+
+    putTraceRecord(event, a, b, c);
+}
+
+void CMRI::putTraceRecord(uint8_t event, uint8_t a, uint8_t b, uint8_t c)
+{
+    uint16_t slot = traceHead + traceCount;
+    if (slot >= TRACE_RECORDS) {
+        slot -= TRACE_RECORDS;
+    }
+
+    uint8_t *r = traceBuf + slot * TRACE_RECORD_LEN;
+    unsigned long now = micros();
+
+    r[0] = event;
+    r[1] = a;
+    r[2] = b;
+    r[3] = c;
+    r[4] = now;
+    r[5] = now >> 8;
+    r[6] = now >> 16;
+    r[7] = now >> 24;
+
+    traceCount++;
+}
+
+/*
+ * Write as many trace records as the trace stream will take right now
+ */
+
+void CMRI::drainTrace()
+{
+    if (traceStream == NULL) {
+        return;
+    }
+
+    while (traceCount > 0 && traceStream->availableForWrite() > TRACE_RECORD_LEN) {
+        uint8_t out[TRACE_RECORD_LEN + 1];
+
+        out[0] = TRACE_SYNC;
+        memcpy(out + 1, traceBuf + traceHead * TRACE_RECORD_LEN, TRACE_RECORD_LEN);
+        traceStream->write(out, sizeof(out));
+
+        traceCount--;
+        if (++traceHead >= TRACE_RECORDS) {
+            traceHead = 0;
+        }
+    }
+}
+#endif
+
+
+#if CMRI_METRICS
+/*
+ * Copy the metrics collected since the object was created (or since
+ * resetMetrics()) into the given snapshot.  Only available when the
+ * library is built with CMRI_METRICS set to 1.
+ */
+
+void CMRI::getMetrics(Metrics & snapshot)
+{
+    snapshot.bytesSeen = charCount;
+    snapshot.framesSeen = messagesSeen;
+    snapshot.framesProcessed = messagesProcessed;
+    snapshot.bytesSkipped = bytesSkipped;
+    snapshot.framesSkipped = framesSkipped;
+    memcpy(snapshot.errors, errorKinds, sizeof(errorKinds));
+    memcpy(snapshot.replyLatency, replyLatency, sizeof(replyLatency));
+    memcpy(snapshot.handlerTime, handlerTime, sizeof(handlerTime));
+    snapshot.maxCheckMicros = maxCheckMicros;
+}
+
+/*
+ * Clear the error categories, histograms and maximum check() time (the
+ * byte and frame counters are the ones printSummary() shows, and keep
+ * counting)
+ */
+
+void CMRI::resetMetrics()
+{
+    memset(errorKinds, 0, sizeof(errorKinds));
+    memset(replyLatency, 0, sizeof(replyLatency));
+    memset(handlerTime, 0, sizeof(handlerTime));
+    maxCheckMicros = 0;
+}
+
+/*
+ * Count a time in its power of two histogram bucket
+ */
+
+void CMRI::addToHistogram(unsigned long *histogram, unsigned long us)
+{
+    uint8_t bucket = 0;
+
+    while (us != 0 && bucket < METRIC_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    histogram[bucket] += 1;
+}
+#endif
+
+
+/*
+ * The longest message (data portion) that can be received or sent, which
+ * is MAX_MESG_LEN unless the buffers were sized otherwise (CMRIStatic),
+ * or could not be allocated at all
+ */
+
+uint16_t CMRI::maxMessageLength()
+{
+    uint16_t sendable = txBufSize >= frameBytes(0) ? (txBufSize - frameBytes(0)) / 2 : 0;
+
+    return bufSize < sendable ? bufSize : sendable;
+}
+
+
+
+
+
+/******************************************************************************
+ *
+ * These are the utility functions used by the CMRI object
+ *
+ ******************************************************************************
+ */
+
+
+/*
+ * Load a word from a packed line model, with bit 0 of the word being the
+ * lowest numbered line.  Only the first `avail' bytes are used; anything
+ * beyond that reads as zero (lines that were not sent are OFF).
+ */
+template < typename W > static inline W loadWord(const uint8_t * data, int avail)
+{
+    W w = 0;
+
+    if (avail >= (int) sizeof(W)) {
+        memcpy(&w, data, sizeof(W));
+    } else if (avail > 0) {
+        memcpy(&w, data, avail);
+    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if (sizeof(W) == 4)
+        w = __builtin_bswap32(w);
+    else if (sizeof(W) == 2)
+        w = __builtin_bswap16(w);
+#endif
+
+    return w;
+}
+
+/*
+ * Store a word into a packed line model, the reverse of loadWord().  The
+ * line models are allocated in whole words, so the word always fits.
+ */
+template < typename W > static inline void storeWord(uint8_t * data, W w)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if (sizeof(W) == 4)
+        w = __builtin_bswap32(w);
+    else if (sizeof(W) == 2)
+        w = __builtin_bswap16(w);
+#endif
+    memcpy(data, &w, sizeof(W));
+}
+
+/* Set a specific bit in an array of unsigned bytes */
+static void setBit(uint8_t * data, uint16_t dataLen, uint16_t bit, bool value)
+{
+    uint16_t byte = bit / 8;
+    uint8_t offset = bit % 8;
+
+    if (byte < dataLen) {
+        if (value) {
+            data[byte] |= 1 << offset;
+        } else {
+            data[byte] &= ~(1 << offset);
+        }
+    }
+}
+
+
+
+
+/******************************************************************************
+ *
+ * These are the methods of the CMRINode object, which holds everything
+ * that belongs to one node address: its handlers and its line models
+ *
+ ******************************************************************************
+ */
+
+
+/*
+ * Create a node, with the given node identifier (0 to 127), to be added
+ * to a CMRI object with addNode().  Everything that the CMRI object
+ * offers for its own node (handlers, line models, input scanning) is
+ * available for each additional node.
+ */
+
+CMRINode::CMRINode(uint8_t n):
+nodeId(n + 65)
+{
+    init();
+}
+
+
+/*
+ * Create a node whose line models are kept in the storage given, which
+ * must hold at least storageBytes() for the number of lines given.  The
+ * storage is cleared here, since a CMRIStaticNode or CMRIStatic on the
+ * stack or the heap does not start out zeroed.
+ */
+
+CMRINode::CMRINode(uint8_t n, uint8_t * inputStore, uint16_t inputLines,
+                   uint8_t * outputStore, uint16_t outputLines):
+nodeId(n + 65)
+{
+    init();
+
+    if (inputLines) {
+        memset(inputStore, 0, storageBytes(inputLines));
+    }
+    if (outputLines) {
+        memset(outputStore, 0, storageBytes(outputLines));
+    }
+
+    inputs = inputLines ? inputStore : NULL;
+    inputCapacity = inputLines;
+    outputs = outputLines ? outputStore : NULL;
+    outputCapacity = outputLines;
+}
+
+
+/*
+ * The state common to both constructors
+ */
+
+void CMRINode::init()
+{
+    initHandler = NULL;
+    memset(&config, 0, sizeof(config));
+    inputHandler = NULL;
+    bulkInputHandler = NULL;
+    numInputs = 0;
+    inputCapacity = 0;
+    inputs = NULL;
+    scanEnabled = false;
+    scanStep = 0;
+    scanCursor = 0;
+    scanInterval = 0;
+    lastScanMicros = 0;
+    sweepStartMicros = 0;
+    snapshotMicros = 0;
+    debounce = NULL;
+    numOutputs = 0;
+    outputCapacity = 0;
+    outputs = NULL;
+    outputGeneration = 0;
+    outputFlags = NULL;
+    perLineOutputHandler = NULL;
+    overallOutputHandler = NULL;
+    changeList = NULL;
+    numChanges = 0;
+    outputChangeHandler = NULL;
+    portMap = NULL;
+    numPorts = 0;
+    portChanges = NULL;
+    portOutputHandler = NULL;
+    effects = NULL;
+    numEffects = 0;
+    effectLines = NULL;
+    wheel = NULL;
+    wheelSlot = 0;
+    wheelMillis = 0;
+}
+
+
+/*
+ * called by the user program to install a function to be called when
+ * an initialization message (I) is received
+ *
+ * The message has already been decoded when the handler is called, so
+ * nodeConfig() describes the new configuration.  The handler returns
+ * false to reject it, in which case the previous configuration (and
+ * transmit delay) stays in effect.
+ */
+void CMRINode::setInitHandler(bool(*initHandler) (uint8_t * data, int datalen))
+{
+    this->initHandler = initHandler;
+}
+
+
+/*
+ * The configuration from the last accepted 'I' message.  nodeType is 0
+ * until one has been received.
+ */
+const CMRINode::Config & CMRINode::nodeConfig()
+{
+    return config;
+}
+
+
+/* 
+ * called by the user program to install a function to be called when an
+ * input poll message (P) is received
+ *
+ * Returns false if the input line model could not be allocated, or is
+ * larger than the storage given to CMRIStaticNode or CMRIStatic.
+ */
+
+bool CMRINode::setInputHandler(uint16_t numLines, bool(*inputHandler) (uint16_t line))
+{
+    if (this->inputHandler == NULL || inputs == NULL) {
+
+        this->inputHandler = inputHandler;
+        this->bulkInputHandler = NULL;
+
+        return createInputs(numLines);
+    }
+    return numLines == numInputs;
+}
+
+
+/*
+ * called by the user program to install a function to be called when an
+ * input poll message (P) is received, for hardware that can read many
+ * input lines at once (a port register, or an MCP23017 GPIO register).
+ *
+ * The handler is given a range of input lines and a pointer to the packed
+ * input bytes for that range: bit 0 of data[0] is firstLine, bit 1 is
+ * firstLine + 1, and so on.  firstLine is always a multiple of 8.  The
+ * handler must fill in every byte that the range covers; bits beyond the
+ * last configured line are ignored.
+ *
+ * This is used instead of the per-line inputHandler, never in addition
+ * to it.
+ */
+
+bool CMRINode::setInputHandler(uint16_t numLines,
+                               void (*bulkInputHandler) (uint16_t firstLine, uint16_t numLines,
+                                                         uint8_t * data))
+{
+    if (this->bulkInputHandler == NULL || inputs == NULL) {
+
+        this->bulkInputHandler = bulkInputHandler;
+        this->inputHandler = NULL;
+
+        return createInputs(numLines);
+    }
+    return numLines == numInputs;
+}
+
+
+/*
+ * called by the user program to sample the inputs in the background,
+ * instead of when a poll (P) message arrives
+ *
+ * Every intervalMicros, check() samples the next linesPerStep input lines
+ * (rounded up to a multiple of 8 for a bulkInputHandler) into an input
+ * snapshot, working round-robin through all the lines.  A poll is then
+ * answered straight from the snapshot, so a slow input handler no longer
+ * delays the response.
+ *
+ * The input handler must be installed first.  A complete sweep is taken
+ * right away, so the snapshot is valid from the start.
+ */
+
+void CMRINode::setInputScan(uint16_t linesPerStep, unsigned long intervalMicros)
+{
+    if (inputs == NULL || numInputs == 0 || linesPerStep == 0) {
+        scanEnabled = false;
+        return;
+    }
+
+    if (bulkInputHandler != NULL) {
+        linesPerStep = (linesPerStep + 7) & ~7;
+    }
+
+    scanStep = linesPerStep;
+    scanInterval = intervalMicros;
+    scanCursor = 0;
+
+    sweepStartMicros = micros();
+    scanInputs(0, numInputs);
+    snapshotMicros = sweepStartMicros;
+    lastScanMicros = sweepStartMicros;
+
+    scanEnabled = true;
+}
+
+
+/*
+ * The age in microseconds of the oldest input sample that a poll would
+ * report right now.  Without background scanning, this is the time
+ * since the last poll was answered.
+ */
+
+unsigned long CMRINode::inputSnapshotAge()
+{
+    return micros() - snapshotMicros;
+}
+
+
+/*
+ * Debounce a range of input lines: a line only changes state in the input
+ * model (and so in the replies to polls) once the given number of samples
+ * in a row (1 to MAX_DEBOUNCE_SAMPLES) have disagreed with it.  The time
+ * this takes is that many times the time between samples, which is the
+ * scan interval with setInputScan(), or else the time between polls.
+ * One sample means no debouncing, which is where every line starts.
+ *
+ * The lines are counted in parallel, a word of lines at a time, with a
+ * few bitwise operations per word and sample whatever the debounce time.
+ *
+ * Call this after setInputHandler().  Returns false if the lines are not
+ * all inputs, the number of samples is out of range, or there is no
+ * memory for the counters.
+ */
+
+bool CMRINode::setInputDebounce(uint16_t firstLine, uint16_t numLines, uint8_t samples)
+{
+    if (inputs == NULL || samples == 0 || samples > MAX_DEBOUNCE_SAMPLES
+        || firstLine > numInputs || numLines > numInputs - firstLine) {
+        return false;
+    }
+
+    uint16_t planeBytes = wordBytesForLines(inputCapacity);
+    uint16_t bits = 8 * sizeof(word_t);
+
+    if (debounce == NULL) {
+        debounce = (uint8_t *) calloc(7, planeBytes);
+        if (debounce == NULL) {
+            return false;
+        }
+
+        // start every line at one sample, and with the samples as they are
+        word_t *k0 = (word_t *) (debounce + 4 * planeBytes);
+        memset(k0, 0xFF, planeBytes);
+        memcpy(debounce, inputs, planeBytes);
+    }
+
+    word_t *k = (word_t *) (debounce + 4 * planeBytes);
+    uint16_t words = planeBytes / sizeof(word_t);
+
+    for (uint16_t line = firstLine; line < firstLine + numLines; line++) {
+        word_t bit = (word_t) 1 << (line % bits);
+
+        for (uint8_t plane = 0; plane < 3; plane++) {
+            if (samples & (1 << plane)) {
+                k[plane * words + line / bits] |= bit;
+            } else {
+                k[plane * words + line / bits] &= ~bit;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/* 
+ * called by the user program to install a function to be called when an
+ * output/transmit message (T) is received
+ *
+ * The perLineOutputHandler is called for each output line that changes.
+ * The overallOutputHandler is called once per 'T' message that changed
+ * anything, with one bool per line; that array is only kept (and only
+ * costs RAM) when an overallOutputHandler is installed.  It holds what
+ * was handed to the other output handlers, so a line that an output
+ * effect drives shows the effect's state, not the host's.
+ *
+ * Returns false if the output line model (or that array) could not be
+ * allocated, or is larger than the storage given to CMRIStaticNode or
+ * CMRIStatic.
+ */
+
+bool CMRINode::setOutputHandler(uint16_t numLines,
+                                void (*perLineOutputHandler) (uint16_t line, bool isOn),
+                                void (*overallOutputHandler) (uint16_t numOutputs,
+                                                              bool outputs[]))
+{
+    if (perLineOutputHandler == NULL || overallOutputHandler == NULL || outputs == NULL) {
+        this->perLineOutputHandler = perLineOutputHandler;
+        this->overallOutputHandler = overallOutputHandler;
+
+        return createOutputs(numLines, overallOutputHandler != NULL);
+    }
+    return numLines == numOutputs;
+}
+
+/*
+ * called by the user program to install a function to be called with
+ * the list of output lines that a 'T' message changed, and their new
+ * states, rather than once per line.  The list holds up to
+ * CMRI_OUTPUT_CHANGES lines; a message that changes more is handed over
+ * in several calls.  This can be used alongside the other output handlers.
+ *
+ * Returns false if the output line model or the list could not be
+ * allocated.
+ */
+
+bool CMRINode::setOutputChangeHandler(uint16_t numLines,
+                                      void (*outputChangeHandler) (const CMRIOutputChange
+                                                                   changes[], uint8_t count))
+{
+    if (outputChangeHandler != NULL && changeList == NULL) {
+        changeList = (CMRIOutputChange *) calloc(CMRI_OUTPUT_CHANGES, sizeof(CMRIOutputChange));
+        if (changeList == NULL) {
+            return false;
+        }
+    }
+
+    this->outputChangeHandler = outputChangeHandler;
+    numChanges = 0;
+
+    return createOutputs(numLines, outputFlags != NULL);
+}
+
+/*
+ * called by the user program to group output changes by hardware port,
+ * such as the 8 bit ports of an I2C port expander.  portMap has an entry
+ * for each output line: port * 8 + bit, or NO_PORT.  Once a 'T' message
+ * has been applied, the portOutputHandler is called once for each port
+ * with changes, with a mask of the bits that changed and their new
+ * states, so that each port needs one write rather than one per line.
+ * Lines on a port are not given to the perLineOutputHandler; lines with
+ * NO_PORT still are.
+ *
+ * The map is not copied, so it must stay around.  Call this after the
+ * output handler is set, since the map is as long as the output lines.
+ * Returns false if numPorts is more than 31, or the port table could not
+ * be allocated.
+ */
+
+bool CMRINode::setOutputPorts(uint8_t numPorts, const uint8_t portMap[],
+                              void (*portOutputHandler) (uint8_t port, uint8_t mask,
+                                                         uint8_t bits))
+{
+    if (portMap == NULL || portOutputHandler == NULL || numPorts == 0) {
+        this->portMap = NULL;
+        this->portOutputHandler = NULL;
+        return true;
+    }
+
+    if (numPorts > NO_PORT / 8 || (portChanges != NULL && numPorts > this->numPorts)) {
+        return false;
+    }
+
+    if (portChanges == NULL) {
+        portChanges = (uint8_t *) calloc(2, numPorts);
+        if (portChanges == NULL) {
+            return false;
+        }
+    }
+
+    this->portMap = portMap;
+    this->numPorts = numPorts;
+    this->portOutputHandler = portOutputHandler;
+    return true;
+}
+
+/*
+ * called by the user program to have the library run an output effect,
+ * rather than timing it in the output handler.  While controlLine is ON,
+ * the lines from firstLine on are driven by the effect:
  *
- * The nodeId value should range between 0 and 127.
+ *   EFFECT_BLINK      all ON for onMillis, then all OFF for offMillis
+ *   EFFECT_ALTERNATE  the same, with the odd numbered lines of the group
+ *                     in the opposite phase (a pair of crossing lights)
+ *   EFFECT_PULSE      all ON for onMillis, then OFF (a turnout motor)
+ *
+ * and when it goes OFF, so do they.  offMillis defaults to onMillis.  The
+ * control line may be one of the lines driven, as when output 7 is to
+ * blink while the host has it ON; a control line that is not is still
+ * handed to the output handlers as usual.  The lines driven are only
+ * handed over by the effect, whatever the host sends for them, and the
+ * overallOutputHandler is called after each step of an effect.
  *
+ * The lines of one effect change together, as one change list and one
+ * write per port when those handlers are installed, and check() only
+ * spends time on the effects that are due.  Call this after the output
+ * handler is set.  Returns false if the lines are not all outputs, if
+ * they overlap another effect's, if the control line is driven by
+ * another effect or another effect's control line is among the lines
+ * driven, or if all CMRI_EFFECTS are in use.  Effects may share a
+ * control line.
  */
 
-CMRI::CMRI(Stream & s, uint8_t n):
-nodeId(n + 65), stream(s)
+bool CMRINode::addOutputEffect(uint8_t effect, uint16_t controlLine, uint16_t firstLine,
+                               uint16_t numLines, uint16_t onMillis, uint16_t offMillis)
 {
-    messageLength = 0;
-    currentState = START;
-    debug = NULL;
-    tickCount = 0;
-    charCount = 0;
-    messagesSeen = 0;
-    messagesProcessed = 0;
-    errorCount = 0;
-    inputHandler = NULL;
-    perLineOutputHandler = NULL;
-    overallOutputHandler = NULL;
-    inputs = NULL;
-    outputs = NULL;
-}
+    if (outputs == NULL || effect > EFFECT_PULSE || numLines == 0 || controlLine >= numOutputs
+        || firstLine >= numOutputs || numLines > numOutputs - firstLine) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < numEffects; i++) {
+        const Effect & e = effects[i];
+
+        if (firstLine < e.firstLine + e.numLines && e.firstLine < firstLine + numLines) {
+            return false;
+        }
+        if (controlLine >= e.firstLine && controlLine < e.firstLine + e.numLines) {
+            return false;
+        }
+        if (e.controlLine >= firstLine && e.controlLine < firstLine + numLines) {
+            return false;
+        }
+    }
+
+    if (effects == NULL) {
+        effects = (Effect *) calloc(CMRI_EFFECTS, sizeof(Effect));
+        effectLines = (uint8_t *) calloc(1, bytesForLines(outputCapacity));
+        wheel = (uint8_t *) malloc(EFFECT_SLOTS);
+        if (effects == NULL || effectLines == NULL || wheel == NULL) {
+            free(effects);
+            free(effectLines);
+            free(wheel);
+            effects = NULL;
+            effectLines = NULL;
+            wheel = NULL;
+            return false;
+        }
+        memset(wheel, NO_EFFECT, EFFECT_SLOTS);
+        wheelMillis = millis();
+    }
 
+    if (numEffects == CMRI_EFFECTS) {
+        return false;
+    }
+
+    Effect & e = effects[numEffects];
+    e.controlLine = controlLine;
+    e.firstLine = firstLine;
+    e.numLines = numLines;
+    e.onMillis = onMillis;
+    e.offMillis = offMillis ? offMillis : onMillis;
+    e.kind = effect;
+    e.running = false;
+    e.lit = false;
+    e.slot = NO_EFFECT;
+
+    setBit(effectLines, bytesForLines(numOutputs), controlLine, true);
+    for (uint16_t line = firstLine; line < firstLine + numLines; line++) {
+        setBit(effectLines, bytesForLines(numOutputs), line, true);
+    }
+
+    numEffects += 1;
+
+    // the host may have turned it on already
+    if (outputs[controlLine / 8] & (1 << (controlLine % 8))) {
+        controlEffects(controlLine, true);
+        finishOutputs();
+        reportOutputs();
+    }
+    return true;
+}
 
 /*
- * Perform the next bit of processing on a CMRI protocol stream.  This
- * should be called frequently; ideally once per iteration of the Arduino
- * loop() method.  
- *
- * Because this method does not block, processing of other functions may
- * occur inside the loop() method.
+ * Allocate the packed input line model, if that has not been done yet,
+ * and make sure it can hold the given number of lines.  On failure there
+ * are no inputs, and polls are not answered.
  */
-
-void CMRI::check()
+bool CMRINode::createInputs(uint16_t numLines)
 {
-    tickCount += 1;
+    if (inputs == NULL) {
+        inputs = (uint8_t *) calloc(1, wordBytesForLines(numLines));
+        inputCapacity = inputs ? numLines : 0;
+    }
 
-    if (stream.available() < 1) {
-        return;
+    if (inputs == NULL || numLines > inputCapacity) {
+        numInputs = 0;
+        return false;
     }
 
-    while (stream.available()) {
-        int b = stream.read();
+    numInputs = numLines;
+    return true;
+}
 
-        if (b >= 0) {
-            // this need
-            nextChar((uint8_t) b);
-        } else {
-            if (debug) {
-                debug->println("error reading from available stream");
-            }
+/*
+ * The same for the packed output line model, and the unpacked copy of it
+ * for the overallOutputHandler if wanted.  On failure there are no
+ * outputs, and 'T' messages change nothing.
+ */
+bool CMRINode::createOutputs(uint16_t numLines, bool wantFlags)
+{
+    if (outputs == NULL) {
+        outputs = (uint8_t *) calloc(1, wordBytesForLines(numLines));
+        outputCapacity = outputs ? numLines : 0;
+    }
+
+    if (outputs == NULL || numLines > outputCapacity) {
+        numOutputs = 0;
+        return false;
+    }
+
+    if (wantFlags && outputFlags == NULL) {
+        outputFlags = (bool *) calloc(sizeof(bool), outputCapacity);
+        if (outputFlags == NULL) {
+            overallOutputHandler = NULL;
+            numOutputs = 0;
+            return false;
         }
     }
+
+    numOutputs = numLines;
+    outputGeneration++;
+    return true;
 }
 
 
 /*
- * called by the user program to install a function to be called when
- * an initialization message (I) is received
+ * Sample the given range of input lines into the packed input model,
+ * using whichever input handler is installed.  firstLine must be a
+ * multiple of 8 when a bulkInputHandler is used.
  */
-void CMRI::setInitHandler(bool(*initHandler) (uint8_t * data, int datalen))
+void CMRINode::scanInputs(uint16_t firstLine, uint16_t count)
 {
-    this->initHandler = initHandler;
-}
-
+    if (firstLine + count > numInputs) {
+        count = numInputs - firstLine;
+    }
 
+    // when debouncing, the samples go to the raw plane first
+    uint8_t *samples = debounce ? debounce : inputs;
 
-/* 
- * called by the user program to install a function to be called when an
- * input poll message (P) is received
- */
+    if (bulkInputHandler != NULL) {
+        (*bulkInputHandler) (firstLine, count, samples + firstLine / 8);
 
-void CMRI::setInputHandler(uint16_t numLines, bool(*inputHandler) (uint16_t line))
-{
-    if (this->inputHandler == NULL || inputs == NULL) {
-        if (debug) {
-            debug->println("inputHandler set");
+        // clear whatever the handler put beyond the last line
+        if (firstLine + count == numInputs && numInputs % 8) {
+            samples[bytesForLines(numInputs) - 1] &= (1 << (numInputs % 8)) - 1;
         }
+    } else if (inputHandler != NULL) {
+        uint16_t modelBytes = bytesForLines(numInputs);
 
-        this->inputHandler = inputHandler;
+        for (uint16_t i = firstLine; i < firstLine + count; i++) {
+            bool val = (*inputHandler) (i);
 
-        if (debug)
-            debug->println("creating inputs");
+            setBit(samples, modelBytes, i, val);
+        }
+    }
 
-        numInputs = numLines;
-        inputs = (bool *) calloc(sizeof(bool), numInputs);
+    if (debounce != NULL && count > 0) {
+        debounceInputs(firstLine, count);
     }
 }
 
-/* 
- * called by the user program to install a function to be called when an
- * output/transmit message (T) is received
- */
 
-void CMRI::setOutputHandler(uint16_t numLines,
-                            void (*perLineOutputHandler) (uint16_t line, bool isOn),
-                            void (*overallOutputHandler) (uint16_t numOutputs, bool outputs[]))
+/*
+ * Run the vertical counters over the lines just sampled.  Bit n of the
+ * counter planes c0, c1 and c2 together count how many samples in a row
+ * line n has disagreed with its state in the input model; when that
+ * reaches the line's number of samples (in k0, k1 and k2) the line
+ * changes state, and a sample that agrees starts the count again.
+ */
+void CMRINode::debounceInputs(uint16_t firstLine, uint16_t count)
 {
-    if (perLineOutputHandler == NULL || overallOutputHandler == NULL || outputs == NULL) {
-        this->perLineOutputHandler = perLineOutputHandler;
-        this->overallOutputHandler = overallOutputHandler;
+    uint16_t planeBytes = wordBytesForLines(inputCapacity);
+    uint16_t words = planeBytes / sizeof(word_t);
+    uint16_t bits = 8 * sizeof(word_t);
+    word_t *c0 = (word_t *) (debounce + planeBytes);
+    word_t *c1 = c0 + words;
+    word_t *c2 = c1 + words;
+    word_t *k0 = c2 + words;
+    word_t *k1 = k0 + words;
+    word_t *k2 = k1 + words;
+    uint16_t lastLine = firstLine + count - 1;
+    const word_t ones = ~(word_t) 0;
+
+    for (uint16_t w = firstLine / bits; w <= lastLine / bits; w++) {
+        // the lines of this word that were sampled
+        word_t mask = ones;
+        if (w == firstLine / bits) {
+            mask &= ones << (firstLine % bits);
+        }
+        if (w == lastLine / bits) {
+            mask &= ones >> (bits - 1 - lastLine % bits);
+        }
 
-        if (debug)
-            debug->println("creating outputs");
+        word_t raw = loadWord < word_t > (debounce + w * sizeof(word_t), sizeof(word_t));
+        word_t state = loadWord < word_t > (inputs + w * sizeof(word_t), sizeof(word_t));
+        word_t delta = (raw ^ state) & mask;
+
+        // count up where the sample disagrees, back to 0 where it agrees
+        word_t n0 = (~c0[w] & delta) | (c0[w] & ~mask);
+        word_t n1 = ((c1[w] ^ c0[w]) & delta) | (c1[w] & ~mask);
+        word_t n2 = ((c2[w] ^ (c1[w] & c0[w])) & delta) | (c2[w] & ~mask);
+
+        word_t toggle = delta & ~((n0 ^ k0[w]) | (n1 ^ k1[w]) | (n2 ^ k2[w]));
+
+        c0[w] = n0 & ~toggle;
+        c1[w] = n1 & ~toggle;
+        c2[w] = n2 & ~toggle;
 
-        numOutputs = numLines;
-        outputs = (bool *) calloc(sizeof(bool), numOutputs);
+        if (toggle) {
+            storeWord < word_t > (inputs + w * sizeof(word_t), state ^ toggle);
+        }
     }
 }
 
+
 /*
- * Let the user program add a stream to use for debug messages 
- * 
- * This can be a second serial port, or an established network
- * connection. Both have been tested.  No reconnection efforts are taken,
- * so network connections are not the most reliable.
+ * Take the next step of a background input scan, if it is due
  */
-
-void CMRI::addDebugStream(Stream * s)
+void CMRINode::scanNextInputs()
 {
-    debug = s;
+    unsigned long now = micros();
+
+    if (now - lastScanMicros < scanInterval) {
+        return;
+    }
+    lastScanMicros = now;
+
+    if (scanCursor == 0) {
+        sweepStartMicros = now;
+    }
+
+    scanInputs(scanCursor, scanStep);
+    scanCursor += scanStep;
+
+    if (scanCursor >= numInputs) {
+        // a complete sweep has been done, so nothing in the snapshot is
+        // older than the start of that sweep
+        scanCursor = 0;
+        snapshotMicros = sweepStartMicros;
+    }
 }
 
 
 /*
- * A debugging routine to print some information about the CMRI object to
- * the debug stream.  
+ * The number of bytes needed to hold the given number of lines, packed
+ * 8 to a byte
  */
-
-void CMRI::printSummary()
+uint16_t CMRINode::bytesForLines(uint16_t lines)
 {
-    if (debug) {
-        debug->println("CMRI communications summary");
-        debug->print("  tickCount: ");
-        debug->println(tickCount);
-        debug->print("  charCount: ");
-        debug->println(charCount);
-        debug->print("  messagesSeen: ");
-        debug->println(messagesSeen);
-        debug->print("  messagesProcessed: ");
-        debug->print(messagesProcessed);
-        debug->println("");
-    }
+    return (lines + 7) / 8;
 }
 
+/*
+ * As bytesForLines, but rounded up to a whole number of words, which is
+ * how the line models are allocated
+ */
+uint16_t CMRINode::wordBytesForLines(uint16_t lines)
+{
+    uint16_t bytes = bytesForLines(lines);
 
+    return (bytes + sizeof(word_t) - 1) / sizeof(word_t) * sizeof(word_t);
+}
 
 
-
-/******************************************************************************
- *
- * These are the utility functions used by the CMRI object
+/*
+ * set the state of the local model for the output lines, checking to make 
+ * sure we don't process more lines than we initialized
  *
- ******************************************************************************
+ * The user defined output handler function is called, with the current
+ * output line number and the current state (on, !on)
  */
+void CMRINode::setOutput(uint16_t line, bool isOn)
+{
+    if (outputs != NULL && line < numOutputs) {
+        setBit(outputs, bytesForLines(numOutputs), line, isOn);
+        outputGeneration++;
 
+        if (effectLines != NULL && (effectLines[line / 8] & (1 << (line % 8)))) {
+            if (controlEffects(line, isOn)) {
+                // an effect drives this line
+                return;
+            }
+        }
 
-/* Read a specific bit in an array of unsigned bytes */
-static bool getBit(uint8_t * data, uint16_t dataLen, uint16_t bit)
-{
-    bool value = false;
+        driveOutput(line, isOn);
+    }
+}
 
-    // do not allow overflow
-    uint16_t byte = bit / 8;
-    uint8_t offset = bit % 8;
 
-    if (byte < dataLen) {
-        value = data[byte] & (1 << offset);
+/*
+ * Hand the new state of an output line to the output handlers: to the
+ * change list and the port it is on, or else the perLineOutputHandler.
+ * It is kept for the overallOutputHandler too.
+ */
+void CMRINode::driveOutput(uint16_t line, bool isOn)
+{
+    if (outputFlags != NULL) {
+        outputFlags[line] = isOn;
+    }
+
+    if (outputChangeHandler != NULL) {
+        changeList[numChanges].line = line;
+        changeList[numChanges].isOn = isOn;
+        if (++numChanges == CMRI_OUTPUT_CHANGES) {
+            (*outputChangeHandler) (changeList, numChanges);
+            numChanges = 0;
+        }
     }
 
-    return value;
+    uint8_t place = portMap != NULL ? portMap[line] : NO_PORT;
+
+    if (place != NO_PORT && place / 8 < numPorts) {
+        uint8_t *port = portChanges + 2 * (place / 8);
+        uint8_t bit = 1 << (place % 8);
+
+        port[0] |= bit;
+        port[1] = isOn ? (port[1] | bit) : (port[1] & ~bit);
+    } else if (perLineOutputHandler != NULL) {
+        (*perLineOutputHandler) (line, isOn);
+    }
 }
 
-/* Set a specific bit in an array of unsigned bytes */
-static void setBit(uint8_t * data, uint16_t dataLen, uint16_t bit, bool value)
+
+/*
+ * Once a 'T' message has been applied, hand over what was collected: the
+ * rest of the change list, and one write for each port that changed
+ */
+void CMRINode::finishOutputs()
 {
-    uint16_t byte = bit / 8;
-    uint8_t offset = bit % 8;
+    if (numChanges > 0) {
+        (*outputChangeHandler) (changeList, numChanges);
+        numChanges = 0;
+    }
 
-    if (byte < dataLen) {
-        if (value) {
-            data[byte] |= 1 << offset;
-        } else {
-            data[byte] &= ~(1 << offset);
+    if (portOutputHandler != NULL) {
+        for (uint8_t p = 0; p < numPorts; p++) {
+            uint8_t *port = portChanges + 2 * p;
+
+            if (port[0] != 0) {
+                (*portOutputHandler) (p, port[0], port[1]);
+                port[0] = 0;
+                port[1] = 0;
+            }
         }
     }
 }
@@ -246,15 +2041,28 @@ static void setBit(uint8_t * data, uint16_t dataLen, uint16_t bit, bool value)
 /*
  * note an error during stream parsing, keeping track of an error count 
  */
-CMRI::cmriStreamState CMRI::error()
+CMRI::cmriStreamState CMRI::error(ErrorKind kind)
 {
-    errorCount += 1;
+    countError(kind);
+    stageNode = NULL;           // whatever was staged is thrown away
     return START;
 }
 
+void CMRI::countError(ErrorKind kind)
+{
+    errorCount += 1;
+    TRACE(TRACE_ERROR, kind, currentState, 0);
+#if CMRI_METRICS
+    errorKinds[kind] += 1;
+#else
+    (void) kind;
+#endif
+}
+
 
 /*
- * Determine whether the current message should be processed by this node.
+ * Determine whether the current message should be processed by this node
+ * (or one of the additional nodes that have been added).
  *
  * There are expectations of a future protocol extension to allow for
  * a broadcast message, which should be processed by every node on the
@@ -263,10 +2071,33 @@ CMRI::cmriStreamState CMRI::error()
 
 bool CMRI::isForMe()
 {
-    if (messageDest == nodeId)
-        return true;
-    else
-        return false;
+    return currentNode != NULL;
+}
+
+
+/*
+ * Find the node served here with the given address (as it appears on the
+ * wire), or NULL if there is none.  This is a table lookup, so it takes
+ * the same time however many nodes there are.
+ */
+
+CMRINode *CMRI::findNode(uint8_t address)
+{
+    if (owner != NULL) {
+        return owner->findNode(address);
+    }
+
+#if CMRI_MAX_NODES > 1
+    uint8_t slot = address - 65;
+
+    if (slot >= 128 || nodeIndex[slot] == 0) {
+        return NULL;
+    }
+
+    return nodes[nodeIndex[slot] - 1];
+#else
+    return (address == node.nodeId) ? &node : NULL;
+#endif
 }
 
 
@@ -276,24 +2107,36 @@ bool CMRI::isForMe()
  */
 
 void CMRI::printCurrentMessage(const char *tag)
+{
+    printMessage(tag, messageDest, messageType, buf, messageLength);
+}
+
+
+/*
+ * print the given message to the debug stream in a text form
+ *
+ */
+
+void CMRI::printMessage(const char *tag, int address, uint8_t type,
+                        const uint8_t * data, uint16_t dataLen)
 {
     if (debug) {
         if (tag)
             debug->print(tag);
 
-        debug->print(messageDest - 65); // display user friendly value
+        debug->print(address - 65);     // display user friendly value
         debug->print("  type: 0x");
-        debug->print(messageType, HEX);
-        if (isprint(messageType)) {
+        debug->print(type, HEX);
+        if (isprint(type)) {
             debug->print(" '");
-            debug->print((char) messageType);
+            debug->print((char) type);
             debug->print("'");
         }
         debug->print("\n---- ");
 
-        if (messageLength > 0) {
-            for (int i = 0; i < messageLength; i++) {
-                debug->print(buf[i], HEX);
+        if (dataLen > 0) {
+            for (uint16_t i = 0; i < dataLen; i++) {
+                debug->print(data[i], HEX);
                 debug->print(" ");
             }
             debug->println("");
@@ -307,10 +2150,10 @@ void CMRI::printCurrentMessage(const char *tag)
  * Do whatever we are supposed to do with the current message (this may
  * include doing nothing because the message is not for this node).
  *
- * Future code will implement the extended CMRInet protocol as proposed by
- * Catania & Neumann (2013).   This will be done either by directly 
- * adding the code in this library, or by allowing for user programs to
- * register callback handlers for specific CMRI protocol message types.
+ * A message handler registered for the message type gets the first look
+ * at it (this is how the extended CMRInet protocol as proposed by
+ * Catania & Neumann (2013) can be implemented).  If there is none, or it
+ * declines the message, the 'I', 'T' and 'P' messages are handled here.
  *
  * Unknown message types are silently ignored.
  * 
@@ -323,8 +2166,14 @@ void CMRI::processMessage()
     if (debug) {
         printCurrentMessage("---- complete message received: dest ");
     }
+
+    bool broadcast = false;
+#ifdef CMRI_BROADCAST_ADDR
+    broadcast = (messageDest == CMRI_BROADCAST_ADDR);
+#endif
+
     // do not process the message if it is not addressed to us
-    if (!isForMe())
+    if (!isForMe() && !broadcast && !monitor)
         return;
 
 
@@ -334,6 +2183,27 @@ void CMRI::processMessage()
     }
 
     messagesProcessed += 1;
+    TRACE(TRACE_FRAME, messageDest, messageType, messageLength > 255 ? 255 : messageLength);
+
+    // the main object's handlers serve every stream; they are handed the
+    // object the message came in on, so that a reply goes back out there
+    CMRIMessageHandler *handlers = owner != NULL ? owner->messageHandlers : messageHandlers;
+    uint8_t slot = messageType - FIRST_HANDLER_TYPE;
+    if (slot < NUM_HANDLER_TYPES && handlers[slot] != NULL) {
+        HANDLER_TIMER_START(t);
+        bool handled = (*handlers[slot]) (*this, messageDest - 65, messageType, buf,
+                                          messageLength);
+        HANDLER_TIMER_STOP(t);
+
+        if (handled) {
+            return;
+        }
+    }
+
+    // broadcasts (and everything, in monitor mode) are only for message
+    // handlers; a node must never reply to one on its own
+    if (broadcast || monitor)
+        return;
 
     switch (messageType) {
     case 'I':
@@ -352,6 +2222,22 @@ void CMRI::processMessage()
 }
 
 
+/*
+ * The ETX of a message for another node has been seen: count it, and get
+ * ready for the next message.
+ */
+
+void CMRI::endSkippedFrame()
+{
+    messagesSeen += 1;
+    framesSkipped += 1;
+    bytesSkipped += charCount - skipStart;
+    TRACE(TRACE_SKIP, messageDest, messageType,
+          charCount - skipStart > 255 ? 255 : charCount - skipStart);
+    changeState(START, ETX);
+}
+
+
 /* Add the given character to the current message, checking to make sure
  * the message buffer is not overflowed.
  */
@@ -359,15 +2245,47 @@ void CMRI::processMessage()
 bool CMRI::addCharToMessage(uint8_t b)
 {
     // we cannot save the data if it exceeds our maximum message length
-    if (messageLength >= MAX_MESG_LEN) {
+    if (messageLength >= bufSize) {
         return false;
     }
 
     buf[messageLength++] = b;
+    if (stageNode != NULL) {
+        stageOutputs(messageLength - 1);
+    }
     return true;
 }
 
 
+/*
+ * Compare the bytes of a 'T' message from buf[from] to the end of what
+ * has been received to the output model, and keep the changed bits until
+ * the ETX (see setStreamingOutputs)
+ */
+
+void CMRI::stageOutputs(uint16_t from)
+{
+    CMRINode & n = *stageNode;
+    uint16_t end = CMRINode::bytesForLines(n.numOutputs);
+
+    if (end > messageLength) {
+        end = messageLength;
+    }
+
+    for (uint16_t i = from; i < end; i++) {
+        uint8_t changed = buf[i] ^ n.outputs[i];
+
+        stage[i] = changed;
+        if (changed != 0) {
+            if (stageEnd == 0) {
+                stageFirst = i;
+            }
+            stageEnd = i + 1;
+        }
+    }
+}
+
+
 /*
  * Throw away all knowledge about the current message
  */
@@ -377,15 +2295,17 @@ void CMRI::resetMessage()
     messageType = 0;
     messageDest = -1;
     messageLength = 0;
+    currentNode = NULL;
+    stageNode = NULL;
 }
 
 
 /* 
  * Return a textual version of the cmriStreamState enum, used for debugging 
  */
-char *CMRI::printState(cmriStreamState state)
+const char *CMRI::printState(cmriStreamState state)
 {
-    char *str;
+    const char *str;
     switch (state) {
     case START:
         str = "START";
@@ -408,6 +2328,12 @@ char *CMRI::printState(cmriStreamState state)
     case DATA_NEXT:
         str = "DATA_NEXT";
         break;
+    case SKIP_NEXT:
+        str = "SKIP_NEXT";
+        break;
+    case SKIP_ESCAPED_NEXT:
+        str = "SKIP_ESCAPED_NEXT";
+        break;
     default:
         str = "*** UNKNOWN ***";
         break;
@@ -440,7 +2366,39 @@ void CMRI::changeState(cmriStreamState newState, uint8_t inputChar)
         }
     }
 
-    currentState = newState;
+    if (newState != currentState) {
+        TRACE(TRACE_STATE, currentState, newState, inputChar);
+    }
+
+    currentState = newState;
+}
+
+
+/*
+ * Header state transitions, indexed by the current state and the class of
+ * the input character (ATTN, STX, anything else).  The header states are
+ * the first five values of cmriStreamState, so they index this directly.
+ * HEADER_ERROR marks a character that is not allowed in that state.
+ */
+
+enum { CLASS_ATTN, CLASS_STX, CLASS_OTHER };
+
+const uint8_t CMRI::headerTable[5][3] = {
+    // START: we can only leave START with an ATTN byte
+    {ATTN_NEXT, HEADER_ERROR, HEADER_ERROR},
+    // ATTN_NEXT: but we must have two of them in a row
+    {STX_NEXT, HEADER_ERROR, HEADER_ERROR},
+    // STX_NEXT: two ATTNs should be followed by STX, or else we start over
+    {HEADER_ERROR, ADDR_NEXT, HEADER_ERROR},
+    // ADDR_NEXT: the destination byte can be anything
+    {TYPE_NEXT, TYPE_NEXT, TYPE_NEXT},
+    // TYPE_NEXT: as can the message type byte
+    {MAYBE_DATA_NEXT, MAYBE_DATA_NEXT, MAYBE_DATA_NEXT},
+};
+
+static inline uint8_t charClass(uint8_t b)
+{
+    return (b == ATTN) ? CLASS_ATTN : (b == STX) ? CLASS_STX : CLASS_OTHER;
 }
 
 
@@ -455,37 +2413,63 @@ void CMRI::nextChar(uint8_t b)
 {
     charCount += 1;
 
-    switch (currentState) {
-    case START:
-        // we can only leave START with an ATTN byte
-        changeState((b == ATTN) ? ATTN_NEXT : error(), b);
-        resetMessage();
-        break;
-
-    case ATTN_NEXT:
-        // but we must have two of them in a row
-        changeState((b == ATTN) ? STX_NEXT : error(), b);
-        break;
+    if (currentState >= SKIP_NEXT) {
+        // this message is for some other node, so all that matters is
+        // where it ends
+        if (currentState == SKIP_ESCAPED_NEXT) {
+            currentState = SKIP_NEXT;
+        } else if (b == DLE) {
+            currentState = SKIP_ESCAPED_NEXT;
+        } else if (b == ETX) {
+            endSkippedFrame();
+        }
+        return;
+    }
 
-    case STX_NEXT:
-        // two ATTNs should be followed by STX, or else we start over
-        changeState((b == STX) ? ADDR_NEXT : error(), b);
-        break;
+    if (currentState <= TYPE_NEXT) {
+        uint8_t next = headerTable[currentState][charClass(b)];
 
-    case ADDR_NEXT:
-        // once we've started the message, the next couple of bytes
-        // are of fixed interpretation.   First comes the message
-        // destination byte
-        messageDest = (uint8_t) b;
-        changeState(TYPE_NEXT, b);
-        break;
+        switch (currentState) {
+        case START:
+            resetMessage();
+            break;
+        case ADDR_NEXT:
+            // once we've started the message, the next couple of bytes
+            // are of fixed interpretation.   First comes the message
+            // destination byte
+            messageDest = (uint8_t) b;
+            currentNode = monitor ? NULL : findNode(b);
+            break;
+        case TYPE_NEXT:
+            // and then comes the message type byte.  If the message is
+            // not for any node served here, the rest of it is skipped.
+            messageType = b;
+            if (currentNode == NULL && !monitor
+#ifdef CMRI_BROADCAST_ADDR
+                && messageDest != CMRI_BROADCAST_ADDR
+#endif
+                ) {
+                skipStart = charCount;
+                next = SKIP_NEXT;
+            } else if (b == 'T' && streamingOutputs && currentNode != NULL
+                       && currentNode->outputs != NULL) {
+                stageNode = currentNode;
+                stageGeneration = currentNode->outputGeneration;
+                stageEnd = 0;
+            }
+            break;
+        default:
+            break;
+        }
 
-    case TYPE_NEXT:
-        // and then comes the message type byte
-        messageType = b;
-        changeState(MAYBE_DATA_NEXT, b);
-        break;
+        if (next & HEADER_ERROR) {
+            next = error(currentState == STX_NEXT ? ERROR_NO_STX : ERROR_JUNK);
+        }
+        changeState((cmriStreamState) next, b);
+        return;
+    }
 
+    switch (currentState) {
     case MAYBE_DATA_NEXT:
         // after the destination and type comes the data portion of the
         // message.  This portion may be empty.  To put the characters
@@ -495,7 +2479,10 @@ void CMRI::nextChar(uint8_t b)
         case ETX:
 	    // we have reached the end of the message, so we do something
 	    // with it, and then start on the next one
+            etxMicros = micros();
+            processing = true;
             processMessage();
+            processing = false;
             changeState(START, b);
             break;
         case DLE:
@@ -507,7 +2494,7 @@ void CMRI::nextChar(uint8_t b)
 	    // if it's not a special character, then we try to add this to
 	    // the message buffer.  If that fails (the message is too long),
 	    // then this is an error.
-            changeState(addCharToMessage(b) ? MAYBE_DATA_NEXT : error(), b);
+            changeState(addCharToMessage(b) ? MAYBE_DATA_NEXT : error(ERROR_OVERFLOW), b);
             break;
         }
         break;
@@ -521,15 +2508,15 @@ void CMRI::nextChar(uint8_t b)
         // to be completely true to the protocol, this should probably reject
         // escaped data characters that are not STX, ETX or DLE
 
-        if ((b == STX || b == ETX || b == DLE) && addCharToMessage(b)) {
-            changeState(MAYBE_DATA_NEXT, b);
+        if (b != STX && b != ETX && b != DLE) {
+            changeState(error(ERROR_ESCAPE), b);
         } else {
-            changeState(error(), b);
+            changeState(addCharToMessage(b) ? MAYBE_DATA_NEXT : error(ERROR_OVERFLOW), b);
         }
 #else
         // be liberal in what you accept, strict in what you emit
 
-        changeState(addCharToMessage(b) ? MAYBE_DATA_NEXT : error(), b);
+        changeState(addCharToMessage(b) ? MAYBE_DATA_NEXT : error(ERROR_OVERFLOW), b);
 #endif
         break;
 
@@ -542,39 +2529,25 @@ void CMRI::nextChar(uint8_t b)
             debug->print(", input char is ");
             debug->println(b, HEX);
         }
-        changeState(error(), b);
+        changeState(error(ERROR_STATE), b);
     }
 }
 
 
 
-/*
- * set the state of the local model for the output lines, checking to make 
- * sure we don't process more lines than we initialized
- *
- * The user defined output handler function is called, with the current
- * output line number and the current state (on, !on)
- */
-void CMRI::setOutput(uint16_t line, bool isOn)
-{
-    if (outputs != NULL && line < numOutputs) {
-        outputs[line] = isOn;
-        if (perLineOutputHandler != NULL) {
-            (*perLineOutputHandler) (line, isOn);
-        }
-    }
-}
-
-
 /*
  * this is used to respond to the P message.  
  *
  * for each of the input lines that we have configured, call the
- * inputHandler to get the current state of the input line.
+ * inputHandler to get the current state of the input line (or call the
+ * bulkInputHandler once, to fill in all of them).  When the inputs are
+ * being scanned in the background, the latest snapshot is used instead.
  *
- * Then assemble each of the returned bit values into a byte array of
- * suitable size and then send the collection of values back in a
- * response (R) message.
+ * The packed input model is then already in the format of the data
+ * portion of the response (R) message, which is sent back.  The encoded
+ * reply is kept in the transmit buffer, and when the same node is polled
+ * next, it is patched (see patchReply) rather than built again, until
+ * something else is sent.
  */
 
 void CMRI::pollInputs()
@@ -583,30 +2556,128 @@ void CMRI::pollInputs()
         debug->println("pollInputs()");
     }
 
-    if (inputHandler == NULL || inputs == NULL) {
+    CMRINode & n = *currentNode;
+
+    if ((n.inputHandler == NULL && n.bulkInputHandler == NULL) || n.inputs == NULL) {
         return;
     }
 
-    for (uint16_t i = 0; i < numInputs; i++) {
-        if (0 && debug) {
-            debug->print("checking input ");
-            debug->println(i);
+    uint16_t modelBytes = CMRINode::bytesForLines(n.numInputs);
+
+    // with background scanning, the snapshot is reported as it is
+    if (!n.scanEnabled) {
+        n.snapshotMicros = micros();
+        HANDLER_TIMER_START(t);
+        n.scanInputs(0, n.numInputs);
+        HANDLER_TIMER_STOP(t);
+    }
+
+    // the packed input model is already in wire format.  The reply is
+    // as long as the host configured with 'I', or before that, one byte
+    // more than the whole bytes of inputs, as it always has been.
+    uint16_t messageByteCount = (n.numInputs / 8) + 1;
+    if (n.config.nodeType != 0) {
+        messageByteCount = n.config.inputLines / 8;
+        if (modelBytes > messageByteCount) {
+            modelBytes = messageByteCount;
+        }
+    }
+    if (messageByteCount > bufSize || messageByteCount > maxMessageLength()) {
+        // the buffers are too small for this many inputs: answer nothing,
+        // but say so
+        countError(ERROR_CAPACITY);
+        if (debug) {
+            debug->print("too many inputs for the message buffer: ");
+            debug->println(n.numInputs);
         }
+        return;
+    }
+
+    if (txSent < txLength || transmitEnabled) {
+        return;
+    }
+
+    // the last reply is still in the transmit buffer: if it was this
+    // node's, only the bytes that have changed since are encoded again
+    if (replyNode == &n && replyLength == messageByteCount && replyModelBytes == modelBytes
+        && debug == NULL) {
+        TRACE(TRACE_REPLY, n.nodeId, 'R', messageByteCount > 255 ? 255 : messageByteCount);
+        patchReply(n.inputs, modelBytes);
+        txLength = replyFrameLength;
+        queueFrame();
+        return;
+    }
+
+    memcpy(buf, n.inputs, modelBytes);
+    memset(buf + modelBytes, 0, messageByteCount - modelBytes);
+
+    encodeFrame(n.nodeId, 'R', buf, messageByteCount);
+
+    replyNode = &n;
+    replyLength = messageByteCount;
+    replyModelBytes = modelBytes;
+    replyFrameLength = txLength;
+    replyEscapes = txLength - messageByteCount - 6;
+
+    queueFrame();
+}
+
+
+/*
+ * Bring the 'R' reply in the transmit buffer up to date with the first
+ * dataLen bytes of its data, which are read back from the frame itself.
+ * Only the bytes that differ are encoded again.  When one of them gains
+ * or loses its DLE escape, the rest of the frame is moved along by a
+ * character.  A frame with no escapes in it is compared all at once, so
+ * when nothing has changed, that is all it costs.
+ */
 
-        bool val = (*inputHandler) (i);
+void CMRI::patchReply(const uint8_t * data, uint16_t dataLen)
+{
+    uint8_t *frame = txBuf + 5; // after ATTN ATTN STX, the address and the type
+    uint8_t *p = frame;
+    uint16_t i = 0;
 
-        inputs[i] = val;
+    if (replyEscapes == 0) {
+        if (memcmp(frame, data, dataLen) == 0) {
+            return;
+        }
+        while (frame[i] == data[i]) {
+            i++;
+        }
+        p = frame + i;
     }
 
-    uint16_t messageByteCount = (numInputs / 8) + 1;
-    if (messageByteCount < MAX_MESG_LEN) {
-        for (int i = 0; i < numInputs; i++) {
-            setBit(buf, MAX_MESG_LEN, i, inputs[i]);
+    for (; i < dataLen; i++) {
+        uint8_t wasEscaped = (*p == DLE);
+        uint8_t b = data[i];
+
+        if (p[wasEscaped] == b) {
+            p += 1 + wasEscaped;
+            continue;
+        }
+
+        uint8_t escaped = (b == ETX || b == STX || b == DLE);
+
+        if (escaped != wasEscaped) {
+            uint8_t *rest = p + 1 + wasEscaped;
+            uint8_t *end = txBuf + replyFrameLength;
+
+            if (escaped) {
+                memmove(rest + 1, rest, end - rest);
+                replyFrameLength++;
+                replyEscapes++;
+            } else {
+                memmove(rest - 1, rest, end - rest);
+                replyFrameLength--;
+                replyEscapes--;
+            }
         }
 
-        messageType = 'R';
-        messageLength = messageByteCount;
-        sendMessage();
+        if (escaped) {
+            *p++ = DLE;
+        }
+        *p++ = b;
     }
 }
 
@@ -614,65 +2685,409 @@ void CMRI::pollInputs()
 /*
  * this is used to respond to the initialization (I) message
  * 
- * call the install initHandler (if there is one) with the
- * message contents
+ * The message is decoded into the node's configuration, which is checked
+ * against the line models, and then the initHandler (if there is one) is
+ * called with the message contents, and may reject it.
  */
 
 void CMRI::processInit()
 {
-    if (initHandler) {
+    CMRINode & n = *currentNode;
+    CMRINode::Config previous = n.config;
+    CMRINode::Config c;
+
+    if (decodeInit(buf, messageLength, c)) {
+        c.linesMatch = (CMRINode::bytesForLines(n.numInputs) == c.inputLines / 8
+                        && CMRINode::bytesForLines(n.numOutputs) == c.outputLines / 8);
+        if (!c.linesMatch) {
+            countError(ERROR_CONFIG);
+            if (debug) {
+                debug->print("init: host expects inputs/outputs ");
+                debug->print(c.inputLines);
+                debug->print("/");
+                debug->print(c.outputLines);
+                debug->print(", node has ");
+                debug->print(n.numInputs);
+                debug->print("/");
+                debug->println(n.numOutputs);
+            }
+        }
+        n.config = c;
+    } else {
+        countError(ERROR_INIT);
+        if (debug) {
+            debug->println("init: malformed 'I' message ignored");
+        }
+    }
 
-        bool rv = (*initHandler) (buf, messageLength);
+    if (n.initHandler) {
+        HANDLER_TIMER_START(t);
+        bool accepted = (*n.initHandler) (buf, messageLength);
+        HANDLER_TIMER_STOP(t);
 
-        // potentially do something with the initialization data
+        if (!accepted) {
+            n.config = previous;
+        }
     }
 }
 
 
 /*
- * this is used to process the transmit (T) message
+ * Decode the data of an 'I' message, which is
  *
- * for each bit in the sent collection of output bits,
- * compare the value to the local model values
+ *   NDP DH DL NS CT...
  *
- * If there is any change, call setOutput which will do whatever needs to
- * be done (update the local model and then call the outputHandler
- * callback).
+ * NDP is the node type.  DH and DL are the transmit delay, in units of
+ * 10 microseconds.  For an SMINI, NS is the number of 2 lead searchlight
+ * signals, and 6 CT bytes give their locations if there are any.  For a
+ * USIC or SUSIC, NS is the number of CT bytes, each describing 4 cards
+ * (2 bits each, from the low bits up: 01 input, 10 output, 00 none).
  *
+ * Returns false if the message is not a valid configuration.
  */
 
-void CMRI::processOutputs()
+bool CMRI::decodeInit(const uint8_t * data, uint16_t dataLen, CMRINode::Config & c)
 {
-    bool anyChanges = false;
+    memset(&c, 0, sizeof(c));
+
+    if (dataLen < 4) {
+        return false;
+    }
+
+    c.nodeType = data[0];
+    c.transmitDelay = ((unsigned long) data[1] << 8 | data[2]) * 10;
+
+    uint8_t ns = data[3];
+
+    switch (c.nodeType) {
+    case 'M':
+        if (ns > 24 || (ns > 0 && dataLen < 4 + 6)) {
+            return false;
+        }
+        c.numSearchlights = ns;
+        c.inputLines = 24;
+        c.outputLines = 48;
+        return true;
 
+    case 'N':
+    case 'X':
+        if (ns > 16 || dataLen < 4 + ns) {
+            return false;
+        }
+        for (uint8_t i = 0; i < ns; i++) {
+            for (uint8_t shift = 0; shift < 8; shift += 2) {
+                uint8_t card = (data[4 + i] >> shift) & 0x03;
+
+                if (card == 0x01) {
+                    c.inputCards += 1;
+                } else if (card == 0x02) {
+                    c.outputCards += 1;
+                } else if (card == 0x03) {
+                    return false;
+                }
+            }
+        }
+        c.inputLines = c.inputCards * (c.nodeType == 'N' ? 24 : 32);
+        c.outputLines = c.outputCards * (c.nodeType == 'N' ? 24 : 32);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * this is used to process the transmit (T) message
+ *
+ * The outputs are not changed here.  Instead, the message is marked as
+ * pending, and check() calls applyNextOutput() until every output line
+ * has been compared to the local model.  The message stays in buf until
+ * then, because check() does not read any more characters while outputs
+ * are pending.
+ *
+ * With streaming outputs, the message has already been compared to the
+ * model as it arrived, and only the bytes that changed are visited, along
+ * with any lines beyond the end of the message.  If the model has changed
+ * since then (by a message on another stream), it is compared again.
+ */
+
+void CMRI::processOutputs()
+{
     if (debug) {
         debug->println("processOutputs()");
     }
 
-    if (outputs == NULL) {
+    if (currentNode->outputs == NULL || currentNode->numOutputs == 0) {
         if (debug)
             debug->println("no outputs object");
         return;
     }
 
+    outputNode = currentNode;
+    outputsPending = true;
+    outputsChanged = false;
+    outputCursor = 0;
+    outputTail = 0;
+    changeMask = 0;
+
+    if (stageNode == currentNode && stageGeneration == currentNode->outputGeneration) {
+        outputCursor = stageEnd != 0 ? stageFirst : 0;
+        outputTail = messageLength;
+    } else {
+        stageEnd = 0;
+    }
+    stageNode = NULL;
+}
+
+
+/*
+ * The control line of an effect, or one of the lines it drives, has been
+ * set: start or stop the effects it controls.  Returns true if an effect
+ * drives the line, so that it is not handed over as it is.
+ */
+bool CMRINode::controlEffects(uint16_t line, bool isOn)
+{
+    bool driven = false;
+
+    for (uint8_t i = 0; i < numEffects; i++) {
+        Effect & e = effects[i];
+
+        if (e.controlLine == line && e.running != isOn) {
+            if (isOn) {
+                moveEffect(e, true, true);
+                e.due = millis() + e.onMillis;
+                queueEffect(i);
+            } else {
+                unqueueEffect(i);
+                moveEffect(e, false, false);
+            }
+        }
+        if (line >= e.firstLine && line < e.firstLine + e.numLines) {
+            driven = true;
+        }
+    }
+    return driven;
+}
+
+/*
+ * Change the state of an effect, handing over each of its lines whose
+ * state that changes
+ */
+void CMRINode::moveEffect(Effect & e, bool running, bool lit)
+{
+    for (uint16_t i = 0; i < e.numLines; i++) {
+        bool odd = e.kind == EFFECT_ALTERNATE && (i & 1);
+        bool was = e.running && (e.lit != odd);
+        bool now = running && (lit != odd);
+
+        if (now != was) {
+            driveOutput(e.firstLine + i, now);
+        }
+    }
+    e.running = running;
+    e.lit = lit;
+}
+
+/*
+ * An effect is due: take its next step, and put it back on the wheel for
+ * the one after that.  The steps keep to the times they were first given
+ * unless the effect has fallen a whole step behind.
+ */
+void CMRINode::stepEffect(uint8_t index, unsigned long now)
+{
+    Effect & e = effects[index];
+
+    if (e.kind == EFFECT_PULSE) {
+        moveEffect(e, true, false);
+        return;
+    }
+
+    moveEffect(e, true, !e.lit);
+    e.due += e.lit ? e.onMillis : e.offMillis;
+    if ((long) (now - e.due) >= 0) {
+        e.due = now + (e.lit ? e.onMillis : e.offMillis);
+    }
+    queueEffect(index);
+}
+
+/*
+ * Put an effect on the wheel, in the first slot that starts at or after
+ * its due time (and at least the next slot), ahead of the others there
+ */
+void CMRINode::queueEffect(uint8_t index)
+{
+    Effect & e = effects[index];
+    long ahead = (long) (e.due - wheelMillis);
+    unsigned long ticks = ahead > 0 ? ((unsigned long) ahead + EFFECT_TICK - 1) / EFFECT_TICK : 1;
+
+    e.slot = (wheelSlot + ticks) % EFFECT_SLOTS;
+    e.next = wheel[e.slot];
+    wheel[e.slot] = index;
+}
+
+/* Take an effect off the wheel, if it is on it */
+void CMRINode::unqueueEffect(uint8_t index)
+{
+    Effect & e = effects[index];
+
+    if (e.slot == NO_EFFECT) {
+        return;
+    }
+
+    uint8_t *link = &wheel[e.slot];
+    while (*link != index) {
+        link = &effects[*link].next;
+    }
+    *link = e.next;
+    e.slot = NO_EFFECT;
+}
+
+/*
+ * Called by check(): run the slots of the wheel that have started since
+ * the last call, stepping the effects in them that are due and putting
+ * back the ones that are due on a later turn of the wheel.  A call with
+ * no new slot costs a subtraction, and one with nothing due a look at
+ * each new slot.  The lines of every effect stepped are handed over
+ * together at the end.
+ */
+void CMRINode::runEffects()
+{
+    unsigned long now = millis();
+    unsigned long ticks = (now - wheelMillis) / EFFECT_TICK;
+
+    if (ticks == 0) {
+        return;
+    }
+
+    // after a long wait, a single turn of the wheel catches up
+    if (ticks > EFFECT_SLOTS) {
+        wheelMillis += (ticks - EFFECT_SLOTS) * EFFECT_TICK;
+        wheelSlot = (wheelSlot + ticks - EFFECT_SLOTS) % EFFECT_SLOTS;
+        ticks = EFFECT_SLOTS;
+    }
+
+    bool stepped = false;
+
+    while (ticks-- > 0) {
+        wheelSlot = (wheelSlot + 1) % EFFECT_SLOTS;
+        wheelMillis += EFFECT_TICK;
+
+        uint8_t index = wheel[wheelSlot];
+        wheel[wheelSlot] = NO_EFFECT;
+
+        while (index != NO_EFFECT) {
+            Effect & e = effects[index];
+            uint8_t next = e.next;
+
+            e.slot = NO_EFFECT;
+            if ((long) (now - e.due) >= 0) {
+                stepEffect(index, now);
+                stepped = true;
+            } else {
+                queueEffect(index);
+            }
+            index = next;
+        }
+    }
+
+    if (stepped) {
+        finishOutputs();
+        reportOutputs();
+    }
+}
+
+/*
+ * Hand the state of every output line, as it was handed over, to the
+ * overallOutputHandler, if there is one
+ */
+void CMRINode::reportOutputs()
+{
+    if (overallOutputHandler != NULL && outputFlags != NULL) {
+        (*overallOutputHandler) (numOutputs, outputFlags);
+    }
+}
+
+
+/*
+ * Apply the pending 'T' message up to (and including) the next output
+ * line that has changed.
+ *
+ * The incoming bits are compared to the local model a word at a time:
+ * the XOR of the two is the set of lines that changed, and only those
+ * set bits are visited.  For each of them, setOutput will do whatever
+ * needs to be done (update the local model and then call the
+ * outputHandler callback).  A 'T' message that changes nothing costs one
+ * compare per word.
+ */
+
+void CMRI::applyNextOutput()
+{
+    typedef CMRINode::word_t word_t;
+    CMRINode & n = *outputNode;
+
+    for (;;) {
+        if (changeMask != 0) {
+            uint8_t bit = __builtin_ctz(changeMask);
+            uint16_t line = changeBase + bit;
+
+            changeMask &= changeMask - 1;
+
+            // the new state comes from the message, since another stream
+            // (see addStream) may have set the line since it was compared
+            bool isOn = line / 8 < messageLength && (buf[line / 8] & (1 << (line % 8)));
+            if (isOn == ((n.outputs[line / 8] & (1 << (line % 8))) != 0)) {
+                continue;
+            }
+
+            outputsChanged = true;
+            HANDLER_TIMER_START(t);
+            n.setOutput(line, isOn);
+            HANDLER_TIMER_STOP(t);
+            return;
+        }
 
-    // go through each output bit, and see if it has changed
-    // from the last time around.  If it has, perform a callback
-    // with that state.
+        // past the staged bytes, the rest of the message is unchanged
+        if (outputCursor >= stageEnd && outputCursor < outputTail) {
+            outputCursor = outputTail;
+        }
 
-    for (uint16_t i = 0; i < numOutputs; i++) {
-        if (0 && debug) {
-            debug->print("checking status of line ");
-            debug->println(i);
+        if (outputCursor >= CMRINode::bytesForLines(n.numOutputs)) {
+            break;
         }
 
-        bool local = outputs[i];
-        bool incoming = getBit(buf, messageLength, i);
+        uint16_t step = sizeof(word_t);
+
+        changeBase = outputCursor * 8;
+        if (outputCursor < stageEnd) {
+            changeMask = loadWord < word_t > (stage + outputCursor, stageEnd - outputCursor);
+            if (step > stageEnd - outputCursor) {
+                step = stageEnd - outputCursor;
+            }
+        } else {
+            // after staged bytes the cursor need not be on a word, so
+            // the model is only read up to the end of its last word
+            word_t incoming = loadWord < word_t > (buf + outputCursor, messageLength - outputCursor);
+            word_t local = loadWord < word_t > (n.outputs + outputCursor,
+                                                CMRINode::wordBytesForLines(n.numOutputs)
+                                                - outputCursor);
+
+            changeMask = incoming ^ local;
+        }
 
-        if (local != incoming) {
-            anyChanges = true;
-            setOutput(i, incoming);
+        // ignore any bits beyond the last configured line
+        uint16_t linesLeft = n.numOutputs - changeBase;
+        if (linesLeft < sizeof(word_t) * 8) {
+            changeMask &= ((word_t) 1 << linesLeft) - 1;
         }
+
+        outputCursor += step;
+    }
+
+    if (outputsChanged) {
+        HANDLER_TIMER_START(t);
+        n.finishOutputs();
+        HANDLER_TIMER_STOP(t);
     }
 
     // lastly, we call the overallOutputHandler to let the
@@ -680,42 +3095,127 @@ void CMRI::processOutputs()
     // anything has changed since the last time around, and
     // if the overallOutputHandler is actually defined.
 
-    if (anyChanges && overallOutputHandler != NULL) {
-	(*overallOutputHandler)(numOutputs, outputs);
+    if (outputsChanged && n.overallOutputHandler != NULL && n.outputFlags != NULL) {
+        HANDLER_TIMER_START(t);
+        (*n.overallOutputHandler) (n.numOutputs, n.outputFlags);
+        HANDLER_TIMER_STOP(t);
     }
 
+    outputsPending = false;
 }
 
 
 /*
- * this is used to send the current message contents to the serial stream
- * (as from the response to the 'P' message)
- *
- * This needs a better API to allow user handlers to other message types to
- * be able to send responses.  Right now this method depends entirely on
- * private data types (which pollInputs has access to).
- *
+ * Assert the RS-485 driver enable (if there is one), as late as
+ * possible: right before the first byte of the frame is written.
  */
 
-void CMRI::sendMessage()
+void CMRI::beginTransmit()
 {
-    if (debug) {
-        printCurrentMessage("---- complete message being sent: sender ");
+    if (transmitEnablePin < 0 && transmitEnableHandler == NULL) {
+        return;
+    }
+
+    // nothing of ours is queued, so this is what an empty buffer looks like
+    txRoomWhenEmpty = stream.availableForWrite();
+
+    setTransmitEnable(true);
+    enableMicros = micros();
+
+    // only a reply has a request whose ETX it can be measured from
+    if (txReply) {
+        timing.requestToEnable = enableMicros - etxMicros;
+        if (timing.requestToEnable > timing.maxRequestToEnable) {
+            timing.maxRequestToEnable = timing.requestToEnable;
+        }
     }
+}
 
-    stream.write(0xff);
-    stream.write(0xff);
-    stream.write(STX);
 
-    stream.write(nodeId);
-    stream.write(messageType);
+/*
+ * Release the RS-485 driver enable if the whole frame has left the UART.
+ * Returns true once that has been done.
+ *
+ * With a transmitIdleHandler, that tells us when the last stop bit is
+ * gone.  Otherwise, once availableForWrite() shows the transmit buffer
+ * has emptied, flush() waits out the character still in the shift
+ * register, which is at most one character time.
+ */
+
+bool CMRI::finishTransmit()
+{
+    if (txSent < txLength) {
+        return false;
+    }
 
-    for (int i = 0; i < messageLength; i++) {
-        if (buf[i] == ETX || buf[i] == STX || buf[i] == DLE) {
-            stream.write(DLE);
+    if (transmitIdleHandler != NULL) {
+        if (!(*transmitIdleHandler) ()) {
+            return false;
+        }
+    } else {
+        if (nonBlockingTransmit && stream.availableForWrite() < txRoomWhenEmpty) {
+            return false;
         }
-        stream.write(buf[i]);
+        stream.flush();
+    }
+
+    setTransmitEnable(false);
+
+    unsigned long now = micros();
+
+    timing.lastWriteToRelease = now - lastWriteMicros;
+    timing.enabledFor = now - enableMicros;
+    if (timing.lastWriteToRelease > timing.maxLastWriteToRelease) {
+        timing.maxLastWriteToRelease = timing.lastWriteToRelease;
+    }
+    if (timing.enabledFor > timing.maxEnabledFor) {
+        timing.maxEnabledFor = timing.enabledFor;
+    }
+
+    return true;
+}
+
+
+/*
+ * Drive the RS-485 driver enable pin or handler
+ */
+
+void CMRI::setTransmitEnable(bool enable)
+{
+    if (transmitEnablePin >= 0) {
+        digitalWrite(transmitEnablePin, enable ? HIGH : LOW);
+    }
+    if (transmitEnableHandler != NULL) {
+        (*transmitEnableHandler) (enable);
+    }
+
+    transmitEnabled = enable;
+}
+
+
+/*
+ * Write as much of the pending frame as the stream will take without
+ * blocking, returning the number of bytes written.
+ */
+
+uint16_t CMRI::drainTransmit()
+{
+    uint16_t remaining = txLength - txSent;
+    int room = stream.availableForWrite();
+
+    if (room <= 0) {
+        return 0;
+    }
+    if ((uint16_t) room < remaining) {
+        remaining = room;
+    }
+
+    uint16_t written = stream.write(txBuf + txSent, remaining);
+    txSent += written;
+
+    if (txSent >= txLength) {
+        lastWriteMicros = micros();
     }
 
-    stream.write(ETX);
+    return written;
 }
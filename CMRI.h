@@ -18,47 +18,457 @@
 
 #include "Arduino.h"
 
+/*
+ * The number of node addresses one CMRI object can serve (see addNode).
+ * Serving more than one costs a 128 byte address lookup table.
+ */
+#ifndef CMRI_MAX_NODES
+#define CMRI_MAX_NODES 1
+#endif
+
+/*
+ * Set to 1 to collect the counters and histograms returned by
+ * getMetrics().  When 0, none of it is compiled in.
+ */
+#ifndef CMRI_METRICS
+#define CMRI_METRICS 0
+#endif
+
+/*
+ * The size in bytes of the trace ring buffer (see setTraceStream), a
+ * multiple of 8.  When 0, tracing is not compiled in.
+ */
+#ifndef CMRI_TRACE_SIZE
+#define CMRI_TRACE_SIZE 0
+#endif
+
+/*
+ * The number of output changes handed to the outputChangeHandler in one
+ * call (see setOutputChangeHandler).  A 'T' message that changes more
+ * lines than this is handed over in several calls.
+ */
+#ifndef CMRI_OUTPUT_CHANGES
+#define CMRI_OUTPUT_CHANGES 16
+#endif
+
+/*
+ * The number of output effects (see addOutputEffect) a node can have, at
+ * most 254.  The table is only allocated for a node that uses effects.
+ */
+#ifndef CMRI_EFFECTS
+#define CMRI_EFFECTS 8
+#endif
+
+/*
+ * With more than one stream (see addStream), the units of work (mostly
+ * characters) each stream may take in check() before the next gets its
+ * turn
+ */
+#ifndef CMRI_STREAM_QUANTUM
+#define CMRI_STREAM_QUANTUM 16
+#endif
+
+class CMRI;
+class CMRIRing;
+
+/*
+ * One output line changed by a 'T' message
+ */
+struct CMRIOutputChange {
+    uint16_t line;
+    bool isOn;
+};
+
+/*
+ * A user function to handle one type of message (see setMessageHandler).
+ * It is given the node the message was addressed to (0 to 127), the
+ * message type and the data portion of the message, which is only valid
+ * for the duration of the call.  It returns true if it has dealt with the
+ * message, or false to let the library handle it as it would otherwise.
+ */
+typedef bool(*CMRIMessageHandler) (CMRI & cmri, uint8_t nodeId, uint8_t type,
+                                   const uint8_t * data, uint16_t dataLen);
+
+/*
+ * Everything that belongs to one C/MRI node address: the handlers and the
+ * input and output line models.  A CMRI object has one of these built in
+ * (for the node given to its constructor), and can serve more.
+ */
+
+class CMRINode {
+  public:
+    /*
+     * The line models are kept packed, 8 lines per byte, in the same
+     * layout as the data portion of the 'R' and 'T' messages.  They are
+     * allocated in whole words so that they can be compared a word at a
+     * time.
+     */
+#if defined(__AVR__)
+    typedef uint8_t word_t;
+#else
+    typedef uint32_t word_t;
+#endif
+
+    CMRINode(uint8_t nodeId);
+
+    // the node configuration sent by the host in an 'I' message
+    struct Config {
+        uint8_t nodeType;       // 'M' (SMINI), 'N' (USIC), 'X' (SUSIC), or 0 if none yet
+        unsigned long transmitDelay;    // microseconds to wait before replying
+        uint8_t numSearchlights;        // SMINI only: 2 lead searchlight signals
+        uint8_t inputCards;     // USIC and SUSIC only
+        uint8_t outputCards;
+        uint16_t inputLines;
+        uint16_t outputLines;
+        bool linesMatch;        // the line models are the sizes the host expects
+    };
+
+    void setInitHandler(bool(*initHandler) (uint8_t * data, int dataLen));
+    const Config & nodeConfig();
+    bool setInputHandler(uint16_t numLines, bool(*inputHandler) (uint16_t line));
+    bool setInputHandler(uint16_t numLines,
+                         void (*bulkInputHandler) (uint16_t firstLine, uint16_t numLines,
+                                                   uint8_t * data));
+    void setInputScan(uint16_t linesPerStep, unsigned long intervalMicros);
+    unsigned long inputSnapshotAge();
+    bool setInputDebounce(uint16_t firstLine, uint16_t numLines, uint8_t samples);
+    bool setOutputHandler(uint16_t numLines,
+                          void (*perLineOutputHandler) (uint16_t line, bool isOn),
+                          void (*overallOutputHandler) (uint16_t numOutputs, bool outputs[]));
+    bool setOutputChangeHandler(uint16_t numLines,
+                                void (*outputChangeHandler) (const CMRIOutputChange changes[],
+                                                             uint8_t count));
+    bool setOutputPorts(uint8_t numPorts, const uint8_t portMap[],
+                        void (*portOutputHandler) (uint8_t port, uint8_t mask, uint8_t bits));
+    bool addOutputEffect(uint8_t effect, uint16_t controlLine, uint16_t firstLine,
+                         uint16_t numLines, uint16_t onMillis, uint16_t offMillis = 0);
+
+    // what an output effect does with its lines while its control line is ON
+    enum OutputEffect {
+        EFFECT_BLINK,           // all ON for onMillis, then all OFF for offMillis
+        EFFECT_ALTERNATE,       // as EFFECT_BLINK, with every other line the opposite
+        EFFECT_PULSE            // ON for onMillis, then OFF
+    };
+
+    // the most samples an input can be debounced over
+    static const uint8_t MAX_DEBOUNCE_SAMPLES = 7;
+
+    // a portMap entry for a line that is not on any port
+    static const uint8_t NO_PORT = 0xFF;
+
+    // bytes of line model storage needed for the given number of lines
+    static constexpr uint16_t storageBytes(uint16_t lines) {
+        return ((lines + 7) / 8 + sizeof(word_t) - 1) / sizeof(word_t) * sizeof(word_t);
+    }
+
+  protected:
+    // a node whose line models live in the given storage, which is cleared
+    CMRINode(uint8_t nodeId, uint8_t * inputStore, uint16_t inputLines,
+             uint8_t * outputStore, uint16_t outputLines);
+
+  private:
+    friend class CMRI;
+
+    uint8_t nodeId;             // as it appears on the wire (65 + the node id)
+
+     bool(*initHandler) (uint8_t * data, int dataLen);
+    Config config;
+
+    uint16_t numInputs;
+    uint16_t inputCapacity;     // lines the inputs storage can hold
+    uint8_t *inputs;
+     bool(*inputHandler) (uint16_t line);
+    void (*bulkInputHandler) (uint16_t firstLine, uint16_t numLines, uint8_t * data);
+
+    // background scanning of the inputs, between polls
+    bool scanEnabled;
+    uint16_t scanStep;          // lines sampled per step
+    uint16_t scanCursor;        // first line of the next step
+    unsigned long scanInterval; // microseconds between steps
+    unsigned long lastScanMicros;
+    unsigned long sweepStartMicros;
+    unsigned long snapshotMicros;       // when the oldest sample in inputs was taken
+
+    // debouncing: the raw samples, then 3 planes of vertical counters and
+    // 3 planes holding each line's sample count, or NULL if not debouncing
+    uint8_t *debounce;
+
+    uint16_t numOutputs;
+    uint16_t outputCapacity;    // lines the outputs storage can hold
+    uint8_t *outputs;
+    uint16_t outputGeneration;  // counts changes to outputs
+    bool *outputFlags;          // unpacked copy, only for the overallOutputHandler
+    void (*perLineOutputHandler) (uint16_t line, bool isOn);
+    void (*overallOutputHandler) (uint16_t numOutputs, bool outputs[]);
+
+    // changed lines, collected for the outputChangeHandler
+    CMRIOutputChange *changeList;
+    uint8_t numChanges;
+    void (*outputChangeHandler) (const CMRIOutputChange changes[], uint8_t count);
+
+    // changes grouped by hardware port, for the portOutputHandler
+    const uint8_t *portMap;     // port * 8 + bit, for each output line
+    uint8_t numPorts;
+    uint8_t *portChanges;       // a mask and the new bits, for each port
+    void (*portOutputHandler) (uint8_t port, uint8_t mask, uint8_t bits);
+
+    // output effects, kept on a timer wheel of EFFECT_SLOTS slots, each
+    // EFFECT_TICK milliseconds long, with a list of the effects due in it
+    struct Effect {
+        uint16_t controlLine;
+        uint16_t firstLine;
+        uint16_t numLines;
+        uint16_t onMillis;
+        uint16_t offMillis;
+        unsigned long due;      // millis() of the next step
+        uint8_t kind;
+        bool running;           // the control line is ON
+        bool lit;               // the (even numbered) lines are ON
+        uint8_t slot;           // where it is on the wheel, or NO_EFFECT
+        uint8_t next;           // the next effect in the same slot
+    };
+
+    static const uint8_t EFFECT_SLOTS = 32;
+    static const uint8_t EFFECT_TICK = 8;
+    static const uint8_t NO_EFFECT = 0xFF;
+
+    Effect *effects;
+    uint8_t numEffects;
+    uint8_t *effectLines;       // a bit for each output line an effect uses
+    uint8_t *wheel;             // the first effect due in each slot
+    uint8_t wheelSlot;          // the slot last run
+    unsigned long wheelMillis;  // when that slot started
+
+    void init();
+    bool createInputs(uint16_t numLines);
+    bool createOutputs(uint16_t numLines, bool wantFlags);
+    void scanInputs(uint16_t firstLine, uint16_t count);
+    void scanNextInputs();
+    void debounceInputs(uint16_t firstLine, uint16_t count);
+    static uint16_t bytesForLines(uint16_t lines);
+    static uint16_t wordBytesForLines(uint16_t lines);
+
+    void setOutput(uint16_t line, bool isOn);
+    void driveOutput(uint16_t line, bool isOn);
+    void finishOutputs();
+    void reportOutputs();
+
+    bool controlEffects(uint16_t line, bool isOn);
+    void moveEffect(Effect & e, bool running, bool lit);
+    void stepEffect(uint8_t index, unsigned long now);
+    void queueEffect(uint8_t index);
+    void unqueueEffect(uint8_t index);
+    void runEffects();
+};
+
+
 class CMRI {
   public:
     CMRI(Stream & stream, uint8_t nodeId);
 
     void check();
+    bool check(uint16_t maxBytes, unsigned long maxMicros = 0);
+    size_t feed(const uint8_t * data, size_t len);
 
     void setInitHandler(bool(*initHandler) (uint8_t * data, int dataLen));
-    void setInputHandler(uint16_t numLines, bool(*inputHandler) (uint16_t line));
-    void setOutputHandler(uint16_t numLines,
+    const CMRINode::Config & nodeConfig();
+    bool setInputHandler(uint16_t numLines, bool(*inputHandler) (uint16_t line));
+    bool setInputHandler(uint16_t numLines,
+                         void (*bulkInputHandler) (uint16_t firstLine, uint16_t numLines,
+                                                   uint8_t * data));
+    void setInputScan(uint16_t linesPerStep, unsigned long intervalMicros);
+    unsigned long inputSnapshotAge();
+    bool setInputDebounce(uint16_t firstLine, uint16_t numLines, uint8_t samples);
+    bool setOutputHandler(uint16_t numLines,
                           void (*perLineOutputHandler) (uint16_t line, bool isOn),
                           void (*overallOutputHandler) (uint16_t numOutputs, bool outputs[]));
+    bool setOutputChangeHandler(uint16_t numLines,
+                                void (*outputChangeHandler) (const CMRIOutputChange changes[],
+                                                             uint8_t count));
+    bool setOutputPorts(uint8_t numPorts, const uint8_t portMap[],
+                        void (*portOutputHandler) (uint8_t port, uint8_t mask, uint8_t bits));
+    bool addOutputEffect(uint8_t effect, uint16_t controlLine, uint16_t firstLine,
+                         uint16_t numLines, uint16_t onMillis, uint16_t offMillis = 0);
+
+    bool addNode(CMRINode & node);
+    bool addStream(CMRI & other);
+
+    void setMessageHandler(uint8_t type, CMRIMessageHandler handler);
+    bool sendMessage(uint8_t type, const uint8_t * data, uint16_t dataLen);
+
+    bool setNonBlockingTransmit(bool nonBlocking);
+    bool transmitComplete();
+
+    bool setStreamingOutputs(bool streaming);
+
+    void setTransmitEnablePin(int pin);
+    void setTransmitEnableHandler(void (*transmitEnableHandler) (bool enable));
+    void setTransmitIdleHandler(bool(*transmitIdleHandler) ());
+
+    // RS-485 bus turnaround achieved, in microseconds
+    struct TransmitTiming {
+        unsigned long requestToEnable;  // ETX of the request until DE asserted (replies only)
+        unsigned long lastWriteToRelease;       // last byte written until DE released
+        unsigned long enabledFor;       // DE asserted until DE released
+        unsigned long maxRequestToEnable;
+        unsigned long maxLastWriteToRelease;
+        unsigned long maxEnabledFor;
+    };
+
+    const TransmitTiming & transmitTiming();
 
+    // the message length allowed by the constructor above; see CMRIStatic
+    // for other sizes
     static const int MAX_MESG_LEN = 72;
 
+    // ATTN ATTN STX addr type, every data byte escaped, ETX
+    static constexpr uint16_t frameBytes(uint16_t mesgLen) {
+        return 2 * mesgLen + 6;
+    }
+    static const int MAX_FRAME_LEN = 2 * MAX_MESG_LEN + 6;
+
+    uint16_t maxMessageLength();
+
     void addDebugStream(Stream * s);
 
 
     void printSummary();
 
+    unsigned long skippedBytes();
+    unsigned long skippedFrames();
+
+    // why a message could not be parsed or handled
+    enum ErrorKind {
+        ERROR_JUNK,             // bytes between frames that do not start one
+        ERROR_NO_STX,           // ATTN ATTN not followed by STX
+        ERROR_OVERFLOW,         // message longer than the message buffer
+        ERROR_ESCAPE,           // needless DLE escape (strict checking only)
+        ERROR_STATE,            // the parser lost track of its state
+        ERROR_INIT,             // malformed 'I' message
+        ERROR_CONFIG,           // 'I' sizes do not match the line models
+        ERROR_CAPACITY,         // 'R' reply too long for the buffers
+        ERROR_OVERRUN,          // characters lost by the receive ring
+        ERROR_TRANSMIT,         // the stream did not take a whole frame
+        NUM_ERROR_KINDS
+    };
 
+    static const char *errorKindName(uint8_t kind);
+
+    /*
+     * Trace events.  Each is written to the trace stream as TRACE_SYNC,
+     * the event, three arguments and the micros() it happened at (least
+     * significant byte first); extras/host/cmri_trace decodes them.
+     */
+    enum TraceEvent {
+        TRACE_STATE = 1,        // old parser state, new state, input byte
+        TRACE_FRAME,            // address, type, data length (to 255)
+        TRACE_SKIP,             // a frame for another node, as TRACE_FRAME
+        TRACE_REPLY,            // sender address, type, data length (to 255)
+        TRACE_ERROR,            // ErrorKind, parser state, 0
+        TRACE_DROPPED,          // records lost while the buffer was full (16 bits), 0
+        NUM_TRACE_EVENTS
+    };
+
+    static const uint8_t TRACE_SYNC = 0xA5;
+    static const uint8_t TRACE_RECORD_LEN = 8;  // in the ring; 1 more on the stream
+
+#if CMRI_TRACE_SIZE > 0
+    void setTraceStream(Stream * s);
+    void setTraceEvents(uint8_t mask);
+#endif
+
+#if CMRI_METRICS
+    // histogram bucket i counts times of 2^(i-1) to 2^i - 1 microseconds
+    // (bucket 0 is under 1us); the last bucket takes everything longer
+    static const uint8_t METRIC_BUCKETS = 16;
+
+    struct Metrics {
+        unsigned long bytesSeen;
+        unsigned long framesSeen;
+        unsigned long framesProcessed;
+        unsigned long bytesSkipped;
+        unsigned long framesSkipped;
+        unsigned long errors[NUM_ERROR_KINDS];
+        unsigned long replyLatency[METRIC_BUCKETS];     // ETX until the reply starts
+        unsigned long handlerTime[METRIC_BUCKETS];      // each user handler call
+        unsigned long maxCheckMicros;   // longest single check()
+    };
+
+    void getMetrics(Metrics & snapshot);
+    void resetMetrics();
+#endif
+
+
+
+    void setMonitorMode(bool monitor);
+
+    void setReceiveRing(CMRIRing * ring);
+
+  protected:
+    // a CMRI object that uses the given storage, rather than allocating
+    // its buffers (see CMRIStatic)
+    CMRI(Stream & stream, uint8_t nodeId, uint8_t * mesgStore, uint16_t mesgSize,
+         uint8_t * frameStore, uint16_t frameSize, uint8_t * inputStore, uint16_t inputLines,
+         uint8_t * outputStore, uint16_t outputLines);
+
+    bool sendFrame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t dataLen);
 
   private:
+    void init();
+
     enum cmriStreamState { START, ATTN_NEXT, STX_NEXT, ADDR_NEXT,
-        TYPE_NEXT, MAYBE_DATA_NEXT, DATA_NEXT
+        TYPE_NEXT, MAYBE_DATA_NEXT, DATA_NEXT, SKIP_NEXT, SKIP_ESCAPED_NEXT
     };
 
-    void sendMessage();
+    static const uint8_t HEADER_ERROR = 0x80;
+    static const uint8_t headerTable[5][3];
+
+    // the message types that can have a handler, 'A' through 'Z'
+    static const uint8_t FIRST_HANDLER_TYPE = 'A';
+    static const uint8_t NUM_HANDLER_TYPES = 26;
+    CMRIMessageHandler messageHandlers[NUM_HANDLER_TYPES];
+    void encodeFrame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t dataLen);
+    void queueFrame();
+    uint16_t drainTransmit();
+    void beginTransmit();
+    void startTransmit();
+    bool finishTransmit();
+    void setTransmitEnable(bool enable);
 
     void nextChar(uint8_t b);
 
-     bool(*initHandler) (uint8_t * data, int dataLen);
-
-    uint16_t numInputs;
-    bool *inputs;
-     bool(*inputHandler) (uint16_t line);
-
-    uint16_t numOutputs;
-    bool *outputs;
-    void (*perLineOutputHandler) (uint16_t line, bool isOn);
-    void (*overallOutputHandler) (uint16_t numOutputs, bool outputs[]);
+    // the nodes served, and a table to find them by address in
+    // constant time
+    CMRINode node;
+    CMRINode *nodes[CMRI_MAX_NODES];
+    uint8_t numNodes;
+#if CMRI_MAX_NODES > 1
+    uint8_t nodeIndex[128];     // (address - 65) to index + 1 in nodes, or 0
+#endif
 
+    CMRINode *findNode(uint8_t address);
+    CMRINode *currentNode;      // the node the current message is for
+
+    // a 'T' message whose outputs have not all been applied yet
+    CMRINode *outputNode;
+    bool outputsPending;
+    bool outputsChanged;
+    uint16_t outputCursor;      // byte offset of the next word to compare
+    uint16_t outputTail;        // where the bytes not staged start
+    uint16_t changeBase;        // line number of bit 0 of changeMask
+    CMRINode::word_t changeMask;          // changed lines not yet applied
+
+    // a 'T' message compared to the output model as it arrives (see
+    // setStreamingOutputs): the changed bits of each byte, and the range
+    // of bytes that have any
+    bool streamingOutputs;
+    uint8_t *stage;
+    CMRINode *stageNode;        // the node being staged for, or NULL
+    uint16_t stageGeneration;   // its outputGeneration when staging began
+    uint16_t stageFirst;
+    uint16_t stageEnd;          // 0 if nothing has changed
+
+    void stageOutputs(uint16_t from);
 
     bool isForMe();
 
@@ -70,26 +480,75 @@ class CMRI {
     void processMessage();
 
     void processInit();
+    static bool decodeInit(const uint8_t * data, uint16_t dataLen, CMRINode::Config & c);
     void pollInputs();
+    void patchReply(const uint8_t * data, uint16_t dataLen);
     void processOutputs();
+    void applyNextOutput();
 
     void processOtherMessages();
 
     void printCurrentMessage(const char *tag);
+    void printMessage(const char *tag, int address, uint8_t type,
+                      const uint8_t * data, uint16_t dataLen);
 
 
-    char *printState(cmriStreamState);
+    const char *printState(cmriStreamState);
     cmriStreamState currentState;
 
 
      Stream & stream;
-    uint8_t nodeId;
+    CMRIRing *ring;             // where characters are read from, if not the stream
+    uint16_t readRing(uint16_t maxBytes);
+
+    // more streams serving the same nodes (see addStream), each with a
+    // CMRI object of its own, chained from the first
+    CMRI *owner;                // the first, if this is one of the others
+    CMRI *nextStream;
+    CMRI *firstStream;          // where the next check() starts, or NULL for this
+
+    bool serve(uint16_t maxBytes, unsigned long maxMicros, unsigned long start,
+               uint16_t & work);
+    bool serveStreams(uint16_t maxBytes, unsigned long maxMicros, unsigned long start,
+                      uint16_t & work);
 
     int messageDest;
     uint8_t messageType;
-    uint8_t buf[MAX_MESG_LEN];
+    uint8_t *buf;
+    uint16_t bufSize;
     int messageLength;
 
+    // the encoded frame being transmitted
+    uint8_t *txBuf;
+    uint16_t txBufSize;
+    uint16_t txLength;
+    uint16_t txSent;
+
+    // the last 'R' reply, kept encoded in txBuf to be sent again (see
+    // pollInputs)
+    CMRINode *replyNode;        // whose reply it is, or NULL if there is none
+    uint16_t replyLength;       // its data length
+    uint16_t replyModelBytes;   // how much of that came from the input model
+    uint16_t replyFrameLength;
+    uint16_t replyEscapes;      // DLEs in its data
+    bool nonBlockingTransmit;
+    bool monitor;               // every frame goes to the message handlers only
+    bool processing;            // in processMessage(), so what is sent is a reply
+    bool txScheduled;           // waiting out the transmit delay (see 'I')
+    bool txReply;               // the frame being sent answers a message
+    unsigned long txDelay;      // microseconds after etxMicros to start
+
+    // RS-485 driver enable
+    int transmitEnablePin;
+    void (*transmitEnableHandler) (bool enable);
+    bool(*transmitIdleHandler) ();
+    bool transmitEnabled;       // DE is currently asserted
+    int txRoomWhenEmpty;        // availableForWrite() with nothing queued
+    unsigned long etxMicros;    // when the ETX of the last message arrived
+    unsigned long enableMicros;
+    unsigned long lastWriteMicros;
+    TransmitTiming timing;
+
     Stream *debug;
 
     unsigned long int tickCount;
@@ -97,14 +556,111 @@ class CMRI {
     unsigned long int messagesSeen;
     unsigned long int messagesProcessed;
 
+    // frames for other nodes, which are skipped over rather than parsed
+    unsigned long int bytesSkipped;
+    unsigned long int framesSkipped;
+    unsigned long int skipStart;        // charCount when the skipping started
+    void endSkippedFrame();
+
     void changeState(cmriStreamState newstate, uint8_t inputChar);
 
     unsigned int errorCount;
-    cmriStreamState error();
+    cmriStreamState error(ErrorKind kind);
+    void countError(ErrorKind kind);
+
+#if CMRI_TRACE_SIZE > 0
+    static_assert(CMRI_TRACE_SIZE % TRACE_RECORD_LEN == 0,
+                  "CMRI_TRACE_SIZE must be a multiple of the record length");
+    static const uint16_t TRACE_RECORDS = CMRI_TRACE_SIZE / TRACE_RECORD_LEN;
+
+    uint8_t traceBuf[CMRI_TRACE_SIZE];
+    uint16_t traceHead;         // the oldest record, not yet drained
+    uint16_t traceCount;
+    uint16_t traceDropped;
+    uint8_t traceMask;
+    Stream *traceStream;
+    void trace(uint8_t event, uint8_t a, uint8_t b, uint8_t c);
+    void putTraceRecord(uint8_t event, uint8_t a, uint8_t b, uint8_t c);
+    void drainTrace();
+#endif
 
-    uint16_t bytesForLines(uint16_t lines);
+#if CMRI_METRICS
+    unsigned long errorKinds[NUM_ERROR_KINDS];
+    unsigned long replyLatency[METRIC_BUCKETS];
+    unsigned long handlerTime[METRIC_BUCKETS];
+    unsigned long maxCheckMicros;
+    static void addToHistogram(unsigned long *histogram, unsigned long us);
+#endif
+};
 
-    void setOutput(uint16_t line, bool isOn);
+
+/*
+ * A CMRI object with its message length and line counts fixed at compile
+ * time, and all of its buffers and line models inside the object, so
+ * none of these come from the heap.  The
+ * message length is not limited to MAX_MESG_LEN, so a node with more than
+ * 568 inputs can be served, and a small node can be made smaller:
+ *
+ *   CMRIStatic<8, 24, 48> cmri(Serial1, 5);    // an SMINI sized node
+ *
+ * The line counts given to setInputHandler and setOutputHandler must not
+ * exceed the ones given here.  ramFootprint() is the RAM the object
+ * takes, all buffers included, and nothing more: the optional features
+ * still allocate from the heap the first time they are turned on.  These
+ * are setStreamingOutputs (MaxMesgLen bytes), an overallOutputHandler
+ * (a bool per output line), setOutputChangeHandler (CMRI_OUTPUT_CHANGES
+ * change records), setOutputPorts (two bytes a port), addOutputEffect
+ * (CMRI_EFFECTS effects, a bit per output line and EFFECT_SLOTS bytes)
+ * and setInputDebounce (seven times the input line model).
+ */
+
+template < uint16_t MaxMesgLen, uint16_t NumInputs, uint16_t NumOutputs >
+class CMRIStatic:public CMRI {
+    static_assert(MaxMesgLen > 0 && MaxMesgLen <= 32764,
+                  "the encoded frame length must fit in 16 bits");
+    static_assert(NumInputs / 8 + 1 <= MaxMesgLen,
+                  "the 'R' reply for NumInputs does not fit in MaxMesgLen");
+    static_assert((NumOutputs + 7) / 8 <= MaxMesgLen,
+                  "the 'T' message for NumOutputs does not fit in MaxMesgLen");
+
+  public:
+    CMRIStatic(Stream & stream, uint8_t nodeId)
+    :CMRI(stream, nodeId, mesgStore, MaxMesgLen, frameStore, sizeof(frameStore),
+           inputStore, NumInputs, outputStore, NumOutputs) {
+    }
+
+    static constexpr size_t ramFootprint() {
+        return sizeof(CMRIStatic);
+    }
+
+  private:
+    uint8_t mesgStore[MaxMesgLen];
+    uint8_t frameStore[frameBytes(MaxMesgLen)];
+    uint8_t inputStore[NumInputs ? CMRINode::storageBytes(NumInputs) : 1];
+    uint8_t outputStore[NumOutputs ? CMRINode::storageBytes(NumOutputs) : 1];
+};
+
+
+/*
+ * Likewise, a node for addNode() with statically allocated line models.
+ * ramFootprint() again leaves out the allocations made by the optional
+ * features above.
+ */
+
+template < uint16_t NumInputs, uint16_t NumOutputs >
+class CMRIStaticNode:public CMRINode {
+  public:
+    CMRIStaticNode(uint8_t nodeId)
+    :CMRINode(nodeId, inputStore, NumInputs, outputStore, NumOutputs) {
+    }
+
+    static constexpr size_t ramFootprint() {
+        return sizeof(CMRIStaticNode);
+    }
+
+  private:
+    uint8_t inputStore[NumInputs ? CMRINode::storageBytes(NumInputs) : 1];
+    uint8_t outputStore[NumOutputs ? CMRINode::storageBytes(NumOutputs) : 1];
 };
 
 #endif
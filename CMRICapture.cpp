@@ -0,0 +1,152 @@
+/* Computer Model Railroad Interface -- bus capture
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.  
+ */
+
+
+#include "CMRICapture.h"
+
+/*
+ * Create a capture of the given stream, written to sink
+ */
+
+CMRICapture::CMRICapture(Stream & s, Print & k):
+stream(s), sink(k)
+{
+    chunkLength = 0;
+    chunkWritten = false;
+    chunkMicros = 0;
+}
+
+
+/*
+ * Start the capture by writing the header.  Call this once, before the
+ * CMRI object is first checked.
+ */
+
+void CMRICapture::begin()
+{
+    sink.write((const uint8_t *) "CMRICAP1", 8);
+}
+
+
+/*
+ * Write out the bytes collected so far, as a record.  This happens by
+ * itself whenever the received bytes stop arriving or the node starts to
+ * write; call it before closing the sink.
+ */
+
+void CMRICapture::flushCapture()
+{
+    if (chunkLength > 0) {
+        writeRecord(chunkMicros, chunkWritten, chunk, chunkLength);
+        chunkLength = 0;
+    }
+}
+
+
+int CMRICapture::available()
+{
+    return stream.available();
+}
+
+int CMRICapture::read()
+{
+    int b = stream.read();
+
+    if (b >= 0) {
+        add((uint8_t) b, false);
+
+        // the end of a burst is the end of the record
+        if (stream.available() <= 0) {
+            flushCapture();
+        }
+    }
+    return b;
+}
+
+int CMRICapture::peek()
+{
+    return stream.peek();
+}
+
+size_t CMRICapture::write(uint8_t b)
+{
+    add(b, true);
+    return stream.write(b);
+}
+
+/*
+ * A frame written all at once becomes one record, without being copied.
+ * Like a single byte, it is timed from when it was handed to the stream,
+ * not from when a blocking write returned.
+ */
+size_t CMRICapture::write(const uint8_t * data, size_t len)
+{
+    unsigned long when = micros();
+    size_t n = stream.write(data, len);
+
+    if (n > 0) {
+        flushCapture();
+        writeRecord(when, true, data, n);
+    }
+    return n;
+}
+
+int CMRICapture::availableForWrite()
+{
+    return stream.availableForWrite();
+}
+
+void CMRICapture::flush()
+{
+    stream.flush();
+}
+
+
+/*
+ * Collect one byte into the current record, starting a new record if
+ * this one is full or goes the other way
+ */
+
+void CMRICapture::add(uint8_t b, bool written)
+{
+    if (chunkLength > 0 && (chunkWritten != written || chunkLength >= CMRI_CAPTURE_CHUNK)) {
+        flushCapture();
+    }
+
+    if (chunkLength == 0) {
+        chunkMicros = micros();
+        chunkWritten = written;
+    }
+    chunk[chunkLength++] = b;
+}
+
+
+void CMRICapture::writeRecord(unsigned long when, bool written, const uint8_t * data,
+                              uint16_t len)
+{
+    while (len > 0) {
+        uint16_t n = len < WRITTEN ? len : WRITTEN - 1;
+        uint16_t field = n | (written ? WRITTEN : 0);
+        uint8_t header[6];
+
+        header[0] = when;
+        header[1] = when >> 8;
+        header[2] = when >> 16;
+        header[3] = when >> 24;
+        header[4] = field;
+        header[5] = field >> 8;
+
+        sink.write(header, sizeof(header));
+        sink.write(data, n);
+
+        data += n;
+        len -= n;
+    }
+}
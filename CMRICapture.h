@@ -0,0 +1,77 @@
+/* Computer Model Railroad Interface -- bus capture
+ *
+ * A CMRICapture sits between a CMRI object and its Stream, and records
+ * every byte read and written, with timestamps, to another Print (a file
+ * on an SD card, a second serial port, or a file on a Linux host).  The
+ * extras/host/cmri_replay tool plays such a capture back through the
+ * library.
+ *
+ *   CMRICapture capture(Serial1, logFile);
+ *   CMRI cmri(capture, 5);
+ *
+ *   capture.begin();           // in setup()
+ *
+ * The capture format is a header, then records, with all values least
+ * significant byte first:
+ *
+ *   "CMRICAP1"                 header
+ *   uint32  micros()           when the first byte of the record was seen
+ *   uint16  length             bit 15 set for bytes written by the node
+ *   length bytes
+ *
+ * Bytes that arrive together are kept in one record, up to
+ * CMRI_CAPTURE_CHUNK of them.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#ifndef CMRI_CAPTURE_H
+#define CMRI_CAPTURE_H
+
+#include "Arduino.h"
+
+/*
+ * The most bytes kept in one record, and the RAM used to collect them
+ */
+#ifndef CMRI_CAPTURE_CHUNK
+#define CMRI_CAPTURE_CHUNK 32
+#endif
+
+class CMRICapture:public Stream {
+  public:
+    CMRICapture(Stream & stream, Print & sink);
+
+    void begin();
+    void flushCapture();
+
+    static const uint16_t WRITTEN = 0x8000;     // in the record length
+
+    // the Stream interface, passed through to the captured stream
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t b);
+    size_t write(const uint8_t * data, size_t len);
+    using Print::write;
+    int availableForWrite();
+    void flush();
+
+  private:
+    Stream & stream;
+    Print & sink;
+
+    uint8_t chunk[CMRI_CAPTURE_CHUNK];
+    uint8_t chunkLength;
+    bool chunkWritten;
+    unsigned long chunkMicros;
+
+    void add(uint8_t b, bool written);
+    void writeRecord(unsigned long when, bool written, const uint8_t * data, uint16_t len);
+};
+
+#endif
@@ -0,0 +1,420 @@
+/* Computer Model Railroad Interface -- bus master
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+
+#include "CMRIMaster.h"
+
+/*
+ * how much longer a node's poll interval gets each time a poll finds its
+ * inputs unchanged: an eighth, plus this many microseconds
+ */
+#define POLL_BACKOFF_MICROS 500
+
+/******************************************************************************
+ *
+ * These are the PUBLIC methods of the CMRIMaster object
+ *
+ ******************************************************************************
+ */
+
+/*
+ * Create a bus master on the given stream.  Transmission is always
+ * non-blocking, so check() never waits for the serial port.
+ */
+
+CMRIMaster::CMRIMaster(Stream & s):
+CMRI(s, 0)
+{
+    numMasterNodes = 0;
+    nextOutputNode = 0;
+    minInterval = 0;
+    maxInterval = 100000;
+    replyTimeout = 50000;
+    awaiting = NULL;
+    pollSentMicros = 0;
+    inputHandler = NULL;
+    statusHandler = NULL;
+
+    setMonitorMode(true);
+    setNonBlockingTransmit(true);
+    setMessageHandler('R', replyHandler);
+}
+
+
+/*
+ * Add a node (0 to 127) to be polled, with the number of input lines it
+ * reports and output lines it is sent.  Nodes start out offline, and
+ * are polled right away.
+ *
+ * Returns false if the table is full, the node is already there, its
+ * outputs do not fit in a message, or its line models could not be
+ * allocated.
+ */
+
+bool CMRIMaster::addNode(uint8_t nodeId, uint16_t numInputs, uint16_t numOutputs)
+{
+    if (numMasterNodes >= CMRI_MASTER_MAX_NODES || nodeId > 127 || masterNode(nodeId) != NULL
+        || (numOutputs + 7) / 8 > maxMessageLength()) {
+        return false;
+    }
+
+    Node & n = masterNodes[numMasterNodes];
+
+    n.inputs = (uint8_t *) calloc(1, (numInputs + 7) / 8 + 1);
+    n.outputs = (uint8_t *) calloc(1, (numOutputs + 7) / 8 + 1);
+    if (n.inputs == NULL || n.outputs == NULL) {
+        free(n.inputs);
+        free(n.outputs);
+        return false;
+    }
+
+    n.address = nodeId + 65;
+    n.numInputs = numInputs;
+    n.numOutputs = numOutputs;
+    n.outputsChanged = false;
+    n.failures = 0;
+    memset(&n.stats, 0, sizeof(n.stats));
+    n.stats.pollInterval = minInterval;
+    n.lastPoll = micros() - maxInterval;
+
+    numMasterNodes++;
+    return true;
+}
+
+
+/*
+ * The range the per node poll intervals adapt within, in microseconds.
+ * A minimum of 0 (the default) means as often as the bus allows.  Setting
+ * both the same gives plain round-robin polling at that rate.  Offline
+ * nodes are polled at the maximum interval (100 milliseconds by default).
+ */
+
+void CMRIMaster::setPollInterval(unsigned long minMicros, unsigned long maxMicros)
+{
+    minInterval = minMicros;
+    maxInterval = maxMicros > minMicros ? maxMicros : minMicros;
+
+    for (uint8_t i = 0; i < numMasterNodes; i++) {
+        NodeStats & s = masterNodes[i].stats;
+
+        if (s.pollInterval < minInterval) {
+            s.pollInterval = minInterval;
+        } else if (s.pollInterval > maxInterval) {
+            s.pollInterval = maxInterval;
+        }
+    }
+}
+
+
+/*
+ * How long to wait for the reply to a poll, counted from when the poll
+ * has been completely sent (50 milliseconds by default)
+ */
+
+void CMRIMaster::setReplyTimeout(unsigned long timeoutMicros)
+{
+    replyTimeout = timeoutMicros;
+}
+
+
+/*
+ * Install a function to be called for each input line that a poll finds
+ * has changed
+ */
+
+void CMRIMaster::setInputHandler(void (*inputHandler) (uint8_t nodeId, uint16_t line, bool isOn))
+{
+    this->inputHandler = inputHandler;
+}
+
+
+/*
+ * Install a function to be called when a node starts answering polls,
+ * or stops (after OFFLINE_AFTER polls in a row go unanswered)
+ */
+
+void CMRIMaster::setNodeStatusHandler(void (*statusHandler) (uint8_t nodeId, bool online))
+{
+    this->statusHandler = statusHandler;
+}
+
+
+/*
+ * Set an output line of a node.  Changes are collected, and sent in one
+ * 'T' message by a later check().  Returns false for an unknown node or
+ * line.
+ */
+
+bool CMRIMaster::setOutput(uint8_t nodeId, uint16_t line, bool isOn)
+{
+    Node *n = masterNode(nodeId);
+
+    if (n == NULL || line >= n->numOutputs) {
+        return false;
+    }
+
+    uint8_t mask = 1 << (line % 8);
+    uint8_t & b = n->outputs[line / 8];
+
+    if (((b & mask) != 0) != isOn) {
+        b ^= mask;
+        n->outputsChanged = true;
+    }
+    return true;
+}
+
+
+/*
+ * The state of an input line of a node, as last reported
+ */
+
+bool CMRIMaster::input(uint8_t nodeId, uint16_t line)
+{
+    Node *n = masterNode(nodeId);
+
+    if (n == NULL || line >= n->numInputs) {
+        return false;
+    }
+    return n->inputs[line / 8] & (1 << (line % 8));
+}
+
+
+/*
+ * Do the next bit of bus mastering: read any replies, then send output
+ * changes and the next poll that is due.  Call this as often as
+ * possible; it does not block.
+ *
+ * Nothing is sent while a reply is awaited, since the node may be
+ * talking.
+ */
+
+void CMRIMaster::check()
+{
+    CMRI::check(0, 0);
+
+    if (awaiting != NULL) {
+        if (!transmitComplete()) {
+            // the poll is still going out; the timeout starts after it
+            pollSentMicros = micros();
+            return;
+        }
+        if (micros() - pollSentMicros < replyTimeout) {
+            return;
+        }
+        pollTimedOut();
+    }
+
+    while (transmitComplete() && sendOutputs()) {
+    }
+
+    if (transmitComplete()) {
+        sendPoll();
+    }
+}
+
+
+/*
+ * Copy the statistics of a node.  Returns false for an unknown node.
+ */
+
+bool CMRIMaster::nodeStats(uint8_t nodeId, NodeStats & stats)
+{
+    Node *n = masterNode(nodeId);
+
+    if (n == NULL) {
+        return false;
+    }
+    stats = n->stats;
+    return true;
+}
+
+
+
+
+/******************************************************************************
+ *
+ * These are the PRIVATE methods of the CMRIMaster object
+ *
+ ******************************************************************************
+ */
+
+
+CMRIMaster::Node * CMRIMaster::masterNode(uint8_t nodeId)
+{
+    for (uint8_t i = 0; i < numMasterNodes; i++) {
+        if (masterNodes[i].address == nodeId + 65) {
+            return &masterNodes[i];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Send the outputs of the next node (round-robin) that has changes.
+ * Returns false if there was nothing to send.
+ */
+
+bool CMRIMaster::sendOutputs()
+{
+    for (uint8_t k = 0; k < numMasterNodes; k++) {
+        uint8_t i = (nextOutputNode + k) % numMasterNodes;
+        Node & n = masterNodes[i];
+
+        if (n.outputsChanged) {
+            if (!sendFrame(n.address, 'T', n.outputs, (n.numOutputs + 7) / 8)) {
+                return false;
+            }
+            n.outputsChanged = false;
+            nextOutputNode = i + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Poll the node that is the furthest past its poll interval, if any is
+ * due.  Returns false if no poll was sent.
+ */
+
+bool CMRIMaster::sendPoll()
+{
+    unsigned long now = micros();
+    Node *best = NULL;
+    unsigned long bestLate = 0;
+
+    for (uint8_t i = 0; i < numMasterNodes; i++) {
+        Node & n = masterNodes[i];
+        unsigned long interval = n.stats.online ? n.stats.pollInterval : maxInterval;
+        unsigned long since = now - n.lastPoll;
+
+        if (since >= interval && (best == NULL || since - interval > bestLate)) {
+            best = &n;
+            bestLate = since - interval;
+        }
+    }
+
+    if (best == NULL || !sendFrame(best->address, 'P', NULL, 0)) {
+        return false;
+    }
+
+    best->lastPoll = now;
+    best->stats.polls += 1;
+    awaiting = best;
+    pollSentMicros = now;
+    return true;
+}
+
+
+/*
+ * The node polled has not answered in time
+ */
+
+void CMRIMaster::pollTimedOut()
+{
+    Node & n = *awaiting;
+
+    awaiting = NULL;
+    n.stats.timeouts += 1;
+    if (n.failures < OFFLINE_AFTER) {
+        n.failures += 1;
+    }
+    if (n.failures >= OFFLINE_AFTER) {
+        setOnline(n, false);
+    }
+}
+
+
+void CMRIMaster::setOnline(Node & n, bool online)
+{
+    if (n.stats.online != online) {
+        n.stats.online = online;
+        if (statusHandler != NULL) {
+            (*statusHandler) (n.address - 65, online);
+        }
+    }
+}
+
+
+/*
+ * A node has reported its inputs: report the lines that changed, and
+ * adapt its poll interval
+ */
+
+void CMRIMaster::processReply(Node & n, const uint8_t * data, uint16_t dataLen)
+{
+    uint16_t bytes = (n.numInputs + 7) / 8;
+    bool changed = false;
+
+    if (dataLen < bytes) {
+        bytes = dataLen;
+    }
+
+    for (uint16_t i = 0; i < bytes; i++) {
+        uint8_t diff = data[i] ^ n.inputs[i];
+
+        while (diff != 0) {
+            uint8_t bit = __builtin_ctz(diff);
+            uint16_t line = i * 8 + bit;
+
+            diff &= diff - 1;
+            if (line >= n.numInputs) {
+                break;
+            }
+
+            n.inputs[i] ^= 1 << bit;
+            changed = true;
+            if (inputHandler != NULL) {
+                (*inputHandler) (n.address - 65, line, n.inputs[i] & (1 << bit));
+            }
+        }
+    }
+
+    NodeStats & s = n.stats;
+    s.replies += 1;
+    if (changed) {
+        s.inputChanges += 1;
+        s.pollInterval /= 2;
+    } else {
+        s.pollInterval += s.pollInterval / 8 + POLL_BACKOFF_MICROS;
+    }
+    if (s.pollInterval < minInterval) {
+        s.pollInterval = minInterval;
+    } else if (s.pollInterval > maxInterval) {
+        s.pollInterval = maxInterval;
+    }
+
+    n.failures = 0;
+    setOnline(n, true);
+}
+
+
+/*
+ * The 'R' message handler, for replies from any node
+ */
+
+bool CMRIMaster::replyHandler(CMRI & cmri, uint8_t nodeId, uint8_t type,
+                              const uint8_t * data, uint16_t dataLen)
+{
+    CMRIMaster & m = static_cast < CMRIMaster & >(cmri);
+    Node *n = m.masterNode(nodeId);
+
+    (void) type;
+
+    if (n != NULL) {
+        if (m.awaiting == n) {
+            m.awaiting = NULL;
+        }
+        m.processReply(*n, data, dataLen);
+    }
+    return true;
+}
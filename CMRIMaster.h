@@ -0,0 +1,110 @@
+/* Computer Model Railroad Interface -- bus master
+ *
+ * The other end of the CMRInet: a master that sends outputs to a table
+ * of nodes and polls them for their inputs.  It uses the same framing,
+ * escaping and parsing as the CMRI node side (it is a CMRI object in
+ * monitor mode underneath), so it can run on an Arduino or on a Linux
+ * host.
+ *
+ * Polling adapts to the nodes: a node whose inputs changed at its last
+ * poll is polled twice as often, and one whose inputs have not changed
+ * is polled gradually less often, between the minimum and maximum poll
+ * intervals.  On a busy bus that gives the bus time to the sensors that
+ * are actually active, and shortens the time it takes to notice a change
+ * there.  Output changes are sent ('T') ahead of any poll, and without
+ * waiting for anything, since 'T' has no reply.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#ifndef CMRI_MASTER_H
+#define CMRI_MASTER_H
+
+#include "CMRI.h"
+
+/*
+ * The number of nodes one master can poll
+ */
+#ifndef CMRI_MASTER_MAX_NODES
+#define CMRI_MASTER_MAX_NODES 16
+#endif
+
+class CMRIMaster:protected CMRI {
+  public:
+    CMRIMaster(Stream & stream);
+
+    bool addNode(uint8_t nodeId, uint16_t numInputs, uint16_t numOutputs);
+
+    void setPollInterval(unsigned long minMicros, unsigned long maxMicros);
+    void setReplyTimeout(unsigned long timeoutMicros);
+    void setInputHandler(void (*inputHandler) (uint8_t nodeId, uint16_t line, bool isOn));
+    void setNodeStatusHandler(void (*statusHandler) (uint8_t nodeId, bool online));
+
+    bool setOutput(uint8_t nodeId, uint16_t line, bool isOn);
+    bool input(uint8_t nodeId, uint16_t line);
+
+    void check();
+
+    struct NodeStats {
+        unsigned long polls;
+        unsigned long replies;
+        unsigned long timeouts;
+        unsigned long inputChanges;     // polls that found a change
+        unsigned long pollInterval;     // the current one, in microseconds
+        bool online;
+    };
+
+    bool nodeStats(uint8_t nodeId, NodeStats & stats);
+
+    using CMRI::addDebugStream;
+    using CMRI::setTransmitEnablePin;
+    using CMRI::setTransmitEnableHandler;
+    using CMRI::setTransmitIdleHandler;
+
+    // consecutive timeouts before a node is taken to be offline
+    static const uint8_t OFFLINE_AFTER = 3;
+
+  private:
+    struct Node {
+        uint8_t address;        // as it appears on the wire
+        uint16_t numInputs;
+        uint16_t numOutputs;
+        uint8_t *inputs;        // as last reported
+        uint8_t *outputs;       // as they should be
+        bool outputsChanged;    // not sent yet
+        unsigned long lastPoll;
+        uint8_t failures;       // consecutive timeouts
+        NodeStats stats;
+    };
+
+    Node masterNodes[CMRI_MASTER_MAX_NODES];
+    uint8_t numMasterNodes;
+    uint8_t nextOutputNode;     // where the search for outputs to send starts
+
+    unsigned long minInterval;
+    unsigned long maxInterval;
+    unsigned long replyTimeout;
+
+    Node *awaiting;             // the node polled, until it replies
+    unsigned long pollSentMicros;
+
+    void (*inputHandler) (uint8_t nodeId, uint16_t line, bool isOn);
+    void (*statusHandler) (uint8_t nodeId, bool online);
+
+    Node *masterNode(uint8_t nodeId);
+    bool sendOutputs();
+    bool sendPoll();
+    void pollTimedOut();
+    void setOnline(Node & n, bool online);
+    void processReply(Node & n, const uint8_t * data, uint16_t dataLen);
+
+    static bool replyHandler(CMRI & cmri, uint8_t nodeId, uint8_t type,
+                             const uint8_t * data, uint16_t dataLen);
+};
+
+#endif
@@ -0,0 +1,121 @@
+/* Computer Model Railroad Interface -- receive ring
+ *
+ * See CMRIRing.h.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#include "CMRIRing.h"
+
+#if defined(__AVR__)
+#include <util/atomic.h>
+#endif
+
+
+CMRIRing::CMRIRing(uint8_t * storage, index_t size):
+data(storage), size(size), mask(size - 1), head(0), tail(0), lost(0), losses(0),
+lossesTaken(0)
+{
+}
+
+
+/*
+ * Store a block of characters, as a DMA completion would.  Returns how
+ * many were stored; the rest are dropped and counted.
+ */
+
+CMRIRing::index_t CMRIRing::push(const uint8_t * src, index_t len)
+{
+    index_t h = head;
+    index_t space = lossPending() ? 0 : room();
+    index_t n = len < space ? len : space;
+
+    for (index_t i = 0; i < n; i++) {
+        data[(index_t) (h + i) & mask] = src[i];
+    }
+    __atomic_store_n(&head, (index_t) (h + n), __ATOMIC_RELEASE);
+
+    if (n < len) {
+        lose(len - n);
+    }
+    return n;
+}
+
+
+/*
+ * The number of characters waiting
+ */
+
+CMRIRing::index_t CMRIRing::available()
+{
+    return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail;
+}
+
+
+/*
+ * Find the characters that can be taken in one piece, up to the end of
+ * the storage.  Returns how many there are (0 if none), with span
+ * pointing at the first.
+ */
+
+CMRIRing::index_t CMRIRing::peek(const uint8_t * &span)
+{
+    index_t n = __atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail;
+    index_t toEnd = size - (tail & mask);
+    if (n > toEnd) {
+        n = toEnd;
+    }
+
+    span = data + (tail & mask);
+    return n;
+}
+
+
+/*
+ * Take the given number of characters, found with peek(), out of the ring
+ */
+
+void CMRIRing::consume(index_t n)
+{
+    __atomic_store_n(&tail, (index_t) (tail + n), __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Returns true, once, when every character from before a loss has been
+ * taken, so that the next one is from after it
+ */
+
+bool CMRIRing::takeLoss()
+{
+    if (__atomic_load_n(&losses, __ATOMIC_ACQUIRE) == lossesTaken
+        || __atomic_load_n(&head, __ATOMIC_ACQUIRE) != tail) {
+        return false;
+    }
+    __atomic_store_n(&lossesTaken, (index_t) (lossesTaken + 1), __ATOMIC_RELEASE);
+    return true;
+}
+
+
+/*
+ * The number of characters dropped because the ring was full
+ */
+
+unsigned long CMRIRing::overruns()
+{
+#if defined(__AVR__)
+    unsigned long n;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        n = lost;
+    }
+    return n;
+#else
+    return __atomic_load_n(&lost, __ATOMIC_RELAXED);
+#endif
+}
@@ -0,0 +1,135 @@
+/* Computer Model Railroad Interface -- receive ring
+ *
+ * A lock-free ring buffer between whatever receives the characters of the
+ * CMRI network and CMRI::check(), which takes them out in bulk.  The
+ * Stream's own receive buffer (64 bytes on an AVR) overflows whenever
+ * loop() is busy for longer than that many character times; a ring filled
+ * straight from the UART receive interrupt, a DMA completion, or a reader
+ * thread on a host can be made as large as the worst case needs:
+ *
+ *   CMRIStaticRing<128> ring;
+ *   CMRI cmri(Serial1, 5);
+ *
+ *   ISR(USART1_RX_vect) { ring.push(UDR1); }   // your own UART driver
+ *
+ *   cmri.setReceiveRing(&ring);                // in setup()
+ *
+ * The stream given to the CMRI object is still used for transmitting.
+ *
+ * There must be exactly one producer (calling push) and one consumer (the
+ * CMRI object); neither ever waits for the other, and no interrupts are
+ * disabled.  When the ring is full, characters are dropped and counted in
+ * overruns(), and so is everything after them until the consumer has
+ * taken all that came before, so that each loss is one gap.  The parser
+ * is told where that is, and throws away the frame that lost characters
+ * (ERROR_OVERRUN) rather than handle it with some missing.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#ifndef CMRI_RING_H
+#define CMRI_RING_H
+
+#include "Arduino.h"
+
+class CMRIRing {
+  public:
+    // the head and tail counters, which must be read and written in one
+    // instruction by both sides
+#if defined(__AVR__)
+    typedef uint8_t index_t;
+#else
+    typedef uint16_t index_t;
+#endif
+
+    // size must be a power of two: at most 128 on AVR, 32768 elsewhere
+    CMRIRing(uint8_t * storage, index_t size);
+
+    /*
+     * The producer side: store a character, from the receive interrupt
+     * or reader thread.  Returns false if it was dropped for want of room.
+     */
+    inline bool push(uint8_t b) {
+        index_t h = head;
+        index_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+
+        if ((index_t) (h - t) == size || lossPending()) {
+            lose(1);
+            return false;
+        }
+        data[h & mask] = b;
+        __atomic_store_n(&head, (index_t) (h + 1), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    index_t push(const uint8_t * src, index_t len);
+
+    // room for characters, as the producer sees it
+    inline index_t room() {
+        return size - (index_t) (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+    }
+
+    // the consumer side, used by CMRI::check()
+    index_t available();
+    index_t peek(const uint8_t * &span);
+    void consume(index_t n);
+    bool takeLoss();
+
+    // characters dropped because the ring was full
+    unsigned long overruns();
+
+  private:
+    uint8_t *data;
+    index_t size;
+    index_t mask;
+
+    // free running counts of characters stored and taken
+    index_t head;               // written by the producer only
+    index_t tail;               // written by the consumer only
+
+    // gaps: the producer counts them, and the consumer counts the ones
+    // it has reached; while they differ, the gap is at head
+    unsigned long lost;         // producer
+    index_t losses;             // producer
+    index_t lossesTaken;        // consumer
+
+    inline bool lossPending() {
+        return __atomic_load_n(&lossesTaken, __ATOMIC_ACQUIRE) != losses;
+    }
+
+    inline void lose(index_t n) {
+#if defined(__AVR__)
+        lost += n;              // in the interrupt; overruns() reads it with them off
+#else
+        __atomic_store_n(&lost, lost + n, __ATOMIC_RELAXED);
+#endif
+        if (!lossPending()) {
+            __atomic_store_n(&losses, (index_t) (losses + 1), __ATOMIC_RELEASE);
+        }
+    }
+};
+
+
+/*
+ * A receive ring with its storage
+ */
+
+template < uint16_t Size > class CMRIStaticRing:public CMRIRing {
+  public:
+    CMRIStaticRing():CMRIRing(store, Size) {
+    }
+
+  private:
+    static_assert(Size != 0 && (Size & (Size - 1)) == 0, "the ring size must be a power of two");
+    static_assert(Size <= (CMRIRing::index_t) ~(CMRIRing::index_t) 0 / 2 + 1,
+                  "the ring is too large for its counters");
+
+    uint8_t store[Size];
+};
+
+#endif
@@ -89,6 +89,33 @@ IOLine *outputs[] = {
 #define outputCount NELEMENTS(outputs)
 
 
+// The IOX lines are also listed by expander port, so that the library can
+// collect the changes a 'T' message makes to each port and hand them over
+// together: one I2C write per port, rather than a read-modify-write per
+// line.  Ports 0 and 1 are ports A and B of the chip at 0x20, ports 2 and
+// 3 those of the chip at 0x21.
+
+#define NP CMRINode::NO_PORT
+#define IOXPORT(address, port, bit) ((((address) - 0x20) * 2 + (port)) * 8 + (bit))
+
+const uint8_t outputPorts[] = {
+    NP, NP, NP, NP, NP, NP, NP, NP, NP, NP,                             // 0-9
+    NP, NP, NP, NP, NP, NP,                                             // 10-15
+    IOXPORT(0x20, 0, 7), IOXPORT(0x20, 0, 6), IOXPORT(0x20, 0, 5), IOXPORT(0x20, 0, 4),
+    IOXPORT(0x20, 0, 3), IOXPORT(0x20, 0, 2), IOXPORT(0x20, 0, 1), IOXPORT(0x20, 0, 0),
+    IOXPORT(0x20, 1, 7), IOXPORT(0x20, 1, 6), IOXPORT(0x20, 1, 5), IOXPORT(0x20, 1, 4),
+    IOXPORT(0x20, 1, 3), IOXPORT(0x20, 1, 2),                           // 16-29
+    IOXPORT(0x21, 0, 7), IOXPORT(0x21, 0, 6), IOXPORT(0x21, 0, 5), IOXPORT(0x21, 0, 4),
+    IOXPORT(0x21, 0, 3), IOXPORT(0x21, 0, 2), IOXPORT(0x21, 0, 1), IOXPORT(0x21, 0, 0),
+    IOXPORT(0x21, 1, 7), IOXPORT(0x21, 1, 6),                           // 30-39
+};
+
+#define portCount 4
+
+// the output latch of each port, as last written
+uint8_t portLatch[portCount];
+
+
 // this is a setting that depends on your Arduino hardware -- what are the
 // pins for the CMRI serial line 
 //   these are correct for the BBLeo based cpNode board
@@ -99,8 +126,8 @@ IOLine *outputs[] = {
 CMRI cmri(Serial1, CMRI_UA);         // I/O device, my Node Number (UA in CMRI terms)
 
 
-// this function will be called every time an output line changes value based on
-// a CMRI 'T' transmit message
+// this function will be called every time an output line that is not on an
+// expander port changes value based on a CMRI 'T' transmit message
 
 void cmriPerLineOutputHandler(uint16_t outputLine, bool isOn)
 {
@@ -117,6 +144,20 @@ void cmriPerLineOutputHandler(uint16_t outputLine, bool isOn)
 }
 
 
+// and this one once per 'T' message for each expander port with changes:
+// mask has the bits that changed, bits their new values
+
+void cmriPortOutputHandler(uint8_t port, uint8_t mask, uint8_t bits)
+{
+    portLatch[port] = (portLatch[port] & ~mask) | bits;
+
+    Wire.beginTransmission(0x20 + port / 2);
+    Wire.write(0x14 + port % 2);        // OLATA or OLATB
+    Wire.write(portLatch[port]);
+    Wire.endTransmission();
+}
+
+
 
 ////////////////////////////////////////////////////////////////
 
@@ -148,6 +189,7 @@ void setup()
 #endif
 
     cmri.setOutputHandler(outputCount, cmriPerLineOutputHandler, NULL);
+    cmri.setOutputPorts(portCount, outputPorts, cmriPortOutputHandler);
 
     // initialize all the CMRI outputs
     for (int i = 0; i < outputCount; i++) {
@@ -117,6 +117,11 @@ void setup()
 
     cmri.setOutputHandler(outputCount, cmriPerLineOutputHandler, NULL);
 
+    // the library times these: output 7 flashes while the host has it ON,
+    // and output 14 turns on a pair of crossing lights on 14 and 15
+    cmri.addOutputEffect(CMRINode::EFFECT_BLINK, 7, 7, 1, 500);
+    cmri.addOutputEffect(CMRINode::EFFECT_ALTERNATE, 14, 14, 2, 600);
+
     // initialize all the CMRI outputs
     for (int i = 0; i < outputCount; i++) {
 	outputs[i]->init();
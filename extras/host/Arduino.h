@@ -0,0 +1,218 @@
+/* Minimal Arduino core shim for building the CMRI library on a Linux host
+ *
+ * Only the pieces of the Arduino API that the CMRI library (and the host
+ * programs in this directory) actually use are provided here: Print,
+ * Stream, the timing functions and a few pin stubs.  This is not an
+ * emulator -- it exists so that the protocol code can be compiled,
+ * measured and exercised off target.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+
+/*
+ * timing
+ *
+ * micros() and millis() count from the first call, and wrap the same way
+ * the 32 bit AVR counters do, so wraparound arithmetic in the library is
+ * exercised the same way it would be on a node.
+ */
+
+static inline uint64_t hostNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// not static, so that every file shares the one epoch
+inline uint64_t hostEpochNanos()
+{
+    static uint64_t epoch = hostNanos();
+    return epoch;
+}
+
+static inline unsigned long micros()
+{
+    uint64_t epoch = hostEpochNanos();
+    return (uint32_t) ((hostNanos() - epoch) / 1000);
+}
+
+static inline unsigned long millis()
+{
+    uint64_t epoch = hostEpochNanos();
+    return (uint32_t) ((hostNanos() - epoch) / 1000000);
+}
+
+static inline void delayMicroseconds(unsigned int us)
+{
+    uint64_t until = hostNanos() + (uint64_t) us * 1000;
+    while (hostNanos() < until)
+        ;
+}
+
+static inline void delay(unsigned long ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+
+/*
+ * pins -- there is no hardware, so these only remember the last value
+ * written so that host programs can look at it
+ */
+
+extern uint8_t hostPinState[256];
+
+static inline void pinMode(uint8_t pin, uint8_t mode)
+{
+    (void) pin;
+    (void) mode;
+}
+
+static inline void digitalWrite(uint8_t pin, uint8_t val)
+{
+    hostPinState[pin] = val;
+}
+
+static inline int digitalRead(uint8_t pin)
+{
+    return hostPinState[pin];
+}
+
+
+/*
+ * Print and Stream, following the shape of the Arduino core classes
+ */
+
+class Print {
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t b) = 0;
+
+    virtual size_t write(const uint8_t * data, size_t len) {
+        size_t n = 0;
+        while (len--) {
+            if (write(*data++))
+                n++;
+            else
+                break;
+        }
+        return n;
+    }
+
+    size_t write(const char *str) {
+        return str ? write((const uint8_t *) str, strlen(str)) : 0;
+    }
+
+    virtual int availableForWrite() {
+        return 0;
+    }
+
+    virtual void flush() {
+    }
+
+    size_t print(const char *s) {
+        return write(s);
+    }
+    size_t print(char c) {
+        return write((uint8_t) c);
+    }
+    size_t print(unsigned char n, int base = DEC) {
+        return print((unsigned long) n, base);
+    }
+    size_t print(int n, int base = DEC) {
+        return print((long) n, base);
+    }
+    size_t print(unsigned int n, int base = DEC) {
+        return print((unsigned long) n, base);
+    }
+    size_t print(long n, int base = DEC) {
+        if (base == DEC && n < 0) {
+            return print('-') + print((unsigned long) -n, base);
+        }
+        return print((unsigned long) n, base);
+    }
+    size_t print(unsigned long n, int base = DEC) {
+        char tmp[8 * sizeof(long) + 1];
+        char *p = &tmp[sizeof(tmp) - 1];
+        *p = '\0';
+        if (base < 2)
+            base = DEC;
+        do {
+            int digit = n % base;
+            *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+            n /= base;
+        } while (n);
+        return write(p);
+    }
+    size_t print(double d, int digits = 2) {
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), "%.*f", digits, d);
+        return write(tmp);
+    }
+
+    size_t println() {
+        return write("\r\n");
+    }
+    template < typename T > size_t println(T v) {
+        return print(v) + println();
+    }
+    template < typename T > size_t println(T v, int base) {
+        return print(v, base) + println();
+    }
+};
+
+
+class Stream:public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    size_t readBytes(uint8_t * buffer, size_t length) {
+        size_t n = 0;
+        while (n < length) {
+            int c = read();
+            if (c < 0)
+                break;
+            buffer[n++] = (uint8_t) c;
+        }
+        return n;
+    }
+};
+
+#endif
@@ -0,0 +1,131 @@
+/* Stream over a non-blocking file descriptor (a socket or a serial port)
+ *
+ * Reading and writing are buffered on the host side: fill() reads
+ * whatever the descriptor has into the receive buffer, where the library
+ * reads it, and everything the library writes is kept until flushOut()
+ * can hand it to the descriptor.  Neither ever blocks, so one thread can
+ * serve many descriptors from an epoll loop.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#ifndef FD_STREAM_H
+#define FD_STREAM_H
+
+#include "Arduino.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+class FdStream:public Stream {
+  public:
+    int fd;
+
+    FdStream(int fd = -1):fd(fd), rxHead(0), txHead(0) {
+    }
+
+    static bool setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL);
+        return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+    }
+
+    /*
+     * read all the descriptor has to offer; returns false at end of file,
+     * or on an error
+     */
+    bool fill() {
+        uint8_t chunk[4096];
+
+        compact(rx, rxHead);
+        for (;;) {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n > 0) {
+                rx.insert(rx.end(), chunk, chunk + n);
+            } else if (n == 0) {
+                return false;
+            } else if (errno == EINTR) {
+                continue;
+            } else {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+        }
+    }
+
+    /*
+     * write as much of the transmit buffer as the descriptor will take;
+     * returns false on an error
+     */
+    bool flushOut() {
+        while (txHead < tx.size()) {
+            ssize_t n = ::write(fd, &tx[txHead], tx.size() - txHead);
+            if (n > 0) {
+                txHead += n;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                return false;
+            }
+        }
+        compact(tx, txHead);
+        return true;
+    }
+
+    /* bytes written by the library, not yet taken by the descriptor */
+    size_t pendingOut() const {
+        return tx.size() - txHead;
+    }
+
+    /* Stream interface, as seen by the library */
+    int available() {
+        return (int) (rx.size() - rxHead);
+    }
+
+    int read() {
+        return rxHead < rx.size() ? rx[rxHead++] : -1;
+    }
+
+    int peek() {
+        return rxHead < rx.size() ? rx[rxHead] : -1;
+    }
+
+    size_t write(uint8_t b) {
+        tx.push_back(b);
+        return 1;
+    }
+
+    size_t write(const uint8_t * data, size_t len) {
+        tx.insert(tx.end(), data, data + len);
+        return len;
+    }
+
+    using Print::write;
+
+    int availableForWrite() {
+        return 4096;
+    }
+
+  private:
+    std::vector < uint8_t > rx, tx;
+    size_t rxHead, txHead;
+
+    /* drop what has been consumed from the front of a buffer */
+    static void compact(std::vector < uint8_t > &v, size_t & head) {
+        if (head == v.size()) {
+            v.clear();
+            head = 0;
+        } else if (head >= 4096) {
+            v.erase(v.begin(), v.begin() + head);
+            head = 0;
+        }
+    }
+};
+
+#endif
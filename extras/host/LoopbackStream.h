@@ -0,0 +1,191 @@
+/* In-memory Stream for driving the CMRI library on a Linux host
+ *
+ * Bytes injected by the host program are handed to the library through
+ * read(), and everything the library writes is captured for inspection.
+ * Optionally, every write is timestamped so that reply latency can be
+ * measured from the moment the last received byte was consumed, and the
+ * transmit side can model a UART at a given baud rate, so that flush()
+ * and availableForWrite() behave as they would on a node.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#ifndef LOOPBACK_STREAM_H
+#define LOOPBACK_STREAM_H
+
+#include "Arduino.h"
+#include <vector>
+
+class LoopbackStream:public Stream {
+  public:
+    LoopbackStream():rxHead(0), timestamps(false), charNanos(0), txFifo(64),
+        rxDrainedNanos(0), firstWriteNanos(0), lastWriteNanos(0), wireIdleNanos(0),
+        writeCalls(0) {
+    }
+
+    /*
+     * model a UART transmitting at the given baud rate (10 bits per
+     * character) through a transmit FIFO of the given size; a baud rate of
+     * 0 turns the model off and writes complete instantly
+     */
+    void setLineRate(unsigned long baud, int fifo = 64) {
+        charNanos = baud ? 10000000000ull / baud : 0;
+        txFifo = fifo;
+        wireIdleNanos = 0;
+    }
+
+    /* queue bytes for the library to read */
+    void inject(const uint8_t * data, size_t len) {
+        rx.insert(rx.end(), data, data + len);
+    }
+
+    void inject(uint8_t b) {
+        rx.push_back(b);
+    }
+
+    /* queue a complete, correctly escaped CMRInet frame */
+    void injectFrame(uint8_t addr, uint8_t type, const uint8_t * data, size_t len) {
+        std::vector < uint8_t > f;
+        appendFrame(f, addr, type, data, len);
+        inject(&f[0], f.size());
+    }
+
+    static void appendFrame(std::vector < uint8_t > &f, uint8_t addr, uint8_t type,
+                            const uint8_t * data, size_t len) {
+        f.push_back(0xFF);
+        f.push_back(0xFF);
+        f.push_back(0x02);
+        f.push_back(addr);
+        f.push_back(type);
+        for (size_t i = 0; i < len; i++) {
+            if (data[i] == 0x02 || data[i] == 0x03 || data[i] == 0x10)
+                f.push_back(0x10);
+            f.push_back(data[i]);
+        }
+        f.push_back(0x03);
+    }
+
+    /* Stream interface, as seen by the library */
+    int available() {
+        return (int) (rx.size() - rxHead);
+    }
+
+    int read() {
+        if (rxHead >= rx.size())
+            return -1;
+        int b = rx[rxHead++];
+        if (rxHead == rx.size()) {
+            rx.clear();
+            rxHead = 0;
+            if (timestamps)
+                rxDrainedNanos = hostNanos();
+        }
+        return b;
+    }
+
+    int peek() {
+        return rxHead < rx.size() ? rx[rxHead] : -1;
+    }
+
+    size_t write(uint8_t b) {
+        return write(&b, 1);
+    }
+
+    size_t write(const uint8_t * data, size_t len) {
+        if (timestamps && tx.empty())
+            firstWriteNanos = hostNanos();
+        if (charNanos) {
+            for (size_t i = 0; i < len; i++) {
+                // a full FIFO blocks, as HardwareSerial::write does
+                while (queued() > (size_t) txFifo)
+                    ;
+                uint64_t now = hostNanos();
+                wireIdleNanos = (wireIdleNanos > now ? wireIdleNanos : now) + charNanos;
+                txDoneNanos.push_back(wireIdleNanos);
+            }
+        } else {
+            txDoneNanos.insert(txDoneNanos.end(), len, hostNanos());
+        }
+        if (timestamps)
+            lastWriteNanos = hostNanos();
+        writeCalls += 1;
+        tx.insert(tx.end(), data, data + len);
+        return len;
+    }
+
+    int availableForWrite() {
+        if (charNanos == 0)
+            return txFifo;
+
+        // the character in the shift register is not in the FIFO
+        size_t q = queued();
+        return txFifo - (q > 0 ? (int) q - 1 : 0);
+    }
+
+    /* wait until the last character has left the wire */
+    void flush() {
+        while (hostNanos() < wireIdleNanos)
+            ;
+    }
+
+    /* characters written but not yet completely transmitted */
+    size_t queued() {
+        uint64_t now = hostNanos();
+        if (now >= wireIdleNanos)
+            return 0;
+        return (size_t) ((wireIdleNanos - now + charNanos - 1) / charNanos);
+    }
+
+    /* captured output, as seen by the host program */
+    const std::vector < uint8_t > &written() const {
+        return tx;
+    }
+
+    void clearWritten() {
+        tx.clear();
+        txDoneNanos.clear();
+        writeCalls = 0;
+    }
+
+    /*
+     * move the written bytes that have completely left the (modeled) wire
+     * to the end of out, as a receiver at the other end would see them
+     */
+    void takeTransmitted(std::vector < uint8_t > &out) {
+        uint64_t now = hostNanos();
+        size_t n = 0;
+
+        while (n < txDoneNanos.size() && txDoneNanos[n] <= now)
+            n++;
+        out.insert(out.end(), tx.begin(), tx.begin() + n);
+        tx.erase(tx.begin(), tx.begin() + n);
+        txDoneNanos.erase(txDoneNanos.begin(), txDoneNanos.begin() + n);
+    }
+
+    void setTimestamps(bool on) {
+        timestamps = on;
+    }
+
+  private:
+    std::vector < uint8_t > rx;
+    size_t rxHead;
+    std::vector < uint8_t > tx;
+    std::vector < uint64_t > txDoneNanos;       // when each byte in tx leaves the wire
+    bool timestamps;
+    uint64_t charNanos;
+    int txFifo;
+
+  public:
+    uint64_t rxDrainedNanos;    // when the read() that emptied the input happened
+    uint64_t firstWriteNanos;   // first write since clearWritten()
+    uint64_t lastWriteNanos;    // most recent write
+    uint64_t wireIdleNanos;     // when the last written character will have left
+    unsigned long writeCalls;   // write() calls since clearWritten()
+};
+
+#endif
@@ -0,0 +1,128 @@
+/* A simulated CMRInet bus of 16 nodes, for host programs
+ *
+ * Four slave CMRI objects, each serving four nodes (1 to 16), on their
+ * own LoopbackStreams, all at 57600 baud.  Whatever is written to the
+ * master stream reaches every slave, and whatever a slave writes reaches
+ * the master, once it has left the (modeled) wire.  Call run() as often
+ * as possible to move the bytes and let the slaves work.
+ *
+ * Each node has 16 input lines, read from virtualInputs, and 8 output
+ * lines, written to virtualOutputs.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#ifndef VIRTUAL_BUS_H
+#define VIRTUAL_BUS_H
+
+#include "Arduino.h"
+#include "CMRI.h"
+#include "LoopbackStream.h"
+#include <vector>
+
+static const int VIRTUAL_NODES = 16;
+static uint8_t virtualInputs[VIRTUAL_NODES][2];
+static uint8_t virtualOutputs[VIRTUAL_NODES];
+
+template < int N > static void virtualInputHandler(uint16_t firstLine, uint16_t numLines,
+                                                   uint8_t * data)
+{
+    memcpy(data, virtualInputs[N] + firstLine / 8, (numLines + 7) / 8);
+}
+
+template < int N > static void virtualOutputHandler(uint16_t line, bool isOn)
+{
+    if (isOn)
+        virtualOutputs[N] |= 1 << line;
+    else
+        virtualOutputs[N] &= ~(1 << line);
+}
+
+static void (*const virtualInputHandlers[VIRTUAL_NODES]) (uint16_t, uint16_t, uint8_t *) = {
+    virtualInputHandler < 0 >, virtualInputHandler < 1 >, virtualInputHandler < 2 >,
+    virtualInputHandler < 3 >, virtualInputHandler < 4 >, virtualInputHandler < 5 >,
+    virtualInputHandler < 6 >, virtualInputHandler < 7 >, virtualInputHandler < 8 >,
+    virtualInputHandler < 9 >, virtualInputHandler < 10 >, virtualInputHandler < 11 >,
+    virtualInputHandler < 12 >, virtualInputHandler < 13 >, virtualInputHandler < 14 >,
+    virtualInputHandler < 15 >
+};
+
+static void (*const virtualOutputHandlers[VIRTUAL_NODES]) (uint16_t, bool) = {
+    virtualOutputHandler < 0 >, virtualOutputHandler < 1 >, virtualOutputHandler < 2 >,
+    virtualOutputHandler < 3 >, virtualOutputHandler < 4 >, virtualOutputHandler < 5 >,
+    virtualOutputHandler < 6 >, virtualOutputHandler < 7 >, virtualOutputHandler < 8 >,
+    virtualOutputHandler < 9 >, virtualOutputHandler < 10 >, virtualOutputHandler < 11 >,
+    virtualOutputHandler < 12 >, virtualOutputHandler < 13 >, virtualOutputHandler < 14 >,
+    virtualOutputHandler < 15 >
+};
+
+class VirtualBus {
+  public:
+    static const int SLAVES = VIRTUAL_NODES / 4;
+
+    LoopbackStream master;
+
+    VirtualBus() {
+        master.setLineRate(57600);
+        for (int i = 0; i < SLAVES; i++) {
+            streams[i].setLineRate(57600);
+            slaves[i] = new CMRI(streams[i], 4 * i + 1);
+            slaves[i]->setInputHandler(16, virtualInputHandlers[4 * i]);
+            slaves[i]->setOutputHandler(8, virtualOutputHandlers[4 * i], NULL);
+            for (int j = 1; j < 4; j++) {
+                extra[i][j] = new CMRINode(4 * i + j + 1);
+                extra[i][j]->setInputHandler(16, virtualInputHandlers[4 * i + j]);
+                extra[i][j]->setOutputHandler(8, virtualOutputHandlers[4 * i + j], NULL);
+                slaves[i]->addNode(*extra[i][j]);
+            }
+        }
+    }
+
+    ~VirtualBus() {
+        for (int i = 0; i < SLAVES; i++) {
+            delete slaves[i];
+            for (int j = 1; j < 4; j++)
+                delete extra[i][j];
+        }
+    }
+
+    void run() {
+        std::vector < uint8_t > bytes;
+
+        master.takeTransmitted(bytes);
+        if (!bytes.empty()) {
+            for (int i = 0; i < SLAVES; i++)
+                streams[i].inject(&bytes[0], bytes.size());
+        }
+        for (int i = 0; i < SLAVES; i++) {
+            bytes.clear();
+            streams[i].takeTransmitted(bytes);
+            if (!bytes.empty())
+                master.inject(&bytes[0], bytes.size());
+            slaves[i]->check();
+        }
+    }
+
+    /* nothing on the wire, and nothing left for the slaves to read */
+    bool idle() {
+        if (!master.written().empty())
+            return false;
+        for (int i = 0; i < SLAVES; i++) {
+            if (!streams[i].written().empty() || streams[i].available() > 0)
+                return false;
+        }
+        return true;
+    }
+
+  private:
+    LoopbackStream streams[SLAVES];
+    CMRI *slaves[SLAVES];
+    CMRINode *extra[SLAVES][4];
+};
+
+#endif
@@ -0,0 +1,2429 @@
+/* Benchmarks for the CMRI protocol handling, run on a Linux host
+ *
+ * These drive a CMRI object through an in-memory LoopbackStream, so that
+ * the cost of the parser state machine and of the poll/response path can
+ * be measured without a serial line in the way.  Absolute numbers on a
+ * host are of course much better than on an AVR, but relative changes
+ * carry over.
+ *
+ * Usage: bench [scale]
+ *
+ *   scale multiplies the number of iterations of every benchmark (default 1)
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#include "Arduino.h"
+#include "LoopbackStream.h"
+#include "CMRI.h"
+#include "CMRIMaster.h"
+#include "CMRIRing.h"
+#include "VirtualBus.h"
+
+#include <algorithm>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t cycles()
+{
+    return __rdtsc();
+}
+#define HAVE_CYCLES 1
+#else
+static inline uint64_t cycles()
+{
+    return 0;
+}
+#define HAVE_CYCLES 0
+#endif
+
+#define NODE 5                  // the node id used by the node under test
+#define NODE_ADDR (NODE + 65)   // and how that appears on the wire
+
+static unsigned long scale = 1;
+static const char *traceFile;  // where to save the trace benchmark's capture
+
+
+/*
+ * input and output handlers for the node under test
+ *
+ * The input pattern changes whenever inputPhase is bumped, so a poll
+ * reply is not the same every time.
+ */
+
+static uint16_t inputPhase;
+static unsigned long outputCalls;
+
+static bool benchInputHandler(uint16_t line)
+{
+    return ((line + inputPhase) % 3) == 0;
+}
+
+static void benchBulkInputHandler(uint16_t firstLine, uint16_t numLines, uint8_t * data)
+{
+    // as a port or expander register read would, 8 lines at a time
+    for (uint16_t line = firstLine; line < firstLine + numLines; line += 8) {
+        uint8_t port = 0;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            if (((line + bit + inputPhase) % 3) == 0)
+                port |= 1 << bit;
+        }
+        *data++ = port;
+    }
+}
+
+static void benchOutputHandler(uint16_t line, bool isOn)
+{
+    (void) line;
+    (void) isOn;
+    outputCalls += 1;
+}
+
+
+static void report(const char *name, size_t bytes, size_t frames, uint64_t nanos, uint64_t cyc)
+{
+    double secs = nanos / 1e9;
+    printf("  %-34s %10.2f MB/s %9.1f ns/frame", name, bytes / secs / 1e6, (double) nanos / frames);
+    if (HAVE_CYCLES)
+        printf(" %9.0f cycles/frame", (double) cyc / frames);
+    printf("\n");
+}
+
+
+/*
+ * Run a prepared byte stream through check(), `rounds' times, and report
+ * throughput of the parser state machine
+ */
+
+static void benchParser(const char *name, const std::vector < uint8_t > &traffic,
+                        size_t framesPerRound, unsigned long rounds)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setOutputHandler(48, benchOutputHandler, NULL);
+
+    uint64_t nanos = 0, cyc = 0;
+    for (unsigned long r = 0; r < rounds; r++) {
+        s.inject(&traffic[0], traffic.size());
+        uint64_t t0 = hostNanos();
+        uint64_t c0 = cycles();
+        cmri.check();
+        cyc += cycles() - c0;
+        nanos += hostNanos() - t0;
+        s.clearWritten();
+    }
+
+    report(name, traffic.size() * rounds, framesPerRound * rounds, nanos, cyc);
+}
+
+
+/*
+ * As benchParser, but hand the whole block to CMRI::feed instead of
+ * having check() read it from the stream a character at a time
+ */
+
+static void benchFeed(const char *name, const std::vector < uint8_t > &traffic,
+                      size_t framesPerRound, unsigned long rounds)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setOutputHandler(48, benchOutputHandler, NULL);
+
+    uint64_t nanos = 0, cyc = 0;
+    for (unsigned long r = 0; r < rounds; r++) {
+        const uint8_t *p = &traffic[0];
+        size_t len = traffic.size();
+        uint64_t t0 = hostNanos();
+        uint64_t c0 = cycles();
+        while (len > 0) {
+            size_t n = cmri.feed(p, len);
+            p += n;
+            len -= n;
+            cmri.check();
+        }
+        cyc += cycles() - c0;
+        nanos += hostNanos() - t0;
+        s.clearWritten();
+    }
+
+    report(name, traffic.size() * rounds, framesPerRound * rounds, nanos, cyc);
+}
+
+
+static void parserBenchmarks()
+{
+    printf("parser throughput (bytes through CMRI::check)\n");
+
+    // traffic for 30 other nodes: a poll and an output message each
+    std::vector < uint8_t > others;
+    size_t otherFrames = 0;
+    for (int n = 0; n < 30; n++) {
+        uint8_t data[6];
+        for (int i = 0; i < 6; i++)
+            data[i] = (uint8_t) (n * 7 + i);
+        if (n + 65 == NODE_ADDR)
+            continue;
+        LoopbackStream::appendFrame(others, n + 65, 'T', data, sizeof(data));
+        LoopbackStream::appendFrame(others, n + 65, 'P', NULL, 0);
+        otherFrames += 2;
+    }
+    benchParser("frames for other nodes", others, otherFrames, 2000 * scale);
+    benchFeed("  ... through feed()", others, otherFrames, 2000 * scale);
+
+    // output messages for this node, with the pattern changing every time
+    std::vector < uint8_t > mine;
+    size_t mineFrames = 0;
+    for (int n = 0; n < 32; n++) {
+        uint8_t data[6];
+        for (int i = 0; i < 6; i++)
+            data[i] = (uint8_t) ((n & 1) ? 0x55 : 0xAA) ^ i;
+        LoopbackStream::appendFrame(mine, NODE_ADDR, 'T', data, sizeof(data));
+        mineFrames += 1;
+    }
+    benchParser("T frames for this node, 48 lines", mine, mineFrames, 2000 * scale);
+
+    // output messages for this node that do not change anything
+    std::vector < uint8_t > same;
+    uint8_t sameData[6] = { 0x5A, 0xA5, 0x0F, 0xF0, 0x11, 0x88 };
+    for (int n = 0; n < 32; n++)
+        LoopbackStream::appendFrame(same, NODE_ADDR, 'T', sameData, sizeof(sameData));
+    benchParser("T frames, no output changes", same, 32, 2000 * scale);
+    benchFeed("  ... through feed()", same, 32, 2000 * scale);
+
+    // long output messages, as for a node with 512 output lines
+    std::vector < uint8_t > longFrames;
+    uint8_t longData[64];
+    for (size_t i = 0; i < sizeof(longData); i++)
+        longData[i] = (uint8_t) (0x40 + i);
+    for (int n = 0; n < 8; n++)
+        LoopbackStream::appendFrame(longFrames, 0x70, 'T', longData, sizeof(longData));
+    benchParser("64 byte T frames", longFrames, 8, 2000 * scale);
+    benchFeed("  ... through feed()", longFrames, 8, 2000 * scale);
+
+    // output messages full of bytes that need escaping
+    std::vector < uint8_t > escaped;
+    uint8_t esc[6] = { 0x02, 0x03, 0x10, 0x10, 0x03, 0x02 };
+    for (int n = 0; n < 32; n++)
+        LoopbackStream::appendFrame(escaped, NODE_ADDR, 'T', esc, sizeof(esc));
+    benchParser("T frames, every byte escaped", escaped, 32, 2000 * scale);
+}
+
+
+/*
+ * Measure the poll round trip: from the moment the ETX of a 'P' message
+ * has been read to the moment the last byte of the 'R' reply has been
+ * written, for various numbers of input lines.
+ */
+
+static void pollBenchmark(uint16_t numInputs, unsigned long rounds, bool bulk, bool scan)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    if (bulk)
+        cmri.setInputHandler(numInputs, benchBulkInputHandler);
+    else
+        cmri.setInputHandler(numInputs, benchInputHandler);
+    if (scan)
+        cmri.setInputScan(16, 1000);
+    s.setTimestamps(true);
+
+    std::vector < uint64_t > latency;
+    latency.reserve(rounds);
+    uint64_t cyc = 0;
+    size_t replyBytes = 0;
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        inputPhase = (uint16_t) r;
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        uint64_t c0 = cycles();
+        cmri.check();
+        cyc += cycles() - c0;
+        replyBytes = s.written().size();
+        latency.push_back(s.lastWriteNanos - s.rxDrainedNanos);
+        s.clearWritten();
+    }
+
+    std::sort(latency.begin(), latency.end());
+    printf("  %-10s %5u inputs %5u reply bytes  latency min %7.0f ns  median %7.0f ns  p99 %7.0f ns",
+           scan ? (bulk ? "bulk+scan" : "line+scan") : (bulk ? "bulk" : "line"), numInputs, (unsigned) replyBytes, (double) latency[0],
+           (double) latency[latency.size() / 2], (double) latency[latency.size() * 99 / 100]);
+    if (HAVE_CYCLES)
+        printf("  %8.0f cycles/poll", (double) cyc / rounds);
+    printf("\n");
+}
+
+
+/*
+ * The kept 'R' reply, patched rather than built again, against the
+ * reference encoder: every reply must be what LoopbackStream::appendFrame()
+ * makes of the input model.  The inputs change a few bytes a poll, to and
+ * from STX, ETX and DLE, so that bytes gain and lose their escapes and the
+ * rest of the frame moves; now and then something else is sent, which
+ * loses the kept reply.  Then the cost of a steady-state poll.
+ */
+
+static uint8_t replyModel[64];
+
+static void replyInputHandler(uint16_t firstLine, uint16_t numLines, uint8_t * data)
+{
+    memcpy(data, replyModel + firstLine / 8, (numLines + 7) / 8);
+}
+
+static unsigned long escapesIn(const std::vector < uint8_t > &frame)
+{
+    unsigned long n = 0;
+
+    for (size_t i = 5; i + 1 < frame.size(); i++) {
+        if (frame[i] == 0x10) {
+            n += 1;
+            i++;
+        }
+    }
+    return n;
+}
+
+static bool replyCacheCheck(uint16_t numInputs, bool nonBlocking)
+{
+    static const uint8_t special[] = { 0x02, 0x03, 0x10, 0x00, 0xFF, 0x41 };
+    static const uint8_t other[] = { 0x10, 0x01, 0x02 };
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(numInputs, replyInputHandler);
+    cmri.setNonBlockingTransmit(nonBlocking);
+    memset(replyModel, 0, sizeof(replyModel));
+    srand(numInputs);
+
+    uint16_t modelBytes = (numInputs + 7) / 8;
+    unsigned long rounds = 20000 * scale, wrong = 0, gained = 0, lost = 0, rebuilt = 0;
+    unsigned long lastEscapes = 0;
+    bool kept = false;
+    for (unsigned long r = 0; r < rounds; r++) {
+        for (int c = rand() % 4; c > 0; c--)
+            replyModel[rand() % modelBytes] = rand() % 3 ? special[rand() % sizeof(special)] : rand();
+        if (numInputs % 8)
+            replyModel[modelBytes - 1] &= (1 << (numInputs % 8)) - 1;
+
+        if (rand() % 50 == 0) {
+            cmri.sendMessage('Z', other, sizeof(other));
+            while (cmri.check(0, 0))
+                ;
+            s.clearWritten();
+            kept = false;
+            rebuilt += 1;
+        }
+
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        while (cmri.check(0, 0))
+            ;
+
+        std::vector < uint8_t > expected, data(numInputs / 8 + 1, 0);
+        memcpy(data.data(), replyModel, modelBytes);
+        LoopbackStream::appendFrame(expected, NODE_ADDR, 'R', data.data(), data.size());
+        if (s.written() != expected)
+            wrong += 1;
+        s.clearWritten();
+
+        unsigned long escapes = escapesIn(expected);
+        if (kept && escapes > lastEscapes)
+            gained += 1;
+        if (kept && escapes < lastEscapes)
+            lost += 1;
+        lastEscapes = escapes;
+        kept = true;
+    }
+
+    bool ok = wrong == 0 && gained > 0 && lost > 0;
+    printf("  %3u inputs  %-12s  %lu polls, %lu after a reply was lost, %lu gained escapes, "
+           "%lu lost them  %lu wrong  %s\n", numInputs, nonBlocking ? "non-blocking" : "blocking",
+           rounds, rebuilt, gained, lost, wrong, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static void replyCacheCost(const char *name, uint8_t fill, bool rebuild)
+{
+    static const uint8_t other[] = { 0x01 };
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(192, replyInputHandler);
+    memset(replyModel, fill, sizeof(replyModel));
+
+    unsigned long rounds = 100000 * scale;
+    uint64_t nanos = 0;
+    for (unsigned long r = 0; r < rounds; r++) {
+        if (rebuild) {
+            cmri.sendMessage('Z', other, sizeof(other));
+            s.clearWritten();
+        }
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        uint64_t t0 = hostNanos();
+        cmri.check();
+        nanos += hostNanos() - t0;
+        s.clearWritten();
+    }
+    printf("  192 inputs, %-34s %6.0f ns/poll\n", name, (double) nanos / rounds);
+}
+
+static bool replyCacheBenchmarks()
+{
+    bool ok = true;
+
+    ok &= replyCacheCheck(160, false);
+    ok &= replyCacheCheck(160, true);
+    ok &= replyCacheCheck(157, false);
+    ok &= replyCacheCheck(157, true);
+
+    replyCacheCost("kept, nothing to escape", 0x55, false);
+    replyCacheCost("kept, every byte escaped", 0x10, false);
+    replyCacheCost("built every time", 0x55, true);
+    return ok;
+}
+
+
+static void pollBenchmarks()
+{
+    printf("poll latency ('P' ETX read to last byte of 'R' written)\n");
+
+    static const uint16_t counts[] = { 8, 24, 48, 96, 192, 384, 512 };
+    for (int mode = 0; mode < 4; mode++) {
+        for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+            pollBenchmark(counts[i], 20000 * scale, mode & 1, mode & 2);
+        }
+    }
+}
+
+
+/*
+ * The cost of debouncing per line sampled, as the number of inputs grows:
+ * a background scan of every line on each check(), with and without it.
+ * Each input is ON for one sample in three, a 1-sample glitch that
+ * 2-sample debouncing must keep out of every poll reply.
+ */
+
+static uint64_t debounceScanNanos(uint16_t numInputs, unsigned long rounds, bool debounce,
+                                  unsigned long &glitches)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(numInputs, benchBulkInputHandler);
+    if (debounce)
+        cmri.setInputDebounce(0, numInputs, 2);
+    cmri.setInputScan(numInputs, 0);
+
+    uint64_t start = hostNanos();
+    for (unsigned long r = 0; r < rounds; r++) {
+        inputPhase = (uint16_t) r;
+        cmri.check();
+    }
+    uint64_t nanos = hostNanos() - start;
+
+    for (unsigned long r = 0; r < 100; r++) {
+        inputPhase = (uint16_t) r;
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        cmri.check();
+
+        // ATTN ATTN STX addr 'R', then the data; nothing in it is escaped
+        // while every line reads OFF
+        const std::vector < uint8_t > &reply = s.written();
+        for (size_t i = 5; i + 1 < reply.size(); i++) {
+            if (reply[i] != 0)
+                glitches++;
+        }
+        s.clearWritten();
+    }
+    return nanos;
+}
+
+static bool debounceBenchmarks()
+{
+    static const uint16_t counts[] = { 32, 96, 192, 512 };
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        unsigned long rounds = 100000 * scale, glitches = 0, rawGlitches = 0;
+        uint64_t raw = debounceScanNanos(counts[i], rounds, false, rawGlitches);
+        uint64_t debounced = debounceScanNanos(counts[i], rounds, true, glitches);
+        double lineSamples = (double) rounds * counts[i];
+
+        printf("  %5u inputs  %5.2f ns per line sampled raw  %5.2f debounced  %lu glitches  %s\n",
+               counts[i], raw / lineSamples, debounced / lineSamples, glitches,
+               glitches == 0 && rawGlitches != 0 ? "ok" : "FAILED");
+        ok &= glitches == 0 && rawGlitches != 0;
+    }
+    return ok;
+}
+
+
+// poll, and return the data of the reply, unescaped, or false if there
+// is none
+static bool pollReply(CMRI & cmri, LoopbackStream & s, std::vector < uint8_t > &data)
+{
+    s.clearWritten();
+    s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+
+    // allowing for the transmit delay the host asked for
+    unsigned long start = micros();
+    while (s.written().empty() && micros() - start < 20000)
+        cmri.check();
+
+    std::vector < uint8_t > f = s.written();
+    s.clearWritten();
+    data.clear();
+    if (f.size() < 6 || f[4] != 'R')
+        return false;
+
+    for (size_t i = 5; i + 1 < f.size(); i++) {
+        if (f[i] == 0x10)
+            i++;
+        data.push_back(f[i]);
+    }
+    return true;
+}
+
+// the data length of the reply to a poll, or -1 if there is none
+static int replyLength(CMRI & cmri, LoopbackStream & s)
+{
+    std::vector < uint8_t > data;
+
+    return pollReply(cmri, s, data) ? (int) data.size() : -1;
+}
+
+/*
+ * What debouncing does, line by line: ranges of lines with 1 to 7
+ * samples, scanned a few lines per step so that steps start and end
+ * inside words.  The input handler keeps a model of each line (a count
+ * of the samples in a row that disagree with its state, which changes
+ * when the count reaches the line's number of samples) and every poll
+ * reply must agree with it.  Then a steady change on every line must
+ * show after exactly its number of samples.
+ */
+
+#define DEBOUNCE_LINES 80
+
+static const struct {
+    uint16_t first, count;
+    uint8_t samples;
+} debounceRanges[] = {
+    {0, 10, 1}, {10, 14, 2}, {24, 13, 3}, {37, 13, 4}, {50, 11, 5}, {61, 9, 6}, {70, 10, 7},
+};
+
+static bool dbRaw[DEBOUNCE_LINES], dbState[DEBOUNCE_LINES];
+static uint8_t dbSamples[DEBOUNCE_LINES], dbCount[DEBOUNCE_LINES], dbRun[DEBOUNCE_LINES];
+static unsigned long dbSampled[DEBOUNCE_LINES], dbChanges[DEBOUNCE_LINES];
+static bool dbRandom;
+
+static bool debounceLineHandler(uint16_t line)
+{
+    if (dbRandom && dbRun[line]-- == 0) {
+        // runs of 1 to 10 samples, shorter and longer than any debounce
+        dbRaw[line] = !dbRaw[line];
+        dbRun[line] = rand() % 10;
+    }
+    dbSampled[line] += 1;
+
+    if (dbRaw[line] == dbState[line]) {
+        dbCount[line] = 0;
+    } else if (++dbCount[line] == dbSamples[line]) {
+        dbState[line] = dbRaw[line];
+        dbCount[line] = 0;
+        dbChanges[line] += 1;
+    }
+    return dbRaw[line];
+}
+
+static bool debounceCheck(uint16_t linesPerStep)
+{
+    memset(dbRaw, 0, sizeof(dbRaw));
+    memset(dbState, 0, sizeof(dbState));
+    memset(dbCount, 0, sizeof(dbCount));
+    memset(dbRun, 0, sizeof(dbRun));
+    memset(dbChanges, 0, sizeof(dbChanges));
+    dbRandom = false;
+    srand(linesPerStep);
+
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(DEBOUNCE_LINES, debounceLineHandler);
+    for (size_t r = 0; r < sizeof(debounceRanges) / sizeof(debounceRanges[0]); r++) {
+        cmri.setInputDebounce(debounceRanges[r].first, debounceRanges[r].count,
+                              debounceRanges[r].samples);
+        for (uint16_t i = 0; i < debounceRanges[r].count; i++)
+            dbSamples[debounceRanges[r].first + i] = debounceRanges[r].samples;
+    }
+    cmri.setInputScan(linesPerStep, 0);
+
+    // random samples: a poll after every step must match the model
+    unsigned long wrong = 0, polls = 0;
+    std::vector < uint8_t > data;
+    dbRandom = true;
+    for (int i = 0; i < 3000; i++) {
+        if (!pollReply(cmri, s, data) || data.size() != DEBOUNCE_LINES / 8 + 1) {
+            wrong += 1;
+            continue;
+        }
+        polls += 1;
+        for (uint16_t line = 0; line < DEBOUNCE_LINES; line++) {
+            if (((data[line / 8] >> (line % 8)) & 1) != dbState[line])
+                wrong += 1;
+        }
+    }
+    for (uint16_t line = 0; line < DEBOUNCE_LINES; line++) {
+        if (dbChanges[line] == 0)
+            wrong += 1;
+    }
+
+    // settle every line OFF, then turn them all ON and keep them there
+    dbRandom = false;
+    memset(dbRaw, 0, sizeof(dbRaw));
+    for (int i = 0; i < 8 * DEBOUNCE_LINES; i++)
+        cmri.check();
+    memset(dbRaw, 1, sizeof(dbRaw));
+    memset(dbSampled, 0, sizeof(dbSampled));
+
+    // each check() takes one step, and so samples a line at most once,
+    // so the first reply with a line ON says how many samples it took
+    unsigned long seen[DEBOUNCE_LINES] = { 0 };
+    for (int i = 0; i < 8 * DEBOUNCE_LINES; i++) {
+        pollReply(cmri, s, data);
+        for (uint16_t line = 0; line < DEBOUNCE_LINES && data.size() > line / 8; line++) {
+            if (seen[line] == 0 && ((data[line / 8] >> (line % 8)) & 1))
+                seen[line] = dbSampled[line];
+        }
+    }
+    unsigned long late = 0;
+    for (uint16_t line = 0; line < DEBOUNCE_LINES; line++) {
+        if (seen[line] != dbSamples[line])
+            late += 1;
+    }
+
+    printf("  %2u lines a step  %5lu polls  %lu wrong  %lu lines not changed after "
+           "exactly their samples  %s\n", linesPerStep, polls, wrong, late,
+           wrong || late ? "FAILED" : "ok");
+    return wrong == 0 && late == 0;
+}
+
+static bool debounceChecks()
+{
+    bool ok = true;
+
+    ok &= debounceCheck(7);
+    ok &= debounceCheck(24);
+    ok &= debounceCheck(DEBOUNCE_LINES);
+    return ok;
+}
+
+
+/*
+ * One CMRI object serving several node addresses: poll each of them in
+ * turn and check that each reply carries the right source address
+ */
+
+static bool multiNodeBenchmark()
+{
+    static const int extraNodes = 3;
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    CMRINode extra[extraNodes] = { CMRINode(NODE + 1), CMRINode(NODE + 10), CMRINode(NODE + 100) };
+
+    cmri.setInputHandler(24, benchBulkInputHandler);
+    for (int i = 0; i < extraNodes; i++) {
+        extra[i].setInputHandler(24, benchBulkInputHandler);
+        if (!cmri.addNode(extra[i])) {
+            printf("  addNode failed\n");
+            return false;
+        }
+    }
+
+    const uint8_t addrs[] = { NODE_ADDR, NODE_ADDR + 1, NODE_ADDR + 10, NODE_ADDR + 100 };
+    unsigned long rounds = 20000 * scale, wrong = 0;
+    uint64_t t0 = hostNanos();
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        uint8_t addr = addrs[r % 4];
+        s.injectFrame(addr, 'P', NULL, 0);
+        cmri.check();
+        if (s.written().size() < 5 || s.written()[3] != addr)
+            wrong += 1;
+        s.clearWritten();
+    }
+
+    uint64_t nanos = hostNanos() - t0;
+    printf("  4 addresses, 24 inputs each    %7.0f ns/poll  %lu wrong replies  %s\n",
+           (double) nanos / rounds, wrong, wrong ? "FAILED" : "ok");
+    return wrong == 0;
+}
+
+
+/*
+ * A CMRI object constructed with an address that is not a node address
+ * (128 to 255) serves nothing itself, and must still work for the nodes
+ * added to it
+ */
+
+static bool badAddressBenchmark()
+{
+    unsigned long wrong = 0;
+
+    for (int n = 128; n < 256; n++) {
+        LoopbackStream s;
+        CMRI cmri(s, n);
+        CMRINode extra(NODE);
+        extra.setInputHandler(24, benchBulkInputHandler);
+        if (!cmri.addNode(extra)) {
+            wrong += 1;
+            continue;
+        }
+
+        for (int addr = 65; addr < 65 + 128; addr++) {
+            s.injectFrame(addr, 'P', NULL, 0);
+            cmri.check();
+            bool replied = !s.written().empty();
+            if (replied != (addr == NODE_ADDR) || (replied && s.written()[3] != addr))
+                wrong += 1;
+            s.clearWritten();
+        }
+    }
+
+    printf("  constructed as 128 to 255, node %u added    %lu wrong replies  %s\n",
+           NODE, wrong, wrong ? "FAILED" : "ok");
+    return wrong == 0;
+}
+
+
+/*
+ * Frames for other nodes, with escaped ETX, STX and DLE in their data, are
+ * stepped over: the counters must show exactly the characters after each
+ * type byte (its data, escapes included, and the ETX) and the frames, and
+ * a 'T' for this node right after them, with the same escapes, must be
+ * applied as sent.  Both check() and feed() are run over the same bus.
+ */
+
+static uint8_t skipOutputs[8];
+
+static void skipOutputHandler(uint16_t line, bool isOn)
+{
+    if (isOn)
+        skipOutputs[line / 8] |= 1 << (line % 8);
+    else
+        skipOutputs[line / 8] &= ~(1 << (line % 8));
+}
+
+static bool skipBenchmark(const char *name, bool useFeed)
+{
+    static const uint8_t special[] = { 0x02, 0x03, 0x10, 0xFF, 0x41 };
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setOutputHandler(64, skipOutputHandler, NULL);
+    memset(skipOutputs, 0, sizeof(skipOutputs));
+    srand(17);
+
+    unsigned long rounds = 2000 * scale, frames = 0, bytes = 0, wrong = 0;
+    uint64_t nanos = 0;
+    std::vector < uint8_t > traffic;
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        traffic.clear();
+        for (int f = 0; f < 4; f++) {
+            uint8_t data[24];
+            uint16_t len = rand() % sizeof(data);
+            for (uint16_t i = 0; i < len; i++)
+                data[i] = rand() % 2 ? special[rand() % sizeof(special)] : rand();
+
+            size_t before = traffic.size();
+            LoopbackStream::appendFrame(traffic, NODE_ADDR + 1 + rand() % 50, rand() % 2 ? 'T' : 'P',
+                                        data, len);
+            bytes += traffic.size() - before - 5;
+            frames += 1;
+        }
+
+        uint8_t outputs[8];
+        for (int i = 0; i < 8; i++)
+            outputs[i] = special[rand() % sizeof(special)];
+        LoopbackStream::appendFrame(traffic, NODE_ADDR, 'T', outputs, sizeof(outputs));
+
+        uint64_t t0 = hostNanos();
+        if (useFeed) {
+            size_t done = 0;
+            while (done < traffic.size()) {
+                done += cmri.feed(traffic.data() + done, traffic.size() - done);
+                cmri.check();
+            }
+        } else {
+            s.inject(traffic.data(), traffic.size());
+            cmri.check();
+        }
+        nanos += hostNanos() - t0;
+
+        if (memcmp(skipOutputs, outputs, sizeof(outputs)) != 0)
+            wrong += 1;
+    }
+
+    bool ok = wrong == 0 && cmri.skippedFrames() == frames && cmri.skippedBytes() == bytes;
+    printf("  %-8s %5.0f ns/round  skipped %lu of %lu frames, %lu of %lu characters,"
+           "  %lu 'T' frames misread  %s\n", name, (double) nanos / rounds, cmri.skippedFrames(),
+           frames, cmri.skippedBytes(), bytes, wrong, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/*
+ * Message handlers: one for an extended message type must be given its
+ * payload as sent, and one that returns false for 'T', 'P' or 'I' must
+ * leave the library to handle the message as usual (one that returns true
+ * must not).  sendMessage() must frame and escape exactly as CMRInet asks,
+ * and from within a handler reply as the node that was addressed.
+ */
+
+static std::vector < uint8_t > handlerData;
+static uint8_t handlerNode, handlerType;
+static unsigned long handlerCalls;
+static bool handlerTakes;
+static bool handlerReplies;
+static CMRI *handlerStream;
+
+static bool recordingHandler(CMRI & cmri, uint8_t nodeId, uint8_t type, const uint8_t * data,
+                             uint16_t dataLen)
+{
+    handlerData.assign(data, data + dataLen);
+    handlerNode = nodeId;
+    handlerType = type;
+    handlerCalls += 1;
+    handlerStream = &cmri;
+    if (handlerReplies)
+        cmri.sendMessage('Q', data, dataLen);
+    return handlerTakes;
+}
+
+static bool handlerBenchmark()
+{
+    static const uint8_t special[] = { 0x02, 0x03, 0x10, 0xFF, 0x00, 0x41 };
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    CMRINode other(NODE + 3);
+    cmri.setInputHandler(24, benchBulkInputHandler);
+    cmri.setOutputHandler(64, skipOutputHandler, NULL);
+    cmri.addNode(other);
+    cmri.setMessageHandler('Q', recordingHandler);
+    cmri.setMessageHandler('T', recordingHandler);
+    cmri.setMessageHandler('P', recordingHandler);
+    cmri.setMessageHandler('I', recordingHandler);
+    memset(skipOutputs, 0, sizeof(skipOutputs));
+    srand(23);
+
+    unsigned long rounds = 2000 * scale, wrong = 0;
+    for (unsigned long r = 0; r < rounds; r++) {
+        uint8_t data[40];
+        uint16_t len = rand() % sizeof(data);
+        for (uint16_t i = 0; i < len; i++)
+            data[i] = rand() % 2 ? special[rand() % sizeof(special)] : rand();
+        std::vector < uint8_t > expected;
+
+        // an extended type: the handler gets the payload, and its reply
+        // comes from the node addressed, framed and escaped
+        uint8_t addr = r % 2 ? NODE_ADDR : NODE_ADDR + 3;
+        handlerTakes = true;
+        handlerReplies = true;
+        handlerCalls = 0;
+        s.injectFrame(addr, 'Q', data, len);
+        cmri.check();
+        LoopbackStream::appendFrame(expected, addr, 'Q', data, len);
+        if (handlerCalls != 1 || handlerNode != addr - 65 || handlerType != 'Q'
+            || handlerData != std::vector < uint8_t > (data, data + len) || s.written() != expected)
+            wrong += 1;
+        s.clearWritten();
+
+        // outside a handler, the message comes from the constructor's node
+        expected.clear();
+        LoopbackStream::appendFrame(expected, NODE_ADDR, 'Z', data, len);
+        if (!cmri.sendMessage('Z', data, len) || s.written() != expected)
+            wrong += 1;
+        s.clearWritten();
+
+        // 'T' taken by the handler changes nothing; declined, it is applied
+        uint8_t outputs[8], before[8];
+        for (int i = 0; i < 8; i++)
+            outputs[i] = rand();
+        memcpy(before, skipOutputs, sizeof(before));
+        handlerReplies = false;
+        s.injectFrame(NODE_ADDR, 'T', outputs, sizeof(outputs));
+        cmri.check();
+        if (memcmp(skipOutputs, before, sizeof(before)) != 0)
+            wrong += 1;
+        handlerTakes = false;
+        s.injectFrame(NODE_ADDR, 'T', outputs, sizeof(outputs));
+        cmri.check();
+        if (memcmp(skipOutputs, outputs, sizeof(outputs)) != 0 || handlerType != 'T')
+            wrong += 1;
+
+        // likewise a poll: no reply when taken, the usual 'R' when declined
+        handlerTakes = true;
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        cmri.check();
+        if (!s.written().empty())
+            wrong += 1;
+        handlerTakes = false;
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        cmri.check();
+        if (s.written().size() < 9 || s.written()[4] != 'R' || handlerType != 'P')
+            wrong += 1;
+        s.clearWritten();
+    }
+
+    // and an 'I': declined, the configuration is decoded as usual
+    const uint8_t init[] = { 'M', 0, 0, 0 };
+    handlerTakes = true;
+    s.injectFrame(NODE_ADDR, 'I', init, sizeof(init));
+    cmri.check();
+    if (cmri.nodeConfig().nodeType != 0)
+        wrong += 1;
+    handlerTakes = false;
+    s.injectFrame(NODE_ADDR, 'I', init, sizeof(init));
+    cmri.check();
+    if (cmri.nodeConfig().nodeType != 'M' || handlerType != 'I')
+        wrong += 1;
+
+    printf("  %lu rounds of 'Q', sendMessage, 'T' and 'P' taken and declined"
+           "  %lu wrong  %s\n", rounds, wrong, wrong ? "FAILED" : "ok");
+    return wrong == 0;
+}
+
+
+/*
+ * The RAM each configuration takes, and a node with more inputs than a
+ * MAX_MESG_LEN message can report, which must still answer a poll
+ */
+
+static bool capacityBenchmark()
+{
+    printf("  CMRI, default buffers (heap)     %5u bytes\n",
+           (unsigned) (sizeof(CMRI) + CMRI::MAX_MESG_LEN + CMRI::MAX_FRAME_LEN));
+    printf("  CMRIStatic<8, 24, 48> (SMINI)    %5u bytes\n",
+           (unsigned) CMRIStatic < 8, 24, 48 >::ramFootprint());
+    printf("  CMRIStatic<72, 568, 576>         %5u bytes\n",
+           (unsigned) CMRIStatic < 72, 568, 576 >::ramFootprint());
+    printf("  CMRIStatic<260, 2048, 2048>      %5u bytes\n",
+           (unsigned) CMRIStatic < 260, 2048, 2048 >::ramFootprint());
+    printf("  CMRIStaticNode<24, 48>           %5u bytes\n",
+           (unsigned) CMRIStaticNode < 24, 48 >::ramFootprint());
+
+    LoopbackStream s;
+    static CMRIStatic < 260, 2048, 2048 > cmri(s, NODE);
+    if (!cmri.setInputHandler(2048, benchBulkInputHandler)) {
+        printf("  setInputHandler failed\n");
+        return false;
+    }
+
+    unsigned long rounds = 20000 * scale, wrong = 0;
+    uint64_t t0 = hostNanos();
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        inputPhase = (uint16_t) r;
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        cmri.check();
+        // 257 data bytes, plus any escapes
+        if (s.written().size() < 257 + 6 || s.written()[4] != 'R')
+            wrong += 1;
+        s.clearWritten();
+    }
+
+    uint64_t nanos = hostNanos() - t0;
+    printf("  2048 inputs, 257 byte reply    %7.0f ns/poll  %lu wrong replies  %s\n",
+           (double) nanos / rounds, wrong, wrong ? "FAILED" : "ok");
+    return wrong == 0;
+}
+
+
+/*
+ * CMRIStatic and CMRIStaticNode built on memory that is not zeroed, as
+ * one on the stack would be: an all-ON 'T' must drive every output, and
+ * a poll must report the inputs and nothing left over in the buffers.
+ */
+
+static unsigned long dirtyOutputsOn;
+
+static void dirtyOutputHandler(uint16_t line, bool isOn)
+{
+    (void) line;
+    if (isOn)
+        dirtyOutputsOn += 1;
+}
+
+static void dirtyInputHandler(uint16_t firstLine, uint16_t numLines, uint8_t * data)
+{
+    (void) firstLine;
+    memset(data, 0, (numLines + 7) / 8);
+}
+
+static bool dirtyStorageBenchmark()
+{
+    typedef CMRIStatic < 8, 24, 48 > Smini;
+    typedef CMRIStaticNode < 24, 48 > SminiNode;
+    alignas(Smini) uint8_t cmriMemory[sizeof(Smini)];
+    alignas(SminiNode) uint8_t nodeMemory[sizeof(SminiNode)];
+    memset(cmriMemory, 0xFF, sizeof(cmriMemory));
+    memset(nodeMemory, 0xFF, sizeof(nodeMemory));
+
+    LoopbackStream s;
+    Smini *cmri = new(cmriMemory) Smini(s, NODE);
+    SminiNode *node = new(nodeMemory) SminiNode(NODE + 1);
+    cmri->setOutputHandler(48, dirtyOutputHandler, NULL);
+    cmri->setInputHandler(24, dirtyInputHandler);
+    node->setOutputHandler(48, dirtyOutputHandler, NULL);
+    node->setInputHandler(24, dirtyInputHandler);
+    bool ok = cmri->addNode(*node);
+
+    const uint8_t allOn[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    unsigned long driven[2], replyWrong = 0;
+    for (int n = 0; n < 2; n++) {
+        dirtyOutputsOn = 0;
+        s.injectFrame(NODE_ADDR + n, 'T', allOn, sizeof(allOn));
+        while (cmri->check(0, 0))
+            ;
+        driven[n] = dirtyOutputsOn;
+
+        std::vector < uint8_t > expected, zeros(24 / 8 + 1, 0);
+        LoopbackStream::appendFrame(expected, NODE_ADDR + n, 'R', zeros.data(), zeros.size());
+        s.injectFrame(NODE_ADDR + n, 'P', NULL, 0);
+        while (cmri->check(0, 0))
+            ;
+        if (s.written() != expected)
+            replyWrong += 1;
+        s.clearWritten();
+    }
+
+    node->~SminiNode();
+    cmri->~Smini();
+
+    ok &= driven[0] == 48 && driven[1] == 48 && replyWrong == 0;
+    printf("  on dirty memory, all-ON 'T' drove %lu and %lu of 48 outputs  "
+           "%lu wrong replies  %s\n", driven[0], driven[1], replyWrong, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/*
+ * Measure the worst case time spent in one call to check() while a long
+ * 'T' message with many changing outputs is processed, with and without
+ * a budget.  The output handler is deliberately slow (as an I2C write
+ * would be).
+ */
+
+static void slowOutputHandler(uint16_t line, bool isOn)
+{
+    (void) line;
+    (void) isOn;
+    delayMicroseconds(2);
+}
+
+static void jitterBenchmark(const char *name, uint16_t maxBytes, unsigned long maxMicros)
+{
+    static const uint16_t numOutputs = 512;
+    uint64_t worst = 0, total = 0;
+    unsigned long calls = 0;
+
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setOutputHandler(numOutputs, slowOutputHandler, NULL);
+
+    for (unsigned long r = 0; r < 20 * scale; r++) {
+        uint8_t data[numOutputs / 8];
+        memset(data, (r & 1) ? 0x55 : 0xAA, sizeof(data));
+        s.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+
+        bool pending = true;
+        while (pending) {
+            uint64_t t0 = hostNanos();
+            if (maxBytes || maxMicros) {
+                pending = cmri.check(maxBytes, maxMicros);
+            } else {
+                cmri.check();
+                pending = false;
+            }
+            uint64_t t = hostNanos() - t0;
+            worst = std::max(worst, t);
+            total += t;
+            calls += 1;
+        }
+    }
+
+    printf("  %-34s worst %8.1f us/call  mean %8.1f us/call  %6lu calls\n",
+           name, worst / 1e3, (double) total / calls / 1e3, calls);
+}
+
+static void jitterBenchmarks()
+{
+    printf("time per check() call, 512 output 'T' frames, 2 us per output change\n");
+
+    jitterBenchmark("unbounded check()", 0, 0);
+    jitterBenchmark("check(32)", 32, 0);
+    jitterBenchmark("check(0, 100)", 0, 100);
+}
+
+
+/*
+ * check(1) with the inputs scanned in the background: a scan step is
+ * due on every call, and the poll must still be read and answered.
+ */
+
+static bool scanBudgetCheck(unsigned long intervalMicros)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(96, benchBulkInputHandler);
+    cmri.setInputScan(16, intervalMicros);
+
+    unsigned long rounds = 1000 * scale, answered = 0, calls = 0;
+    for (unsigned long r = 0; r < rounds; r++) {
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        for (int c = 0; c < 64 && s.written().empty(); c++) {
+            cmri.check(1);
+            calls += 1;
+        }
+        if (s.written().size() >= 9 && s.written()[4] == 'R')
+            answered += 1;
+        s.clearWritten();
+    }
+
+    bool ok = answered == rounds;
+    printf("  check(1), scan every %4lu us   %lu of %lu polls answered, %.1f calls each  %s\n",
+           intervalMicros, answered, rounds, (double) calls / rounds, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/*
+ * Apply the same 'T' messages to 64 outputs on eight 8 bit expander
+ * ports, once with a write per changed line and once with the lines
+ * grouped by port, counting the writes each takes.  The lines are spread
+ * over the ports (line n is bit n / 8 of port n % 8), and the latches
+ * written must end up matching the outputs sent.
+ */
+
+static const uint8_t BENCH_PORTS = 8;
+static uint8_t lineLatch[BENCH_PORTS], portLatch[BENCH_PORTS];
+static unsigned long lineWrites, portWrites, changeCalls, changedLines;
+
+static void lineWriteHandler(uint16_t line, bool isOn)
+{
+    uint8_t bit = 1 << (line / 8);
+
+    lineLatch[line % 8] = isOn ? (lineLatch[line % 8] | bit) : (lineLatch[line % 8] & ~bit);
+    lineWrites += 1;
+}
+
+static void portWriteHandler(uint8_t port, uint8_t mask, uint8_t bits)
+{
+    portLatch[port] = (portLatch[port] & ~mask) | bits;
+    portWrites += 1;
+}
+
+static void changeListHandler(const CMRIOutputChange changes[], uint8_t count)
+{
+    (void) changes;
+    changeCalls += 1;
+    changedLines += count;
+}
+
+static bool portBenchmark()
+{
+    static const uint16_t numOutputs = 64;
+    uint8_t portMap[numOutputs];
+
+    for (uint16_t line = 0; line < numOutputs; line++)
+        portMap[line] = (line % 8) * 8 + line / 8;
+
+    LoopbackStream s1, s2;
+    CMRI perLine(s1, NODE), byPort(s2, NODE);
+    perLine.setOutputHandler(numOutputs, lineWriteHandler, NULL);
+    perLine.setOutputChangeHandler(numOutputs, changeListHandler);
+    byPort.setOutputHandler(numOutputs, lineWriteHandler, NULL);
+    if (!byPort.setOutputPorts(BENCH_PORTS, portMap, portWriteHandler)) {
+        printf("  setOutputPorts failed  FAILED\n");
+        return false;
+    }
+
+    memset(lineLatch, 0, sizeof(lineLatch));
+    memset(portLatch, 0, sizeof(portLatch));
+    lineWrites = portWrites = changeCalls = changedLines = 0;
+    srand(1);
+
+    unsigned long frames = 2000 * scale, wrong = 0;
+    for (unsigned long r = 0; r < frames; r++) {
+        uint8_t data[numOutputs / 8];
+        for (size_t i = 0; i < sizeof(data); i++)
+            data[i] = rand();
+
+        s1.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+        perLine.check();
+        unsigned long before = lineWrites;
+        s2.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+        byPort.check();
+        if (lineWrites != before)
+            wrong += 1;         // no line is off the ports
+
+        uint8_t expected[BENCH_PORTS] = { 0 };
+        for (uint16_t line = 0; line < numOutputs; line++) {
+            if (data[line / 8] & (1 << (line % 8)))
+                expected[line % 8] |= 1 << (line / 8);
+        }
+        if (memcmp(expected, lineLatch, sizeof(expected)) != 0
+            || memcmp(expected, portLatch, sizeof(expected)) != 0)
+            wrong += 1;
+    }
+
+    bool ok = wrong == 0 && changedLines == lineWrites;
+    printf("  per line                       %6.1f writes/frame\n", (double) lineWrites / frames);
+    printf("  change list                    %6.1f calls/frame, %.1f lines each\n",
+           (double) changeCalls / frames, (double) changedLines / changeCalls);
+    printf("  grouped by port                %6.1f writes/frame  %lu wrong  %s\n",
+           (double) portWrites / frames, wrong, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/*
+ * Output effects: 8 groups of 8 lines, one group to an expander port,
+ * blinking on a node with 512 outputs.  check() should cost about the
+ * same as without them, and each step of a group should be one port write.
+ */
+
+static unsigned long effectPortWrites;
+
+static void effectPortHandler(uint8_t port, uint8_t mask, uint8_t bits)
+{
+    (void) port;
+    (void) mask;
+    (void) bits;
+    effectPortWrites++;
+}
+
+static double effectCheckNanos(bool withEffects, unsigned long &steps)
+{
+    static const uint16_t numOutputs = 512;
+    static uint8_t portMap[numOutputs];
+
+    for (uint16_t line = 0; line < numOutputs; line++)
+        portMap[line] = line < 64 ? line : CMRINode::NO_PORT;
+
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setOutputHandler(numOutputs, benchOutputHandler, NULL);
+    cmri.setOutputPorts(8, portMap, effectPortHandler);
+
+    // control lines 64 to 71, each for a group of 8 lines on a port
+    if (withEffects) {
+        for (uint16_t g = 0; g < 8; g++)
+            cmri.addOutputEffect(CMRINode::EFFECT_BLINK, 64 + g, 8 * g, 8, 20 + 5 * g);
+    }
+    uint8_t data[numOutputs / 8] = { 0 };
+    data[8] = 0xFF;
+    s.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+    cmri.check();
+
+    effectPortWrites = 0;
+    unsigned long checks = 0;
+    uint64_t start = hostNanos(), end = start + 300000000ull;
+    while (hostNanos() < end) {
+        cmri.check();
+        checks++;
+    }
+    uint64_t nanos = hostNanos() - start;
+
+    // every group blinks for 300 ms, a step every 20 to 55 ms
+    steps = 0;
+    if (withEffects) {
+        for (uint16_t g = 0; g < 8; g++)
+            steps += 300 / (20 + 5 * g);
+    }
+    return (double) nanos / checks;
+}
+
+static bool effectsBenchmark()
+{
+    unsigned long steps, none;
+    double plain = effectCheckNanos(false, none);
+    double effects = effectCheckNanos(true, steps);
+    unsigned long writes = effectPortWrites;
+
+    // a step or so per group may fall either side of the end
+    bool ok = writes + 8 >= steps && writes <= steps + 8;
+    printf("  no effects     %6.1f ns/check()\n", plain);
+    printf("  8 effects      %6.1f ns/check()  %lu port writes for %lu steps  %s\n",
+           effects, writes, steps, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/*
+ * What the effects do to their lines, as the output handler sees them:
+ * an ALTERNATE pair of crossing lights, a PULSE and a BLINK, while the
+ * host sends 'T' frames that keep the control lines ON and set the
+ * driven lines at random, which must make no difference.  Then the host
+ * turns the control lines OFF, and every driven line must follow.  The
+ * overallOutputHandler must see the same as the per-line handler, and an
+ * effect whose control line is driven by another, or which drives
+ * another's control line, must be refused.
+ */
+
+static bool fxLines[64], fxOverall[64];
+
+static void fxLineHandler(uint16_t line, bool isOn)
+{
+    fxLines[line] = isOn;
+}
+
+static void fxOverallHandler(uint16_t numOutputs, bool outputs[])
+{
+    memcpy(fxOverall, outputs, numOutputs * sizeof(bool));
+}
+
+static bool effectStateCheck()
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setOutputHandler(64, fxLineHandler, fxOverallHandler);
+    memset(fxLines, 0, sizeof(fxLines));
+    memset(fxOverall, 0, sizeof(fxOverall));
+
+    // control lines 40 to 42, for lines 0 to 23
+    cmri.addOutputEffect(CMRINode::EFFECT_ALTERNATE, 40, 0, 8, 30);
+    cmri.addOutputEffect(CMRINode::EFFECT_PULSE, 41, 8, 8, 40);
+    cmri.addOutputEffect(CMRINode::EFFECT_BLINK, 42, 16, 8, 25, 15);
+
+    unsigned long overlaps = 0;
+    if (cmri.addOutputEffect(CMRINode::EFFECT_BLINK, 4, 30, 2, 10))
+        overlaps += 1;
+    if (cmri.addOutputEffect(CMRINode::EFFECT_BLINK, 43, 40, 2, 10))
+        overlaps += 1;
+
+    uint8_t data[8] = { 0 };
+    data[5] = 0x07;
+    s.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+    cmri.check();
+    unsigned long start = millis(), pulseEnd = 0;
+    unsigned long unlit = 0, apart = 0, ragged = 0, relit = 0, flips = 0, unseen = 0;
+    bool lastPhase = fxLines[0];
+
+    if (!fxLines[0] || !fxLines[8] || !fxLines[16])
+        unlit += 1;
+
+    srand(21);
+    while (millis() - start < 200) {
+        // whatever the host says about the driven lines
+        data[0] = rand();
+        data[1] = rand();
+        data[2] = rand();
+        s.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+        for (int i = 0; i < 20; i++)
+            cmri.check();
+
+        for (int i = 0; i < 8; i += 2) {
+            if (fxLines[i] == fxLines[i + 1] || fxLines[i] != fxLines[0])
+                apart += 1;
+        }
+        if (fxLines[0] != lastPhase) {
+            lastPhase = fxLines[0];
+            flips += 1;
+        }
+        for (int i = 17; i < 24; i++) {
+            if (fxLines[i] != fxLines[16])
+                ragged += 1;
+        }
+        if (pulseEnd == 0 && !fxLines[8])
+            pulseEnd = millis() - start;
+        for (int i = 8; i < 16; i++) {
+            if (pulseEnd != 0 && fxLines[i])
+                relit += 1;
+        }
+        if (memcmp(fxOverall, fxLines, sizeof(fxLines)) != 0)
+            unseen += 1;
+    }
+
+    // the pulse ends on the first 8 ms tick of the wheel after onMillis,
+    // allowing a couple more for this loop
+    bool pulseOk = pulseEnd >= 40 && pulseEnd <= 40 + 3 * 8;
+
+    data[5] = 0;
+    data[0] = data[1] = data[2] = 0xFF;
+    s.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+    unsigned long lit = 0;
+    for (int i = 0; i < 1000; i++) {
+        cmri.check();
+        for (int line = 0; line < 24; line++) {
+            if (fxLines[line])
+                lit += 1;
+        }
+    }
+    if (memcmp(fxOverall, fxLines, sizeof(fxLines)) != 0)
+        unseen += 1;
+
+    bool ok = unlit == 0 && apart == 0 && flips >= 4 && ragged == 0 && pulseOk && relit == 0
+        && lit == 0 && unseen == 0 && overlaps == 0;
+    printf("  ALTERNATE %lu out of phase, %lu flips  PULSE ended at %lu ms, %lu relit  "
+           "BLINK %lu ragged  %lu ON after OFF  %lu not as overall handler saw  "
+           "%lu control overlaps taken  %s\n", apart, flips, pulseEnd, relit, ragged, lit,
+           unseen, overlaps, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/*
+ * The receive ring, filled by a producer thread one character at a time
+ * while check() empties it: 'T' frames for the node under test, each
+ * ending in a check byte, with frames for other nodes between them.  With
+ * a producer that waits for room every frame must arrive.  With one that
+ * does not, characters are lost, but no frame that lost any may be
+ * handled.
+ */
+
+static const uint16_t RING_FRAME_DATA = 16;
+static unsigned long ringGood, ringBad;
+
+static bool ringFrameHandler(CMRI & cmri, uint8_t nodeId, uint8_t type, const uint8_t * data,
+                             uint16_t dataLen)
+{
+    (void) cmri;
+    (void) nodeId;
+    (void) type;
+
+    uint8_t sum = 0;
+    for (uint16_t i = 0; i + 1 < dataLen; i++)
+        sum += data[i];
+    if (dataLen == RING_FRAME_DATA && data[dataLen - 1] == sum)
+        ringGood++;
+    else
+        ringBad++;
+    return true;
+}
+
+static bool ringBenchmark(const char *name, CMRIRing & ring, bool waitForRoom)
+{
+    std::vector < uint8_t > traffic;
+    unsigned long frames = 20000 * scale;
+    srand(5);
+
+    for (unsigned long f = 0; f < frames; f++) {
+        uint8_t data[RING_FRAME_DATA], sum = 0;
+        for (uint16_t i = 0; i + 1 < RING_FRAME_DATA; i++) {
+            data[i] = rand();
+            sum += data[i];
+        }
+        data[RING_FRAME_DATA - 1] = sum;
+        LoopbackStream::appendFrame(traffic, NODE_ADDR, 'T', data, sizeof(data));
+        LoopbackStream::appendFrame(traffic, NODE_ADDR + 1, 'T', data, sizeof(data));
+    }
+
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setMessageHandler('T', ringFrameHandler);
+    cmri.setReceiveRing(&ring);
+    ringGood = ringBad = 0;
+
+    volatile bool done = false;
+    uint64_t start = hostNanos();
+
+    // a producer that does not wait runs as a UART would, a character
+    // every microsecond whether or not there is room
+    std::thread producer([&] {
+        uint64_t next = hostNanos();
+        for (size_t i = 0; i < traffic.size(); i++) {
+            if (waitForRoom) {
+                while (ring.room() == 0)
+                    std::this_thread::yield();
+            } else {
+                while (hostNanos() < next)
+                    ;
+                next += 1000;
+            }
+            ring.push(traffic[i]);
+        }
+        done = true;
+    });
+
+    for (unsigned long n = 0; !done || ring.available() > 0; n++) {
+        cmri.check();
+        if (!waitForRoom && n % 64 == 0)
+            delayMicroseconds(100);     // a loop() busy elsewhere
+    }
+    producer.join();
+    cmri.check();
+
+    uint64_t nanos = hostNanos() - start;
+    CMRI::Metrics m;
+    cmri.getMetrics(m);
+    unsigned long overrunErrors = m.errors[CMRI::ERROR_OVERRUN];
+
+    bool ok = ringBad == 0 && (waitForRoom ? ringGood == frames && ring.overruns() == 0
+                               : ring.overruns() > 0 && overrunErrors > 0 && ringGood > 0);
+    printf("  %-26s %6.1f MB/s  %lu of %lu frames  %lu characters lost, %lu frames dropped"
+           "  %lu bad  %s\n", name, traffic.size() / (nanos / 1e3), ringGood, frames,
+           ring.overruns(), overrunErrors, ringBad, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool ringBenchmarks()
+{
+    static CMRIStaticRing < 4096 > large;
+    static CMRIStaticRing < 256 > small;
+    bool ok = true;
+
+    ok &= ringBenchmark("4096 bytes, no losses", large, true);
+    ok &= ringBenchmark("256 bytes, consumer stalls", small, false);
+    return ok;
+}
+
+
+/*
+ * A long 'T' frame (512 outputs, 64 data bytes) arriving 8 characters at
+ * a time, as from a UART, with check() after each piece, and a few lines
+ * changed by each frame.  Reports the time spent in check() while the
+ * frame arrives and after its ETX, with and without streaming outputs,
+ * and checks that both apply the same changes.  With 32 bit words the
+ * compare after the ETX is only 16 steps; on an AVR it is 64.
+ */
+
+static unsigned long streamChanges;
+static uint32_t streamSum;
+
+static void streamOutputHandler(uint16_t line, bool isOn)
+{
+    streamChanges += 1;
+    streamSum = streamSum * 31 + line * 2 + isOn;
+}
+
+static bool streamingBenchmark(const char *name, bool streaming, uint32_t & sum)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setOutputHandler(512, streamOutputHandler, NULL);
+    if (!cmri.setStreamingOutputs(streaming))
+        return false;
+
+    uint8_t data[64];
+    memset(data, 0, sizeof(data));
+    streamChanges = 0;
+    streamSum = 0;
+    srand(9);
+
+    unsigned long frames = 20000 * scale;
+    uint64_t during = 0, after = 0;
+    std::vector < uint8_t > frame;
+    for (unsigned long f = 0; f < frames; f++) {
+        for (int c = 0; c < 4; c++)
+            data[rand() % sizeof(data)] ^= 1 << (rand() % 8);
+        frame.clear();
+        LoopbackStream::appendFrame(frame, NODE_ADDR, 'T', data, sizeof(data));
+
+        size_t last = frame.size() - 1;
+        for (size_t i = 0; i < last; i += 8) {
+            s.inject(frame.data() + i, i + 8 < last ? 8 : last - i);
+            uint64_t t0 = hostNanos();
+            cmri.check();
+            during += hostNanos() - t0;
+        }
+
+        s.inject(frame[last]);
+        uint64_t t0 = hostNanos();
+        cmri.check();
+        after += hostNanos() - t0;
+    }
+
+    sum = streamSum;
+    printf("  %-10s while arriving %6.0f ns/frame  after ETX %5.0f ns/frame  %lu changes\n",
+           name, (double) during / frames, (double) after / frames, streamChanges);
+    return true;
+}
+
+// 'T' frames of 0 to 6 bytes, to nodes of 8 to 40 outputs: after the
+// staged bytes of a frame shorter than the model, the compare carries on
+// from a byte that need not start a word
+static uint32_t shortFramesSum(bool streaming)
+{
+    streamChanges = 0;
+    streamSum = 0;
+    srand(24);
+
+    for (uint16_t lines = 8; lines <= 40; lines++) {
+        LoopbackStream s;
+        CMRI cmri(s, NODE);
+        cmri.setOutputHandler(lines, streamOutputHandler, NULL);
+        cmri.setStreamingOutputs(streaming);
+
+        for (int f = 0; f < 50; f++) {
+            uint8_t data[6];
+            uint16_t len = rand() % (sizeof(data) + 1);
+            for (uint16_t i = 0; i < len; i++)
+                data[i] = rand();
+            s.injectFrame(NODE_ADDR, 'T', data, len);
+            while (cmri.check(0))
+                ;
+        }
+    }
+    return streamSum;
+}
+
+static bool streamingBenchmarks()
+{
+    uint32_t plain, streamed;
+    bool ok = streamingBenchmark("at ETX", false, plain);
+    ok &= streamingBenchmark("streaming", true, streamed);
+    ok &= plain == streamed;
+    printf("  same changes applied  %s\n", ok ? "ok" : "FAILED");
+
+    uint32_t shortPlain = shortFramesSum(false);
+    unsigned long changes = streamChanges;
+    uint32_t shortStreamed = shortFramesSum(true);
+    bool same = shortPlain == shortStreamed && changes == streamChanges && changes > 0;
+    printf("  short frames, 8 to 40 outputs  %lu changes  same changes applied  %s\n",
+           changes, same ? "ok" : "FAILED");
+    return ok && same;
+}
+
+
+/*
+ * One node served on two streams, with check(32) as a loop() with little
+ * time to spare would call it.  Stream A carries a backlog of frames for
+ * other nodes; the polls arriving on B must be answered on B, within a
+ * check() or two, rather than wait for A's backlog to drain.
+ */
+
+static bool streamsBenchmark()
+{
+    LoopbackStream a, b;
+    CMRI cmri(a, NODE);
+    CMRI second(b, NODE);
+    cmri.setInputHandler(96, benchBulkInputHandler);
+    if (!cmri.addStream(second))
+        return false;
+
+    uint8_t data[32];
+    memset(data, 0x55, sizeof(data));
+
+    unsigned long rounds = 1000 * scale, total = 0, worst = 0, backlog = 0;
+    bool ok = true;
+    for (unsigned long r = 0; r < rounds; r++) {
+        for (int f = 0; f < 16; f++)
+            a.injectFrame(NODE_ADDR + 1, 'T', data, sizeof(data));
+        backlog += a.available();
+        b.injectFrame(NODE_ADDR, 'P', NULL, 0);
+
+        unsigned long calls = 0;
+        while (b.written().empty() && calls < 10000) {
+            cmri.check(32);
+            calls++;
+        }
+        total += calls;
+        if (calls > worst)
+            worst = calls;
+        ok &= b.written().size() > 0 && b.written()[b.written().size() - 1] == 0x03
+            && a.written().empty();
+        b.clearWritten();
+
+        while (cmri.check(32))
+            ;
+    }
+
+    ok &= worst <= 2;
+    printf("  %lu polls on B behind %lu bytes queued on A: %.2f check(32) calls to answer,"
+           " %lu at most (A alone needs %lu)  %s\n", rounds, backlog / rounds,
+           (double) total / rounds, worst, backlog / rounds / 32, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/*
+ * Message handlers with two streams: those set on either object are the
+ * main object's, a message on the second stream reaches them with that
+ * object and is answered there, and monitor mode on the second stream
+ * leaves the first alone.
+ */
+
+static bool streamHandlerCheck()
+{
+    static const uint8_t data[] = { 0x02, 0x10, 0x41, 0x03 };
+    LoopbackStream a, b;
+    CMRI cmri(a, NODE);
+    CMRI second(b, NODE);
+    cmri.setInputHandler(24, benchBulkInputHandler);
+    cmri.addStream(second);
+    cmri.setMessageHandler('Q', recordingHandler);
+    second.setMessageHandler('Z', recordingHandler);
+    handlerTakes = true;
+    handlerReplies = true;
+    unsigned long wrong = 0;
+
+    std::vector < uint8_t > expected;
+    LoopbackStream::appendFrame(expected, NODE_ADDR, 'Q', data, sizeof(data));
+
+    // 'Q' set on the main object, sent on the second stream
+    handlerCalls = 0;
+    b.injectFrame(NODE_ADDR, 'Q', data, sizeof(data));
+    cmri.check();
+    if (handlerCalls != 1 || handlerStream != &second || b.written() != expected
+        || !a.written().empty())
+        wrong += 1;
+    b.clearWritten();
+
+    // 'Z' set on the second object, sent on the main stream
+    handlerCalls = 0;
+    a.injectFrame(NODE_ADDR, 'Z', data, sizeof(data));
+    second.check();
+    if (handlerCalls != 1 || handlerStream != &cmri || handlerType != 'Z'
+        || a.written() != expected || !b.written().empty())
+        wrong += 1;
+    a.clearWritten();
+
+    // the second stream watches every address, the main one does not
+    second.setMonitorMode(true);
+    handlerReplies = false;
+    handlerCalls = 0;
+    b.injectFrame(NODE_ADDR + 7, 'Q', data, sizeof(data));
+    a.injectFrame(NODE_ADDR + 7, 'Q', data, sizeof(data));
+    for (int i = 0; i < 4; i++)
+        cmri.check();
+    if (handlerCalls != 1 || handlerStream != &second || handlerNode != NODE + 7)
+        wrong += 1;
+
+    printf("  message handlers and monitor mode on a second stream  %lu wrong  %s\n", wrong,
+           wrong ? "FAILED" : "ok");
+    return wrong == 0;
+}
+
+
+/*
+ * Check the RS-485 transmit enable timing against a stream that models a
+ * 57600 baud UART: DE must be asserted before the first byte is written,
+ * and must not be released before the last character has left the wire.
+ * Reports how close to those limits the library gets.
+ */
+
+static LoopbackStream *deStream;
+static uint64_t deAssertNanos, deReleaseNanos, deReleaseEarly;
+
+static void benchTransmitEnable(bool enable)
+{
+    uint64_t now = hostNanos();
+    if (enable) {
+        deAssertNanos = now;
+    } else {
+        deReleaseNanos = now;
+        if (now < deStream->wireIdleNanos)
+            deReleaseEarly += 1;
+    }
+}
+
+static bool benchTransmitIdle()
+{
+    return deStream->queued() == 0;
+}
+
+static bool turnaroundBenchmark(const char *name, bool nonBlocking, bool idleHandler)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(96, benchBulkInputHandler);
+    cmri.setTransmitEnableHandler(benchTransmitEnable);
+    cmri.setNonBlockingTransmit(nonBlocking);
+    if (idleHandler)
+        cmri.setTransmitIdleHandler(benchTransmitIdle);
+    s.setTimestamps(true);
+    s.setLineRate(57600, 16);
+    deStream = &s;
+    deReleaseEarly = 0;
+
+    std::vector < uint64_t > lead, lag;
+    uint64_t lateAssert = 0;
+    unsigned long rounds = 200 * scale;
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        while (cmri.check(0, 0)) {
+        }
+
+        if (deAssertNanos > s.firstWriteNanos)
+            lateAssert += 1;
+        lead.push_back(s.firstWriteNanos - deAssertNanos);
+        lag.push_back(deReleaseNanos - s.wireIdleNanos);
+        s.clearWritten();
+    }
+
+    // a frame that is not a reply has no request to measure from, so it
+    // must leave the request timing as it was
+    const CMRI::TransmitTiming & t = cmri.transmitTiming();
+    unsigned long requestToEnable = t.requestToEnable, maxRequestToEnable = t.maxRequestToEnable;
+    static const uint8_t unsolicited[] = { 0x01 };
+    delayMicroseconds(2000);
+    cmri.sendMessage('Z', unsolicited, sizeof(unsolicited));
+    while (cmri.check(0, 0)) {
+    }
+    bool unchanged = t.requestToEnable == requestToEnable
+        && t.maxRequestToEnable == maxRequestToEnable;
+    s.clearWritten();
+
+    bool ok = lateAssert == 0 && deReleaseEarly == 0 && unchanged;
+
+    std::sort(lead.begin(), lead.end());
+    std::sort(lag.begin(), lag.end());
+    printf("  %-22s DE lead median %5.1f us  release lag median %5.1f us max %7.1f us  "
+           "(library: ETX->DE max %lu us%s)  %s\n",
+           name, lead[lead.size() / 2] / 1e3, lag[lag.size() / 2] / 1e3, lag.back() / 1e3,
+           t.maxRequestToEnable, unchanged ? "" : ", changed by a frame that is not a reply",
+           ok ? "ok" : "TIMING VIOLATION");
+
+    return ok;
+}
+
+/*
+ * A host that configures a transmit delay with 'I' must not see the reply
+ * start any sooner, and no single check() may block while it is waited
+ * out
+ */
+
+static bool transmitDelayBenchmark(bool nonBlocking)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(24, benchBulkInputHandler);
+    cmri.setNonBlockingTransmit(nonBlocking);
+    s.setTimestamps(true);
+
+    const uint8_t init[] = { 'M', 0, 50, 0 };   // SMINI, 500 us delay
+    s.injectFrame(NODE_ADDR, 'I', init, sizeof(init));
+    cmri.check();
+
+    std::vector < uint64_t > wait;
+    uint64_t longestCheck = 0;
+    unsigned long early = 0, rounds = 200 * scale;
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        for (;;) {
+            uint64_t t0 = hostNanos();
+            bool more = cmri.check(0, 0);
+            uint64_t t = hostNanos() - t0;
+
+            if (t > longestCheck)
+                longestCheck = t;
+            if (!more)
+                break;
+        }
+
+        uint64_t w = s.firstWriteNanos - s.rxDrainedNanos;
+        if (w < cmri.nodeConfig().transmitDelay * 1000)
+            early += 1;
+        wait.push_back(w);
+        s.clearWritten();
+    }
+
+    std::sort(wait.begin(), wait.end());
+    printf("  %-22s delay 500 us: reply after median %6.1f us  longest check() %5.1f us  %s\n",
+           nonBlocking ? "non-blocking" : "blocking", wait[wait.size() / 2] / 1e3,
+           longestCheck / 1e3, early ? "TIMING VIOLATION" : "ok");
+
+    return early == 0;
+}
+
+
+/*
+ * Decoding the 'I' message: the SMINI, USIC and SUSIC layouts, malformed
+ * ones (which must leave the configuration as it was), the check against
+ * the line models, an initHandler that turns one down, and the length of
+ * the 'R' reply, which follows the configuration once there is one.
+ */
+
+static bool initAccept;
+static unsigned long initCalls;
+
+static bool benchInitHandler(uint8_t * data, int dataLen)
+{
+    (void) data;
+    (void) dataLen;
+    initCalls += 1;
+    return initAccept;
+}
+
+static unsigned long initErrors(CMRI & cmri, CMRI::ErrorKind kind)
+{
+    CMRI::Metrics m;
+    cmri.getMetrics(m);
+    return m.errors[kind];
+}
+
+static bool initBenchmark()
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(24, benchBulkInputHandler);
+    cmri.setOutputHandler(48, benchOutputHandler, NULL);
+    cmri.setInitHandler(benchInitHandler);
+    initAccept = true;
+    unsigned long wrong = 0;
+
+    // before any 'I', the reply is one byte more than the whole bytes of
+    // inputs, as it always was
+    if (replyLength(cmri, s) != 4)
+        wrong += 1;
+
+    // SMINI: fixed 24 inputs and 48 outputs, and two searchlights whose
+    // CT bytes must be there
+    const uint8_t smini[] = { 'M', 1, 2, 2, 0, 0, 0, 0, 0, 0 };
+    s.injectFrame(NODE_ADDR, 'I', smini, sizeof(smini));
+    cmri.check();
+    const CMRINode::Config & c = cmri.nodeConfig();
+    if (c.nodeType != 'M' || c.transmitDelay != 2580 || c.numSearchlights != 2
+        || c.inputLines != 24 || c.outputLines != 48 || !c.linesMatch
+        || initErrors(cmri, CMRI::ERROR_CONFIG) != 0 || replyLength(cmri, s) != 3)
+        wrong += 1;
+
+    // malformed: each is counted, and changes nothing
+    const uint8_t shortInit[] = { 'M', 0, 0 };
+    const uint8_t noCT[] = { 'M', 0, 0, 2 };
+    const uint8_t cardCode3[] = { 'N', 0, 0, 1, 0x0D };
+    const uint8_t missingCT[] = { 'X', 0, 0, 3, 0x01, 0x01 };
+    const uint8_t tooManyCT[] = { 'N', 0, 0, 17, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+    const uint8_t badType[] = { 'Q', 0, 0, 0 };
+    const struct {
+        const uint8_t *data;
+        uint16_t len;
+    } malformed[] = {
+        {shortInit, sizeof(shortInit)}, {noCT, sizeof(noCT)}, {cardCode3, sizeof(cardCode3)},
+        {missingCT, sizeof(missingCT)}, {tooManyCT, sizeof(tooManyCT)}, {badType, sizeof(badType)},
+    };
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        unsigned long before = initErrors(cmri, CMRI::ERROR_INIT);
+        s.injectFrame(NODE_ADDR, 'I', malformed[i].data, malformed[i].len);
+        cmri.check();
+        if (initErrors(cmri, CMRI::ERROR_INIT) != before + 1 || c.nodeType != 'M'
+            || c.transmitDelay != 2580)
+            wrong += 1;
+    }
+
+    // USIC: two CT bytes, cards from the low bits up: out, out, in, in,
+    // then in, none, none, none.  3 input and 2 output cards of 24 lines,
+    // which do not match the node's line models.
+    const uint8_t usic[] = { 'N', 0, 0, 2, 0x5A, 0x01 };
+    s.injectFrame(NODE_ADDR, 'I', usic, sizeof(usic));
+    cmri.check();
+    if (c.nodeType != 'N' || c.transmitDelay != 0 || c.inputCards != 3 || c.outputCards != 2
+        || c.inputLines != 72 || c.outputLines != 48 || c.linesMatch
+        || initErrors(cmri, CMRI::ERROR_CONFIG) != 1)
+        wrong += 1;
+
+    // the reply is as long as the host expects: the 3 bytes of the model,
+    // padded with zeros to 9
+    if (replyLength(cmri, s) != 9)
+        wrong += 1;
+
+    // SUSIC: 32 lines a card, one input card and one output card, as 24
+    // inputs and 48 outputs cannot match
+    const uint8_t susic[] = { 'X', 0, 0, 1, 0x09 };
+    s.injectFrame(NODE_ADDR, 'I', susic, sizeof(susic));
+    cmri.check();
+    if (c.nodeType != 'X' || c.inputLines != 32 || c.outputLines != 32 || c.linesMatch
+        || replyLength(cmri, s) != 4)
+        wrong += 1;
+
+    // no input cards at all: the reply has no data
+    const uint8_t outputsOnly[] = { 'N', 0, 0, 1, 0x0A };
+    s.injectFrame(NODE_ADDR, 'I', outputsOnly, sizeof(outputsOnly));
+    cmri.check();
+    if (c.inputLines != 0 || c.outputLines != 48 || replyLength(cmri, s) != 0)
+        wrong += 1;
+
+    // an initHandler that turns it down restores the configuration
+    initAccept = false;
+    initCalls = 0;
+    s.injectFrame(NODE_ADDR, 'I', smini, sizeof(smini));
+    cmri.check();
+    if (initCalls != 1 || c.nodeType != 'N' || c.inputLines != 0 || c.outputLines != 48)
+        wrong += 1;
+    initAccept = true;
+    s.injectFrame(NODE_ADDR, 'I', smini, sizeof(smini));
+    cmri.check();
+    if (c.nodeType != 'M' || !c.linesMatch || replyLength(cmri, s) != 3)
+        wrong += 1;
+
+    printf("  SMINI, USIC, SUSIC and 6 malformed 'I' messages  %lu wrong  %s\n", wrong,
+           wrong ? "FAILED" : "ok");
+    return wrong == 0;
+}
+
+
+/*
+ * A non-blocking reply longer than the stream's transmit FIFO must be
+ * written over several check() calls, as room appears, and come out as
+ * the reference encoder makes it.  DE must be asserted once, and stay
+ * asserted until the last character has left the wire.
+ */
+
+static LoopbackStream *drainStream;
+static size_t drainExpected;
+static unsigned long drainAsserts, drainEarly;
+
+static void drainTransmitEnable(bool enable)
+{
+    if (enable) {
+        drainAsserts += 1;
+    } else if (drainStream->written().size() < drainExpected || drainStream->queued() > 0) {
+        drainEarly += 1;
+    }
+}
+
+static bool drainBenchmark(bool idleHandler)
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(256, replyInputHandler);
+    cmri.setNonBlockingTransmit(true);
+    cmri.setTransmitEnableHandler(drainTransmitEnable);
+    if (idleHandler) {
+        deStream = &s;
+        cmri.setTransmitIdleHandler(benchTransmitIdle);
+    }
+    s.setLineRate(57600, 16);
+    drainStream = &s;
+    drainAsserts = drainEarly = 0;
+
+    unsigned long rounds = 50 * scale, wrong = 0, calls = 0, writingCalls = 0;
+    for (unsigned long r = 0; r < rounds; r++) {
+        for (int i = 0; i < 33; i++)
+            replyModel[i] = 0x41 + (r + i) % 26;
+        replyModel[32] = 0;
+
+        std::vector < uint8_t > expected;
+        LoopbackStream::appendFrame(expected, NODE_ADDR, 'R', replyModel, 33);
+        drainExpected = expected.size();
+
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        bool pending = true;
+        while (pending) {
+            size_t before = s.written().size();
+            pending = cmri.check(0, 0);
+            calls += 1;
+            if (s.written().size() > before)
+                writingCalls += 1;
+        }
+
+        if (s.written() != expected || !cmri.transmitComplete())
+            wrong += 1;
+        s.clearWritten();
+    }
+
+    bool ok = wrong == 0 && drainAsserts == rounds && drainEarly == 0 && writingCalls >= 2 * rounds;
+    printf("  %-22s %lu byte replies, a 16 byte FIFO  %.1f check() calls wrote each  "
+           "%lu DE asserts, %lu released early  %lu wrong  %s\n",
+           idleHandler ? "TX idle" : "flush", (unsigned long) drainExpected,
+           (double) writingCalls / rounds, drainAsserts, drainEarly, wrong, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/*
+ * Streams that do not behave like HardwareSerial: one that never reports
+ * room to write (as Print's own availableForWrite() does), one that takes
+ * a few bytes per write(), and one that stops taking any.  Non-blocking
+ * transmit must be refused on the first, and every poll answered; a
+ * frame the stream will not take must be counted as an error.
+ */
+
+class QuirkyStream:public LoopbackStream {
+  public:
+    int room;                   // what availableForWrite() says
+    size_t perWrite;            // the most one write() takes
+    size_t total;               // the most all writes take, or 0
+
+    QuirkyStream(int room, size_t perWrite, size_t total):room(room), perWrite(perWrite),
+        total(total) {
+    }
+
+    size_t write(const uint8_t * data, size_t len) {
+        if (len > perWrite)
+            len = perWrite;
+        if (total != 0 && written().size() + len > total)
+            len = total - written().size();
+        return len ? LoopbackStream::write(data, len) : 0;
+    }
+
+    using LoopbackStream::write;
+
+    int availableForWrite() {
+        return room;
+    }
+};
+
+static bool quirkyStreamCheck(const char *name, int room, size_t perWrite, size_t total)
+{
+    QuirkyStream s(room, perWrite, total);
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(256, replyInputHandler);
+    bool nonBlocking = cmri.setNonBlockingTransmit(true);
+    memset(replyModel, 0x41, 32);
+
+    std::vector < uint8_t > expected;
+    LoopbackStream::appendFrame(expected, NODE_ADDR, 'R', replyModel, 33);
+
+    unsigned long rounds = 50, wrong = 0;
+    for (unsigned long r = 0; r < rounds; r++) {
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        for (int c = 0; c < 100 && cmri.check(0, 0); c++)
+            ;
+        if (total == 0 && s.written() != expected)
+            wrong += 1;
+        s.clearWritten();
+    }
+
+    CMRI::Metrics m;
+    cmri.getMetrics(m);
+    unsigned long lost = m.errors[CMRI::ERROR_TRANSMIT];
+
+    bool ok = wrong == 0 && nonBlocking == (room > 0) && lost == (total == 0 ? 0 : rounds);
+    printf("  %-28s %s  %lu of %lu replies wrong, %lu cut short  %s\n", name,
+           nonBlocking ? "non-blocking" : "blocking    ", wrong, rounds, lost, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool turnaroundBenchmarks()
+{
+    printf("RS-485 turnaround at 57600 baud (DE lead before first byte, release after last stop bit)\n");
+
+    bool ok = true;
+    ok &= turnaroundBenchmark("blocking, flush", false, false);
+    ok &= turnaroundBenchmark("non-blocking, flush", true, false);
+    ok &= turnaroundBenchmark("non-blocking, TX idle", true, true);
+
+    printf("non-blocking replies longer than the transmit FIFO\n");
+    ok &= drainBenchmark(false);
+    ok &= drainBenchmark(true);
+
+    printf("streams that are not like HardwareSerial\n");
+    ok &= quirkyStreamCheck("no availableForWrite()", 0, 1000, 0);
+    ok &= quirkyStreamCheck("5 bytes per write()", 0, 5, 0);
+    ok &= quirkyStreamCheck("5 bytes a write, with room", 16, 5, 0);
+    ok &= quirkyStreamCheck("takes 20 bytes, then none", 0, 1000, 20);
+
+    printf("transmit delay requested by 'I'\n");
+    ok &= transmitDelayBenchmark(false);
+    ok &= transmitDelayBenchmark(true);
+    return ok;
+}
+
+
+/*
+ * Run mixed traffic (polls, output changes, frames for other nodes and
+ * some line noise) and print what the metrics make of it
+ */
+
+static void printHistogram(const char *name, const unsigned long *h)
+{
+    printf("  %-14s", name);
+    for (int i = 0; i < CMRI::METRIC_BUCKETS; i++) {
+        if (h[i])
+            printf(" <%luus:%lu", 1ul << i, h[i]);
+    }
+    printf("\n");
+}
+
+static void metricsReport()
+{
+    LoopbackStream s;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(48, benchBulkInputHandler);
+    cmri.setOutputHandler(48, benchOutputHandler, NULL);
+
+    uint8_t data[6] = { 0 };
+    const uint8_t noise[] = { 0x55, 0xFF, 0xFF, 0x41 };
+    unsigned long rounds = 5000 * scale;
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        data[r % 6] ^= 0x11;
+        s.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+        s.injectFrame(NODE_ADDR + 1, 'P', NULL, 0);
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+        if (r % 100 == 0)
+            s.inject(noise, sizeof(noise));
+        while (cmri.check(0, 0)) {
+        }
+        s.clearWritten();
+    }
+
+    CMRI::Metrics m;
+    cmri.getMetrics(m);
+
+    printf("  bytes %lu  frames %lu (processed %lu, skipped %lu, %lu bytes)  max check() %lu us\n",
+           m.bytesSeen, m.framesSeen, m.framesProcessed, m.framesSkipped, m.bytesSkipped,
+           m.maxCheckMicros);
+    printf("  errors:");
+    for (int i = 0; i < CMRI::NUM_ERROR_KINDS; i++)
+        printf(" %s %lu", CMRI::errorKindName(i), m.errors[i]);
+    printf("\n");
+    printHistogram("reply latency", m.replyLatency);
+    printHistogram("handler time", m.handlerTime);
+}
+
+
+/*
+ * Poll latency while the bus is being watched: not at all, with the text
+ * debug stream, and with the binary trace.  Both go to a 115200 baud
+ * port.  Polls come every 2ms, and check() is called in between, as a
+ * sketch's loop() would.
+ */
+
+static void traceBenchmark(int mode)
+{
+    static const char *const names[] = { "no debugging", "debug stream", "trace" };
+    LoopbackStream s, dbg;
+    CMRI cmri(s, NODE);
+    cmri.setInputHandler(48, benchBulkInputHandler);
+    cmri.setOutputHandler(48, benchOutputHandler, NULL);
+    dbg.setLineRate(115200, 64);
+    if (mode == 1)
+        cmri.addDebugStream(&dbg);
+    if (mode == 2)
+        cmri.setTraceStream(&dbg);
+    s.setTimestamps(true);
+
+    uint8_t data[6] = { 0 };
+    const uint8_t noise[] = { 0x55, 0xFF, 0xFF, 0x41 };
+    std::vector < uint64_t > latency;
+    std::vector < uint8_t > capture;
+    unsigned long rounds = 200 * scale;
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        data[r % 6] ^= 0x11;
+        s.injectFrame(NODE_ADDR, 'T', data, sizeof(data));
+        s.injectFrame(NODE_ADDR + 1, 'P', NULL, 0);
+        if (r % 50 == 0)
+            s.inject(noise, sizeof(noise));
+        s.injectFrame(NODE_ADDR, 'P', NULL, 0);
+
+        uint64_t until = hostNanos() + 2000000;
+        while (cmri.check(0, 0) || hostNanos() < until) {
+        }
+
+        latency.push_back(s.firstWriteNanos - s.rxDrainedNanos);
+        s.clearWritten();
+        capture.insert(capture.end(), dbg.written().begin(), dbg.written().end());
+        dbg.clearWritten();
+    }
+
+    std::sort(latency.begin(), latency.end());
+    printf("  %-14s reply latency median %8.1f us  max %8.1f us  %7u bytes of output\n",
+           names[mode], latency[latency.size() / 2] / 1e3, latency.back() / 1e3,
+           (unsigned) capture.size());
+
+    if (mode == 2 && traceFile != NULL) {
+        FILE *f = fopen(traceFile, "wb");
+        if (f != NULL) {
+            fwrite(&capture[0], 1, capture.size(), f);
+            fclose(f);
+        }
+    }
+}
+
+
+/*
+ * A bus master against the 16 nodes of a VirtualBus.
+ *
+ * Two of the nodes have an input that changes every 25ms or so; the rest
+ * change every couple of seconds.  The time from a change to the master
+ * reporting it is measured, with round-robin polling and with adaptive
+ * polling.
+ */
+
+static uint64_t changeNanos[VIRTUAL_NODES], nextChange[VIRTUAL_NODES];
+static bool changePending[VIRTUAL_NODES];
+static std::vector < uint64_t > busyLatency, quietLatency;
+static int nodesOffline;
+
+static bool isBusyNode(int k)
+{
+    return k == 2 || k == 9;
+}
+
+static void masterInputHandler(uint8_t nodeId, uint16_t line, bool isOn)
+{
+    int k = nodeId - 1;
+
+    (void) line;
+    (void) isOn;
+    if (k >= 0 && k < VIRTUAL_NODES && changePending[k]) {
+        uint64_t now = hostNanos(), period = isBusyNode(k) ? 25000000 : 2000000000;
+
+        (isBusyNode(k) ? busyLatency : quietLatency).push_back(now - changeNanos[k]);
+        changePending[k] = false;
+        // the next change comes a while after this one is seen, so that
+        // changes are not in step with the polls
+        nextChange[k] = now + period / 2 + rand() % period;
+    }
+}
+
+static void masterStatusHandler(uint8_t nodeId, bool online)
+{
+    (void) nodeId;
+    nodesOffline += online ? -1 : 1;
+}
+
+static bool masterBenchmark(const char *name, unsigned long minMicros, unsigned long maxMicros,
+                            bool missingNode)
+{
+    VirtualBus bus;
+    CMRIMaster master(bus.master);
+    master.setPollInterval(minMicros, maxMicros);
+    master.setReplyTimeout(10000);
+    master.setInputHandler(masterInputHandler);
+    master.setNodeStatusHandler(masterStatusHandler);
+    bool added = true;
+    for (int k = 0; k < VIRTUAL_NODES; k++)
+        added &= master.addNode(k + 1, 16, 8);
+    if (missingNode)
+        added &= master.addNode(100, 16, 8);
+    if (!added) {
+        printf("  %-12s could not add the nodes  FAILED\n", name);
+        return false;
+    }
+
+    memset(virtualInputs, 0, sizeof(virtualInputs));
+    memset(changePending, 0, sizeof(changePending));
+    busyLatency.clear();
+    quietLatency.clear();
+    nodesOffline = 0;
+    srand(1);
+
+    uint64_t start = hostNanos(), end = start + 2000000000ull * scale;
+    uint64_t nextOutput = start;
+
+    for (int k = 0; k < VIRTUAL_NODES; k++)
+        nextChange[k] = start + 100000000;
+
+    for (uint64_t now = start; now < end; now = hostNanos()) {
+        for (int k = 0; k < VIRTUAL_NODES; k++) {
+            if (!changePending[k] && now >= nextChange[k]) {
+                virtualInputs[k][0] ^= 1;
+                changeNanos[k] = now;
+                changePending[k] = true;
+            }
+        }
+        if (now >= nextOutput) {
+            master.setOutput(1 + rand() % VIRTUAL_NODES, rand() % 8, rand() & 1);
+            nextOutput = now + 50000000;
+        }
+
+        bus.run();
+        master.check();
+    }
+
+    unsigned long polls = 0, busyPolls = 0;
+    for (int k = 0; k < VIRTUAL_NODES; k++) {
+        CMRIMaster::NodeStats st;
+        master.nodeStats(k + 1, st);
+        polls += st.polls;
+        if (isBusyNode(k))
+            busyPolls += st.polls;
+    }
+
+    std::sort(busyLatency.begin(), busyLatency.end());
+    std::sort(quietLatency.begin(), quietLatency.end());
+    if (!missingNode) {
+        printf("  %-12s %5.0f polls/s, %2.0f%% to the busy nodes  busy: median %5.1f ms max %5.1f ms"
+               "  quiet: median %5.1f ms max %5.1f ms\n", name, polls / (2.0 * scale),
+               100.0 * busyPolls / polls, busyLatency[busyLatency.size() / 2] / 1e6,
+               busyLatency.back() / 1e6, quietLatency[quietLatency.size() / 2] / 1e6,
+               quietLatency.back() / 1e6);
+        return true;
+    }
+
+    // the missing node must be the only one offline, and every change seen
+    CMRIMaster::NodeStats missing;
+    master.nodeStats(100, missing);
+    bool ok = nodesOffline == -VIRTUAL_NODES && !missing.online && missing.timeouts > 0;
+    printf("  %-12s %lu timeouts from the missing node, %d of %d virtual nodes online  %s\n",
+           name, missing.timeouts, -nodesOffline, VIRTUAL_NODES, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        scale = strtoul(argv[1], NULL, 0);
+        if (scale == 0)
+            scale = 1;
+    }
+    if (argc > 2)
+        traceFile = argv[2];
+
+    parserBenchmarks();
+    pollBenchmarks();
+    jitterBenchmarks();
+
+    bool ok = turnaroundBenchmarks();
+
+    printf("byte budget with background input scanning\n");
+    ok &= scanBudgetCheck(0);
+    ok &= scanBudgetCheck(1000);
+
+    printf("'R' replies kept and patched, against the reference encoder\n");
+    ok &= replyCacheBenchmarks();
+
+    printf("node configuration from 'I'\n");
+    ok &= initBenchmark();
+
+    printf("output writes, 64 outputs on 8 expander ports, random 'T' frames\n");
+    ok &= portBenchmark();
+
+    printf("receive ring, with a producer thread\n");
+    ok &= ringBenchmarks();
+
+    printf("'T' frames applied at the ETX or as they arrive\n");
+    ok &= streamingBenchmarks();
+
+    printf("two streams, one with a backlog\n");
+    ok &= streamsBenchmark();
+    ok &= streamHandlerCheck();
+
+    printf("output effects, 8 groups blinking on a 512 output node\n");
+    ok &= effectsBenchmark();
+    printf("effect states, with the host writing to the driven lines\n");
+    ok &= effectStateCheck();
+
+    printf("input debouncing, 2 samples, every line glitching\n");
+    ok &= debounceBenchmarks();
+    printf("debounced lines against a model, 1 to 7 samples in ranges of %u lines\n",
+           DEBOUNCE_LINES);
+    ok &= debounceChecks();
+
+    printf("frames for other nodes, with escapes, then one for this node\n");
+    ok &= skipBenchmark("check()", false);
+    ok &= skipBenchmark("feed()", true);
+
+    printf("message handlers and sendMessage()\n");
+    ok &= handlerBenchmark();
+
+    printf("multiple node addresses\n");
+    ok &= multiNodeBenchmark();
+    ok &= badAddressBenchmark();
+
+    printf("capacity (RAM footprint per configuration)\n");
+    ok &= capacityBenchmark();
+    ok &= dirtyStorageBenchmark();
+
+    printf("metrics\n");
+    metricsReport();
+
+    printf("bus master, 16 virtual nodes at 57600 baud (input change to master noticing)\n");
+    masterBenchmark("round-robin", 0, 0, false);
+    masterBenchmark("adaptive", 0, 200000, false);
+    ok &= masterBenchmark("timeouts", 0, 200000, true);
+
+    printf("watching the bus\n");
+    for (int mode = 0; mode < 3; mode++)
+        traceBenchmark(mode);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,720 @@
+/* CMRInet over TCP: a gateway between serial buses and network clients
+ *
+ * JMRI and other C/MRI hosts can talk to a bus over a TCP connection
+ * carrying the same bytes as the serial line.  This gateway accepts any
+ * number of such connections and bridges them to one or more buses, from
+ * a single epoll loop with non-blocking I/O and buffers per connection:
+ *
+ *   cmri_gateway [-p port] [-t timeout] [-v] [-q] [device[:baud[:nodes]] ...]
+ *
+ *   -p port     the TCP port to listen on (default 9007)
+ *   -t ms       how long a bus waits for the reply to a poll (default 100)
+ *   -v          add a virtual bus of 16 simulated nodes (1 to 16), to try
+ *               the gateway out without any hardware
+ *   -q          do not log connections
+ *   device      a serial port, e.g. /dev/ttyUSB0:115200:1,2,5 (the baud
+ *               rate defaults to 57600).  A bus without a list of nodes
+ *               takes every node that no other bus lists.
+ *
+ * Frames from the clients are parsed by the library (a CMRI object in
+ * monitor mode per connection) and queued for the bus of the node they
+ * are addressed to.  A bus sends them in order, and after a poll ('P')
+ * sends nothing more until the node replies or the timeout passes.  The
+ * reply goes back only to the client that sent the poll, so several
+ * clients can share a bus.
+ *
+ * A serial port that fails is closed, and the gateway carries on with
+ * the other buses.  The clients that were waiting on it, and any that
+ * later send to one of its nodes, are disconnected, which is the only
+ * way CMRInet has to tell them.
+ *
+ * On SIGINT or SIGTERM the counters of each bus are printed.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#include "Arduino.h"
+#include "CMRI.h"
+#include "FdStream.h"
+#include "VirtualBus.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// long enough for the 'R' reply of a fully loaded node
+static const uint16_t GATEWAY_MESG_LEN = 256;
+
+// a client that lets this much of its replies pile up is dropped
+static const size_t MAX_CLIENT_BACKLOG = 65536;
+
+// frames waiting for one bus, beyond which more are dropped
+static const size_t MAX_BUS_QUEUE = 1024;
+
+static bool quiet;
+static volatile sig_atomic_t stopping;
+static unsigned long replyTimeoutMicros = 100000;
+
+
+/*
+ * Something in the epoll set
+ */
+
+class Pollable {
+  public:
+    virtual ~Pollable() {
+    }
+    virtual void ready(uint32_t events) = 0;
+};
+
+
+/*
+ * One end of the gateway: a CMRI object in monitor mode, which parses
+ * every frame on its stream and hands it to frame()
+ */
+
+class Port:protected CMRIStatic < GATEWAY_MESG_LEN, 0, 0 > {
+  public:
+    Port(Stream & s):CMRIStatic < GATEWAY_MESG_LEN, 0, 0 > (s, 0) {
+        setMonitorMode(true);
+        for (uint8_t t = 'A'; t <= 'Z'; t++)
+            setMessageHandler(t, frameHandler);
+    }
+
+    virtual void frame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t len) = 0;
+
+    /* parse everything there is to read */
+    void parse() {
+        while (check(0, 0)) {
+        }
+    }
+
+    bool send(uint8_t address, uint8_t type, const uint8_t * data, uint16_t len) {
+        return sendFrame(address, type, data, len);
+    }
+
+    using CMRI::transmitComplete;
+    using CMRI::setNonBlockingTransmit;
+
+  private:
+    static bool frameHandler(CMRI & cmri, uint8_t nodeId, uint8_t type,
+                             const uint8_t * data, uint16_t dataLen) {
+        static_cast < Port & >(cmri).frame(nodeId + 65, type, data, dataLen);
+        return true;
+    }
+};
+
+
+class Client;
+static std::map < unsigned long, Client * >clients;
+static std::vector < Client * >closed;        // freed once the event batch is done
+
+
+/*
+ * A bus: a queue of frames from the clients, sent one at a time, with at
+ * most one poll outstanding
+ */
+
+class Bus:public Port {
+  public:
+    std::string name;
+    std::vector < uint8_t > nodes;      // the addresses listed for it
+
+    unsigned long framesSent, polls, replies, timeouts, strays, dropped;
+
+    Bus(Stream & s, const std::string & name):Port(s), name(name), framesSent(0), polls(0),
+        replies(0), timeouts(0), strays(0), dropped(0), failed(false), awaiting(0), owner(0),
+        pollSent(0) {
+        setNonBlockingTransmit(true);
+    }
+
+    bool failed;                // the port failed, and was closed
+
+    void queue(unsigned long client, uint8_t address, uint8_t type, const uint8_t * data,
+               uint16_t len) {
+        if (requests.size() >= MAX_BUS_QUEUE) {
+            dropped++;
+            return;
+        }
+        requests.push_back(Request());
+        Request & r = requests.back();
+        r.client = client;
+        r.address = address;
+        r.type = type;
+        r.data.assign(data, data + len);
+    }
+
+    /* drop the frames of a client that has gone, which no one would get replies to */
+    void forget(unsigned long client) {
+        for (std::deque < Request >::iterator r = requests.begin(); r != requests.end();) {
+            if (r->client == client)
+                r = requests.erase(r);
+            else
+                ++r;
+        }
+    }
+
+    void fail(const char *why);
+
+    /* time out a poll, and send what can be sent */
+    void service() {
+        if (failed)
+            return;
+
+        parse();
+
+        if (awaiting != 0) {
+            if (!transmitComplete()) {
+                pollSent = micros();
+                return;
+            }
+            if (micros() - pollSent < replyTimeoutMicros)
+                return;
+            timeouts++;
+            awaiting = 0;
+        }
+
+        while (!requests.empty() && transmitComplete()) {
+            Request & r = requests.front();
+            if (!send(r.address, r.type, r.data.empty() ? NULL : &r.data[0], r.data.size()))
+                break;
+            framesSent++;
+            if (r.type == 'P') {
+                polls++;
+                awaiting = r.address;
+                owner = r.client;
+                pollSent = micros();
+            }
+            requests.pop_front();
+            if (awaiting != 0)
+                break;
+        }
+    }
+
+    /*
+     * how long epoll may sleep before this bus needs service(), in
+     * milliseconds (-1 for as long as it likes)
+     */
+    virtual int idleTimeout() {
+        if (failed)
+            return -1;
+        if (awaiting == 0)
+            return requests.empty() ? -1 : 0;
+        unsigned long waited = micros() - pollSent;
+        return waited >= replyTimeoutMicros ? 0 : (replyTimeoutMicros - waited + 999) / 1000;
+    }
+
+    void frame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t len);
+
+  private:
+    struct Request {
+        unsigned long client;
+        uint8_t address;
+        uint8_t type;
+        std::vector < uint8_t > data;
+    };
+
+    std::deque < Request > requests;
+    uint8_t awaiting;           // the address polled, or 0
+    unsigned long owner;        // the client that sent the poll
+    unsigned long pollSent;
+};
+
+static std::vector < Bus * >buses;
+static Bus *busFor[128];        // by node
+
+
+/*
+ * A serial port
+ */
+
+struct FdHolder {
+    FdStream fdStream;
+};
+
+class SerialBus:private FdHolder, public Bus, public Pollable {
+  public:
+    int epollFd;
+
+    SerialBus(int fd, const std::string & name):Bus(fdStream, name), epollFd(-1),
+        wantWrite(false) {
+        fdStream.fd = fd;
+    }
+
+    void ready(uint32_t events) {
+        if (failed)
+            return;
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            errno = 0;
+            if (!fdStream.fill()) {
+                fail(errno ? strerror(errno) : "closed");
+                return;
+            }
+        }
+        service();
+        flushOut();
+    }
+
+    /*
+     * hand the port what the bus has written, and while some of it has
+     * to wait, have epoll say when there is room
+     */
+    void flushOut() {
+        if (failed)
+            return;
+        if (!fdStream.flushOut()) {
+            fail(strerror(errno));
+            return;
+        }
+
+        bool want = fdStream.pendingOut() > 0;
+        if (want != wantWrite) {
+            struct epoll_event ev;
+            ev.events = want ? (uint32_t) (EPOLLIN | EPOLLOUT) : (uint32_t) EPOLLIN;
+            ev.data.ptr = static_cast < Pollable * >(this);
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, fdStream.fd, &ev);
+            wantWrite = want;
+        }
+    }
+
+    int fd() {
+        return fdStream.fd;
+    }
+
+  private:
+    bool wantWrite;
+
+    /* close the port; the bus stays, failed */
+    void fail(const char *why) {
+        if (failed)
+            return;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fdStream.fd, NULL);
+        ::close(fdStream.fd);
+        Bus::fail(why);
+    }
+};
+
+
+/*
+ * The virtual bus of -v.  Its nodes only run when run() is called, so
+ * while anything is on its wire the event loop does not sleep.
+ */
+
+class SimulatedBus:private VirtualBus, public Bus {
+  public:
+    SimulatedBus():Bus(master, "virtual") {
+        for (int k = 0; k < VIRTUAL_NODES; k++) {
+            virtualInputs[k][0] = k + 1;
+            virtualInputs[k][1] = 0x80 | k;
+            nodes.push_back(k + 1 + 65);
+        }
+    }
+
+    void run() {
+        VirtualBus::run();
+        service();
+    }
+
+    int idleTimeout() {
+        return idle() && transmitComplete()? Bus::idleTimeout() : 0;
+    }
+};
+
+
+/*
+ * A TCP connection
+ */
+
+class Client:private FdHolder, public Port, public Pollable {
+  public:
+    unsigned long id;
+    int epollFd;
+    bool dead;                  // disconnected, but the batch may still name it
+
+    Client(int fd, unsigned long id, int epollFd):Port(fdStream), id(id), epollFd(epollFd),
+        dead(false), wantWrite(false) {
+        fdStream.fd = fd;
+    }
+
+    ~Client() {
+        close(fdStream.fd);
+    }
+
+    void ready(uint32_t events) {
+        if (dead)
+            return;
+        if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !fdStream.fill()) {
+            disconnect("closed");
+            return;
+        }
+        parse();
+        if ((events & EPOLLOUT) || fdStream.pendingOut() > 0)
+            flushOut();
+    }
+
+    /* a reply to one of this client's polls */
+    void reply(uint8_t address, uint8_t type, const uint8_t * data, uint16_t len) {
+        send(address, type, data, len);
+        if (fdStream.pendingOut() > MAX_CLIENT_BACKLOG)
+            disconnect("not reading");
+        else
+            flushOut();
+    }
+
+    void frame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t len) {
+        Bus *bus = address >= 65 && address < 65 + 128 ? busFor[address - 65] : NULL;
+
+        if (dead || bus == NULL)
+            return;
+        if (bus->failed)
+            disconnect(("sent to " + bus->name + ", which has failed").c_str());
+        else
+            bus->queue(id, address, type, data, len);
+    }
+
+    /*
+     * This can be called from inside another Pollable's ready() (a bus
+     * handing over a reply), while events for this client may still be
+     * waiting further on in the same batch.  So the client is only freed
+     * once the batch is done.
+     */
+    void disconnect(const char *why) {
+        if (dead)
+            return;
+        if (!quiet)
+            fprintf(stderr, "client %lu %s\n", id, why);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fdStream.fd, NULL);
+        clients.erase(id);
+        dead = true;
+        closed.push_back(this);
+    }
+
+  private:
+    bool wantWrite;
+
+    void flushOut() {
+        if (!fdStream.flushOut()) {
+            disconnect("write failed");
+            return;
+        }
+
+        // only ask for EPOLLOUT while there is something waiting to go
+        bool want = fdStream.pendingOut() > 0;
+        if (want != wantWrite) {
+            struct epoll_event ev;
+            ev.events = want ? (uint32_t) (EPOLLIN | EPOLLOUT) : (uint32_t) EPOLLIN;
+            ev.data.ptr = static_cast < Pollable * >(this);
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, fdStream.fd, &ev);
+            wantWrite = want;
+        }
+    }
+};
+
+
+/*
+ * The bus has failed: nothing more is sent on it, and the clients with
+ * frames for it, or a poll outstanding on it, are disconnected
+ */
+void Bus::fail(const char *why)
+{
+    fprintf(stderr, "%s: %s, bus closed\n", name.c_str(), why);
+    failed = true;
+
+    std::vector < unsigned long >waiting;
+    if (awaiting != 0)
+        waiting.push_back(owner);
+    for (size_t i = 0; i < requests.size(); i++)
+        waiting.push_back(requests[i].client);
+    requests.clear();
+    awaiting = 0;
+
+    std::string reason = "lost " + name;
+    for (size_t i = 0; i < waiting.size(); i++) {
+        std::map < unsigned long, Client * >::iterator c = clients.find(waiting[i]);
+        if (c != clients.end())
+            c->second->disconnect(reason.c_str());
+    }
+}
+
+
+void Bus::frame(uint8_t address, uint8_t type, const uint8_t * data, uint16_t len)
+{
+    if (type != 'R')
+        return;                 // our own frames, echoed by the bus adapter
+
+    if (awaiting != address) {
+        strays++;
+        return;
+    }
+
+    awaiting = 0;
+    replies++;
+
+    std::map < unsigned long, Client * >::iterator c = clients.find(owner);
+    if (c != clients.end())
+        c->second->reply(address, type, data, len);
+}
+
+
+/*
+ * The listening socket
+ */
+
+class Listener:public Pollable {
+  public:
+    Listener(int fd, int epollFd):fd(fd), epollFd(epollFd), nextId(1) {
+    }
+
+    void ready(uint32_t events) {
+        (void) events;
+        for (;;) {
+            struct sockaddr_in from;
+            socklen_t fromLen = sizeof(from);
+            int c = accept(fd, (struct sockaddr *) &from, &fromLen);
+            if (c < 0)
+                return;
+
+            int one = 1;
+            setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            FdStream::setNonBlocking(c);
+
+            Client *client = new Client(c, nextId++, epollFd);
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = static_cast < Pollable * >(client);
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, c, &ev);
+            clients[client->id] = client;
+
+            if (!quiet)
+                fprintf(stderr, "client %lu from %s:%u\n", client->id, inet_ntoa(from.sin_addr),
+                        ntohs(from.sin_port));
+        }
+    }
+
+  private:
+    int fd;
+    int epollFd;
+    unsigned long nextId;
+};
+
+
+static speed_t baudRate(unsigned long baud)
+{
+    switch (baud) {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    }
+    return B0;
+}
+
+/* open device[:baud[:nodes]] */
+static SerialBus *openSerialBus(const char *spec)
+{
+    std::string s(spec), device = s.substr(0, s.find(':'));
+    unsigned long baud = 57600;
+    std::vector < uint8_t > nodes;
+
+    size_t colon = s.find(':');
+    if (colon != std::string::npos) {
+        const char *p = s.c_str() + colon + 1;
+        char *end;
+        baud = strtoul(p, &end, 10);
+        if (*end == ':') {
+            for (p = end + 1; *p;) {
+                unsigned long n = strtoul(p, &end, 10);
+                if (end == p || n > 127)
+                    break;
+                nodes.push_back(n + 65);
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+    }
+
+    speed_t speed = baudRate(baud);
+    if (speed == B0) {
+        fprintf(stderr, "%s: unsupported baud rate %lu\n", device.c_str(), baud);
+        return NULL;
+    }
+
+    int fd = open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    struct termios tio;
+    if (fd < 0 || tcgetattr(fd, &tio) != 0) {
+        perror(device.c_str());
+        return NULL;
+    }
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+
+    SerialBus *bus = new SerialBus(fd, device);
+    bus->nodes = nodes;
+    return bus;
+}
+
+
+static void stop(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: cmri_gateway [-p port] [-t ms] [-v] [-q] [device[:baud[:nodes]] ...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int port = 9007;
+    bool virtualBus = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:t:vq")) != -1) {
+        switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            replyTimeoutMicros = strtoul(optarg, NULL, 0) * 1000;
+            break;
+        case 'v':
+            virtualBus = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    int epollFd = epoll_create1(0);
+    std::vector < SerialBus * >serialBuses;
+    SimulatedBus *simulated = NULL;
+
+    for (int i = optind; i < argc; i++) {
+        SerialBus *bus = openSerialBus(argv[i]);
+        if (bus == NULL)
+            return 1;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = static_cast < Pollable * >(bus);
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, bus->fd(), &ev);
+        bus->epollFd = epollFd;
+        serialBuses.push_back(bus);
+        buses.push_back(bus);
+    }
+    if (virtualBus) {
+        simulated = new SimulatedBus();
+        buses.push_back(simulated);
+    }
+    if (buses.empty())
+        usage();
+
+    // listed nodes first, then the rest to the first bus without a list
+    for (size_t b = 0; b < buses.size(); b++) {
+        for (size_t k = 0; k < buses[b]->nodes.size(); k++)
+            busFor[buses[b]->nodes[k] - 65] = buses[b];
+    }
+    for (size_t b = 0; b < buses.size(); b++) {
+        if (buses[b]->nodes.empty()) {
+            for (int n = 0; n < 128; n++) {
+                if (busFor[n] == NULL)
+                    busFor[n] = buses[b];
+            }
+            break;
+        }
+    }
+
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0) {
+        perror("listen");
+        return 1;
+    }
+    FdStream::setNonBlocking(listenFd);
+
+    Listener listener(listenFd, epollFd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = static_cast < Pollable * >(&listener);
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    if (!quiet)
+        fprintf(stderr, "listening on port %d, %u buses\n", port, (unsigned) buses.size());
+
+    while (!stopping) {
+        int timeout = -1;
+        for (size_t b = 0; b < buses.size(); b++) {
+            int t = buses[b]->idleTimeout();
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
+        }
+
+        struct epoll_event events[64];
+        int n = epoll_wait(epollFd, events, 64, timeout);
+
+        for (int i = 0; i < n; i++)
+            static_cast < Pollable * >(events[i].data.ptr)->ready(events[i].events);
+
+        // the clients' frames are queued by now; send them
+        if (simulated)
+            simulated->run();
+        for (size_t b = 0; b < serialBuses.size(); b++) {
+            serialBuses[b]->service();
+            serialBuses[b]->flushOut();
+        }
+
+        for (size_t c = 0; c < closed.size(); c++) {
+            for (size_t b = 0; b < buses.size(); b++)
+                buses[b]->forget(closed[c]->id);
+            delete closed[c];
+        }
+        closed.clear();
+    }
+
+    for (size_t b = 0; b < buses.size(); b++) {
+        Bus & bus = *buses[b];
+        fprintf(stderr, "%s: %lu frames sent, %lu polls, %lu replies, %lu timeouts, "
+                "%lu stray replies, %lu frames dropped\n", bus.name.c_str(), bus.framesSent,
+                bus.polls, bus.replies, bus.timeouts, bus.strays, bus.dropped);
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+/* Exercise cmri_gateway over loopback TCP
+ *
+ * Connects several bus masters (CMRIMaster objects, each on its own TCP
+ * connection) to a gateway running with its virtual bus, and has each
+ * poll all 16 virtual nodes as fast as it can while sending them output
+ * changes.  Then it checks that every client saw every node online, with
+ * the inputs the virtual nodes report, no timeouts, and no replies to
+ * polls it did not send:
+ *
+ *   cmri_gateway -v -p 9007 &
+ *   cmri_gwclient [-p port] [-c clients] [-s seconds]
+ *
+ * The exit status is 0 if all is well.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#include "Arduino.h"
+#include "CMRIMaster.h"
+#include "FdStream.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <vector>
+
+// the virtual bus of cmri_gateway -v
+static const int NODES = 16;
+
+static int connectTo(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    // give the gateway a moment to start listening
+    for (int tries = 0; connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0; tries++) {
+        if (tries == 50) {
+            perror("connect");
+            exit(1);
+        }
+        delay(20);
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    FdStream::setNonBlocking(fd);
+    return fd;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: cmri_gwclient [-p port] [-c clients] [-s seconds]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int port = 9007, numClients = 4, seconds = 2;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:c:s:")) != -1) {
+        switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            numClients = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (numClients < 1 || seconds < 1)
+        usage();
+
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector < FdStream * >streams;
+    std::vector < CMRIMaster * >masters;
+
+    for (int k = 0; k < numClients; k++) {
+        FdStream *s = new FdStream(connectTo(port));
+        CMRIMaster *m = new CMRIMaster(*s);
+
+        // polls wait in the gateway's queue behind the other clients'
+        m->setPollInterval(0, 0);
+        m->setReplyTimeout(500000);
+        for (int n = 1; n <= NODES; n++)
+            m->addNode(n, 16, 8);
+        streams.push_back(s);
+        masters.push_back(m);
+    }
+
+    uint64_t start = hostNanos(), end = start + 1000000000ull * seconds, nextOutput = start;
+    srand(1);
+
+    std::vector < struct pollfd >fds(numClients);
+    for (int k = 0; k < numClients; k++) {
+        fds[k].fd = streams[k]->fd;
+        fds[k].events = POLLIN;
+    }
+
+    while (hostNanos() < end) {
+        // sleep until a reply comes (or a millisecond passes), leaving the
+        // processor to the gateway
+        poll(&fds[0], numClients, 1);
+
+        if (hostNanos() >= nextOutput) {
+            masters[rand() % numClients]->setOutput(1 + rand() % NODES, rand() % 8, rand() & 1);
+            nextOutput += 10000000;
+        }
+        for (int k = 0; k < numClients; k++) {
+            if (!streams[k]->fill() || !streams[k]->flushOut()) {
+                fprintf(stderr, "client %d: connection lost\n", k);
+                return 1;
+            }
+            masters[k]->check();
+        }
+    }
+
+    bool ok = true;
+    unsigned long total = 0;
+
+    for (int k = 0; k < numClients; k++) {
+        unsigned long polls = 0, timeouts = 0, extra = 0, wrong = 0, offline = 0;
+
+        for (int n = 1; n <= NODES; n++) {
+            CMRIMaster::NodeStats st;
+            masters[k]->nodeStats(n, st);
+            polls += st.polls;
+            timeouts += st.timeouts;
+            if (st.replies > st.polls)
+                extra += st.replies - st.polls;
+            if (!st.online)
+                offline++;
+
+            // what the gateway's virtual nodes report
+            uint16_t expected = n | (0x80 | (n - 1)) << 8;
+            for (int line = 0; line < 16; line++) {
+                if (masters[k]->input(n, line) != ((expected >> line) & 1))
+                    wrong++;
+            }
+        }
+
+        bool clientOk = timeouts == 0 && extra == 0 && wrong == 0 && offline == 0;
+        printf("  client %d  %5.0f polls/s, %5.2f ms per poll  %lu timeouts, %lu replies not asked for,"
+               " %lu wrong inputs, %lu nodes offline  %s\n", k, polls / (double) seconds,
+               polls ? seconds * 1e3 / polls : 0.0, timeouts, extra, wrong, offline,
+               clientOk ? "ok" : "FAILED");
+        ok &= clientOk;
+        total += polls;
+    }
+
+    printf("  %d clients, %.0f polls/s in all\n", numClients, total / (double) seconds);
+    return ok ? 0 : 1;
+}
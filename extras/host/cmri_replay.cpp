@@ -0,0 +1,389 @@
+/* Replay a bus capture through the CMRI library
+ *
+ * Plays the bytes received in a capture (see CMRICapture.h) into a CMRI
+ * object, as fast as possible or at the pace they were recorded, and
+ * prints the output handler calls and replies that result, followed by
+ * the counters.  That output does not depend on timing, so two builds of
+ * the library can be compared by running the same capture through each
+ * and diffing.  Throughput and the timing metrics go to standard error.
+ *
+ *   cmri_replay [options] capture
+ *
+ *   -n node     the node to be (default 5)
+ *   -i inputs   its number of input lines (default 24)
+ *   -o outputs  its number of output lines (default 48)
+ *   -r          replay in recorded real time
+ *   -f          hand the bytes to feed() rather than reading them in check()
+ *   -q          print only the counters
+ *   -w file     capture the replay itself (replies included) to file
+ *
+ *   cmri_replay -g capture [polls]
+ *
+ * makes a synthetic capture of a bus with several nodes, for trying
+ * things out.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#include "Arduino.h"
+#include "CMRI.h"
+#include "CMRICapture.h"
+#include "LoopbackStream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+static bool quiet;
+static uint32_t firstMicros, recordMicros;     // timeline of the capture
+
+static void stamp()
+{
+    printf("%12.6f ", (uint32_t) (recordMicros - firstMicros) / 1e6);
+}
+
+
+/*
+ * handlers: inputs follow a fixed pattern, so that the replies are the
+ * same from one run to the next
+ */
+
+static uint16_t polls;
+
+static bool replayInputHandler(uint16_t line)
+{
+    return (line + polls) % 3 == 0;
+}
+
+static void replayOutputHandler(uint16_t line, bool isOn)
+{
+    if (!quiet) {
+        stamp();
+        printf("output %u %s\n", line, isOn ? "on" : "off");
+    }
+}
+
+static bool replayInitHandler(uint8_t * data, int dataLen)
+{
+    if (!quiet) {
+        stamp();
+        printf("init  ");
+        for (int i = 0; i < dataLen; i++)
+            printf(" %02X", data[i]);
+        printf("\n");
+    }
+    return true;
+}
+
+
+/*
+ * print the frames the node wrote, unescaped
+ */
+
+static void printReplies(const std::vector < uint8_t > &w)
+{
+    size_t i = 0;
+
+    while (i + 5 < w.size()) {
+        if (w[i] != 0xFF || w[i + 1] != 0xFF || w[i + 2] != 0x02) {
+            i++;
+            continue;
+        }
+
+        uint8_t addr = w[i + 3], type = w[i + 4];
+        if (type == 'R')
+            polls++;
+
+        stamp();
+        printf("reply  node %d '%c'", addr - 65, type);
+        for (i += 5; i < w.size() && w[i] != 0x03; i++) {
+            if (w[i] == 0x10 && i + 1 < w.size())
+                i++;
+            printf(" %02X", w[i]);
+        }
+        printf("\n");
+        i++;
+    }
+}
+
+
+/*
+ * a synthetic bus: a host initializing, then polling and sending
+ * outputs to several nodes, which answer, with some line noise
+ */
+
+static void appendRecord(std::vector < uint8_t > &f, uint32_t when, bool written,
+                         const std::vector < uint8_t > &data)
+{
+    uint16_t field = data.size() | (written ? CMRICapture::WRITTEN : 0);
+    uint8_t header[6] = {
+        (uint8_t) when, (uint8_t) (when >> 8), (uint8_t) (when >> 16), (uint8_t) (when >> 24),
+        (uint8_t) field, (uint8_t) (field >> 8)
+    };
+
+    f.insert(f.end(), header, header + 6);
+    f.insert(f.end(), data.begin(), data.end());
+}
+
+static int generate(const char *file, unsigned long rounds)
+{
+    static const uint8_t nodes[] = { 0, 1, 5, 12, 30 };
+    const uint32_t charMicros = 174;    // 57600 baud
+    std::vector < uint8_t > f(8);
+    uint32_t now = 1000;
+
+    memcpy(&f[0], "CMRICAP1", 8);
+    srand(1);
+
+    for (size_t n = 0; n < sizeof(nodes); n++) {
+        const uint8_t init[] = { 'M', 0, 0, 0 };
+        std::vector < uint8_t > frame;
+        LoopbackStream::appendFrame(frame, 65 + nodes[n], 'I', init, sizeof(init));
+        appendRecord(f, now, false, frame);
+        now += frame.size() * charMicros + 500;
+    }
+
+    uint8_t outputs[sizeof(nodes)][6] = { {0} };
+
+    for (unsigned long r = 0; r < rounds; r++) {
+        for (size_t n = 0; n < sizeof(nodes); n++) {
+            std::vector < uint8_t > frame;
+            uint8_t addr = 65 + nodes[n];
+
+            if (rand() % 4 == 0) {
+                outputs[n][rand() % 6] ^= 1 << (rand() % 8);
+                LoopbackStream::appendFrame(frame, addr, 'T', outputs[n], 6);
+                appendRecord(f, now, false, frame);
+                now += frame.size() * charMicros + 200;
+                frame.clear();
+            }
+
+            LoopbackStream::appendFrame(frame, addr, 'P', NULL, 0);
+            appendRecord(f, now, false, frame);
+            now += frame.size() * charMicros + 300;
+            frame.clear();
+
+            // every node hears the other nodes' replies
+            const uint8_t in[3] = { (uint8_t) rand(), 0x02, (uint8_t) r };
+            LoopbackStream::appendFrame(frame, addr, 'R', in, 3);
+            appendRecord(f, now, false, frame);
+            now += frame.size() * charMicros + 300;
+
+            if (rand() % 200 == 0) {
+                std::vector < uint8_t > noise(1 + rand() % 4);
+                for (size_t i = 0; i < noise.size(); i++)
+                    noise[i] = rand();
+                appendRecord(f, now, false, noise);
+                now += noise.size() * charMicros;
+            }
+        }
+    }
+
+    FILE *out = fopen(file, "wb");
+    if (out == NULL) {
+        perror(file);
+        return 1;
+    }
+    fwrite(&f[0], 1, f.size(), out);
+    fclose(out);
+    fprintf(stderr, "%lu polls, %u bytes\n", rounds * sizeof(nodes), (unsigned) f.size());
+    return 0;
+}
+
+
+/*
+ * capture to a file, for -w
+ */
+
+class FilePrint:public Print {
+  public:
+    FilePrint(FILE * f):f(f) {
+    }
+    size_t write(uint8_t b) {
+        return fputc(b, f) == EOF ? 0 : 1;
+    }
+    size_t write(const uint8_t * data, size_t len) {
+        return fwrite(data, 1, len, f);
+    }
+  private:
+    FILE * f;
+};
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: cmri_replay [-n node] [-i inputs] [-o outputs] [-r] [-f] [-q] "
+            "[-w file] capture\n" "       cmri_replay -g capture [polls]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int node = 5, numInputs = 24, numOutputs = 48;
+    bool realTime = false, useFeed = false;
+    const char *generateFile = NULL, *writeFile = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:i:o:rfqw:g:")) != -1) {
+        switch (c) {
+        case 'n':
+            node = atoi(optarg);
+            break;
+        case 'i':
+            numInputs = atoi(optarg);
+            break;
+        case 'o':
+            numOutputs = atoi(optarg);
+            break;
+        case 'r':
+            realTime = true;
+            break;
+        case 'f':
+            useFeed = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'w':
+            writeFile = optarg;
+            break;
+        case 'g':
+            generateFile = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (generateFile)
+        return generate(generateFile, optind < argc ? strtoul(argv[optind], NULL, 0) : 1000);
+    if (optind >= argc)
+        usage();
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (in == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    std::vector < uint8_t > cap;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+        cap.insert(cap.end(), chunk, chunk + n);
+    fclose(in);
+
+    if (cap.size() < 8 || memcmp(&cap[0], "CMRICAP1", 8) != 0) {
+        fprintf(stderr, "%s: not a CMRI capture\n", argv[optind]);
+        return 1;
+    }
+
+    LoopbackStream s;
+    FILE *wf = NULL;
+    FilePrint *wp = NULL;
+    CMRICapture *recorder = NULL;
+    if (writeFile) {
+        wf = fopen(writeFile, "wb");
+        if (wf == NULL) {
+            perror(writeFile);
+            return 1;
+        }
+        wp = new FilePrint(wf);
+        recorder = new CMRICapture(s, *wp);
+        recorder->begin();
+    }
+
+    CMRI cmri(recorder ? (Stream &) * recorder : (Stream &) s, node);
+    cmri.setInitHandler(replayInitHandler);
+    cmri.setInputHandler(numInputs, replayInputHandler);
+    cmri.setOutputHandler(numOutputs, replayOutputHandler, NULL);
+
+    unsigned long bytes = 0, records = 0;
+    uint64_t busyNanos = 0, start = hostNanos();
+    bool first = true;
+
+    for (size_t i = 8; i + 6 <= cap.size();) {
+        const uint8_t *h = &cap[i];
+        uint32_t when = h[0] | h[1] << 8 | h[2] << 16 | (uint32_t) h[3] << 24;
+        uint16_t field = h[4] | h[5] << 8;
+        uint16_t len = field & ~CMRICapture::WRITTEN;
+
+        i += 6;
+        if (i + len > cap.size())
+            break;
+        const uint8_t *data = &cap[i];
+        i += len;
+
+        if (first) {
+            firstMicros = when;
+            first = false;
+        }
+        recordMicros = when;
+
+        // the node's own writes in the capture are what it said then;
+        // what it says now is printed instead
+        if (field & CMRICapture::WRITTEN)
+            continue;
+
+        if (realTime) {
+            uint64_t due = start + (uint64_t) (uint32_t) (when - firstMicros) * 1000;
+            while (hostNanos() < due)
+                cmri.check(0, 0);
+        }
+
+        uint64_t t0 = hostNanos();
+        if (useFeed) {
+            size_t used = 0;
+            while (used < len) {
+                used += cmri.feed(data + used, len - used);
+                cmri.check(0, 0);
+            }
+            while (cmri.check(0, 0)) {
+            }
+        } else {
+            s.inject(data, len);
+            while (cmri.check(0, 0)) {
+            }
+        }
+        busyNanos += hostNanos() - t0;
+
+        bytes += len;
+        records += 1;
+
+        if (!s.written().empty()) {
+            if (!quiet)
+                printReplies(s.written());
+            s.clearWritten();
+        }
+    }
+
+    CMRI::Metrics m;
+    cmri.getMetrics(m);
+
+    printf("bytes %lu  frames %lu  processed %lu  skipped %lu (%lu bytes)  errors",
+           m.bytesSeen, m.framesSeen, m.framesProcessed, m.framesSkipped, m.bytesSkipped);
+    for (int k = 0; k < CMRI::NUM_ERROR_KINDS; k++)
+        printf(" %s %lu", CMRI::errorKindName(k), m.errors[k]);
+    printf("\n");
+
+    fprintf(stderr, "%lu records, %lu bytes, %.1f s of bus time in %.3f s (%.1f MB/s while busy)"
+            "  max check() %lu us\n", records, bytes, (uint32_t) (recordMicros - firstMicros) / 1e6,
+            (hostNanos() - start) / 1e9, busyNanos ? bytes * 1e3 / busyNanos : 0.0,
+            m.maxCheckMicros);
+    fprintf(stderr, "reply latency (us):");
+    for (int k = 0; k < CMRI::METRIC_BUCKETS; k++)
+        if (m.replyLatency[k])
+            fprintf(stderr, " <%lu:%lu", 1ul << k, m.replyLatency[k]);
+    fprintf(stderr, "\n");
+
+    if (recorder) {
+        recorder->flushCapture();
+        fclose(wf);
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/* Decoder for the binary trace written by CMRI::setTraceStream()
+ *
+ * Reads a capture of the trace stream (from a file, or standard input)
+ * and prints one line per event:
+ *
+ *   cmri_trace capture.bin
+ *
+ * Records are found by their sync byte, so a capture that starts in the
+ * middle of a record, or has other output mixed in, still decodes.
+ *
+ * This work is licensed under the Creative Commons Attribution-ShareAlike
+ * 4.0 International License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-sa/4.0/deed.en_US.
+ *
+ * You may use this work for any purposes, provided that you make your
+ * version available to anyone else.
+ */
+
+#include "Arduino.h"
+#include "CMRI.h"
+
+#include <stdio.h>
+#include <vector>
+
+// the parser states, in the order of CMRI::cmriStreamState
+static const char *const stateNames[] = {
+    "START", "ATTN_NEXT", "STX_NEXT", "ADDR_NEXT", "TYPE_NEXT",
+    "MAYBE_DATA_NEXT", "DATA_NEXT", "SKIP_NEXT", "SKIP_ESCAPED_NEXT"
+};
+
+static const char *stateName(uint8_t s)
+{
+    return s < sizeof(stateNames) / sizeof(stateNames[0]) ? stateNames[s] : "?";
+}
+
+static void printType(uint8_t type)
+{
+    if (type >= 0x20 && type < 0x7F)
+        printf("'%c'", type);
+    else
+        printf("0x%02X", type);
+}
+
+static void printEvent(const uint8_t * r)
+{
+    uint8_t a = r[1], b = r[2], c = r[3];
+
+    switch (r[0]) {
+    case CMRI::TRACE_STATE:
+        printf("state   %s -> %s on 0x%02X", stateName(a), stateName(b), c);
+        break;
+    case CMRI::TRACE_FRAME:
+    case CMRI::TRACE_SKIP:
+    case CMRI::TRACE_REPLY:
+        printf("%-7s node %3d ", r[0] == CMRI::TRACE_FRAME ? "frame" :
+               r[0] == CMRI::TRACE_SKIP ? "skip" : "reply", a - 65);
+        printType(b);
+        printf(" %u%s %s", c, c == 255 ? "+" : "", r[0] == CMRI::TRACE_SKIP ? "bytes" : "data bytes");
+        break;
+    case CMRI::TRACE_ERROR:
+        printf("error   %s in %s", CMRI::errorKindName(a), stateName(b));
+        break;
+    case CMRI::TRACE_DROPPED:
+        printf("dropped %u events (trace buffer full)", a | b << 8);
+        break;
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f = stdin;
+
+    if (argc > 1) {
+        f = fopen(argv[1], "rb");
+        if (f == NULL) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    std::vector < uint8_t > in;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        in.insert(in.end(), chunk, chunk + n);
+
+    const size_t len = CMRI::TRACE_RECORD_LEN + 1;
+    unsigned long junk = 0, events = 0;
+    uint32_t first = 0, last = 0;
+
+    for (size_t i = 0; i < in.size();) {
+        if (i + len > in.size() || in[i] != CMRI::TRACE_SYNC || in[i + 1] == 0
+            || in[i + 1] >= CMRI::NUM_TRACE_EVENTS) {
+            junk++;
+            i++;
+            continue;
+        }
+
+        const uint8_t *r = &in[i + 1];
+        uint32_t t = r[4] | r[5] << 8 | r[6] << 16 | (uint32_t) r[7] << 24;
+        if (events == 0)
+            first = last = t;
+
+        printf("%12.3f ms %+9ld us  ", (uint32_t) (t - first) / 1e3, (long) (uint32_t) (t - last));
+        printEvent(r);
+
+        last = t;
+        events++;
+        i += len;
+    }
+
+    fprintf(stderr, "%lu events, %lu bytes not part of any event\n", events, junk);
+    return 0;
+}